@@ -0,0 +1,473 @@
+#include "AsyncEngine.h"
+#include "CompiledSQL.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <deque>
+#include <list>
+
+namespace server {
+namespace mysqldb {
+
+static uint64_t nowMs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+struct AsyncEngine::Job {
+	enum State {
+		WAITING,	//for an idle connection
+		CONNECTING,
+		QUERYING,
+		STORING,
+		COMMITTING,
+	};
+
+	Job(const std::string &db, Callback *cb, const char *text)
+	: dbname(db), callback(cb), sql(text), has_params(false), source(NULL), probe(false), ticket(0), conn(NULL),
+	  state(WAITING), fd(-1), reused(false), delivered(false), deadline(0) {}
+
+	std::string dbname;
+	Callback *callback;
+	std::string sql;
+	bool has_params;
+	ParamCopy params;
+	std::promise<int> promise;
+
+	Source *source;
+	bool probe;		//let through an open breaker, its connect is reported by probed()
+	uint32_t ticket;	//of the probe, from admit()
+	Connection *conn;
+	std::list<Job *>::iterator pos;	//in Loop::active while conn is held
+	State state;
+	int fd;			//registered with the loop's epoll set, -1 if not
+	bool reused;		//conn was connected before, it may have gone stale in the pool
+	bool delivered;		//the callback got the result
+	std::string text;
+	uint64_t deadline;
+};
+
+struct AsyncEngine::Loop {
+	AsyncEngine *engine;
+	pthread_t thread;
+	int epfd;
+	int wakefd;
+	pthread_mutex_t lock;
+	std::deque<Job *> inbox;
+	bool stopping;
+	bool joined;
+
+	//only touched by the loop's own thread
+	std::deque<Job *> waiting;
+	std::list<Job *> active;
+};
+
+/* AsyncEngine */
+AsyncEngine::AsyncEngine(unsigned int threads): next_(0), connect_timeout_(3), read_timeout_(30) {
+	if (threads == 0)
+		threads = 1;
+
+	for (unsigned int i = 0; i < threads; ++i) {
+		Loop *loop = new Loop;
+		loop->engine = this;
+		loop->stopping = false;
+		loop->joined = false;
+		pthread_mutex_init(&loop->lock, NULL);
+		loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+		loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		assert(loop->epfd >= 0 && loop->wakefd >= 0);
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev);
+
+		pthread_create(&loop->thread, NULL, run, loop);
+		loops_.push_back(loop);
+	}
+}
+
+AsyncEngine::~AsyncEngine() {
+	stop();
+	for (std::vector<Loop *>::iterator it = loops_.begin(); it != loops_.end(); ++it) {
+		::close((*it)->epfd);
+		::close((*it)->wakefd);
+		pthread_mutex_destroy(&(*it)->lock);
+		delete *it;
+	}
+}
+
+void AsyncEngine::stop() {
+	for (std::vector<Loop *>::iterator it = loops_.begin(); it != loops_.end(); ++it) {
+		Loop *loop = *it;
+		pthread_mutex_lock(&loop->lock);
+		bool joined = loop->joined;
+		loop->stopping = true;
+		loop->joined = true;
+		pthread_mutex_unlock(&loop->lock);
+		if (joined)
+			continue;
+
+		uint64_t one = 1;
+		if (write(loop->wakefd, &one, sizeof(one)) < 0) {
+			//the counter is non-zero already, the loop will wake up anyway
+		}
+		pthread_join(loop->thread, NULL);
+	}
+}
+
+std::future<int> AsyncEngine::submit(const std::string &dbname, Callback *callback, const char *sql,
+                                     const ParamList *args) {
+	Job *job = new Job(dbname, callback, sql);
+	if (args != NULL) {
+		job->has_params = true;
+		job->params.assign(*args);
+	}
+	std::future<int> result = job->promise.get_future();
+
+	Loop *loop = loops_[next_++ % loops_.size()];
+	pthread_mutex_lock(&loop->lock);
+	bool stopping = loop->stopping;
+	if (!stopping)
+		loop->inbox.push_back(job);
+	pthread_mutex_unlock(&loop->lock);
+
+	if (stopping) {
+		if (callback)
+			callback->onException(Exception(-1, "async engine stopped"));
+		job->promise.set_value(-1);
+		delete job;
+		return result;
+	}
+
+	uint64_t one = 1;
+	if (write(loop->wakefd, &one, sizeof(one)) < 0) {
+		//the counter is non-zero already, the loop will wake up anyway
+	}
+	return result;
+}
+
+void *AsyncEngine::run(void *arg) {
+	Loop *loop = (Loop *) arg;
+	AsyncEngine *engine = loop->engine;
+	struct epoll_event events[64];
+#ifdef LINUX
+	mysql_thread_init();
+#endif
+
+	for (;;) {
+		pthread_mutex_lock(&loop->lock);
+		bool stopping = loop->stopping;
+		loop->waiting.insert(loop->waiting.end(), loop->inbox.begin(), loop->inbox.end());
+		loop->inbox.clear();
+		pthread_mutex_unlock(&loop->lock);
+		if (stopping)
+			break;
+
+		engine->dispatch(loop);
+
+		//connections released by other threads are not signalled, poll
+		//faster while statements wait for one
+		int n = epoll_wait(loop->epfd, events, 64, loop->waiting.empty() ? 100 : 5);
+		for (int i = 0; i < n; ++i) {
+			Job *job = (Job *) events[i].data.ptr;
+			if (job == NULL) {
+				uint64_t count;
+				if (read(loop->wakefd, &count, sizeof(count)) < 0) {
+					//drained by an earlier event of this round
+				}
+				continue;
+			}
+			engine->step(loop, job);
+		}
+		engine->expire(loop);
+	}
+
+	//whatever is still in flight is left half done, drop those connections
+	while (!loop->active.empty()) {
+		Job *job = loop->active.front();
+		job->delivered = true;
+		job->conn->disconnect();
+		engine->fail(loop, job, Exception(-1, "async engine stopped"));
+	}
+	while (!loop->waiting.empty()) {
+		Job *job = loop->waiting.front();
+		loop->waiting.pop_front();
+		engine->fail(loop, job, Exception(-1, "async engine stopped"));
+	}
+
+#ifdef LINUX
+	mysql_thread_end();
+#endif
+	return NULL;
+}
+
+void AsyncEngine::dispatch(Loop *loop) {
+	for (size_t n = loop->waiting.size(); n > 0; --n) {
+		Job *job = loop->waiting.front();
+		loop->waiting.pop_front();
+
+#ifdef MYSQLDB_HAVE_NONBLOCKING
+		//the same breaker and reconnect budget as getConnection
+		Source *source = MYSQL_FACTORY::instance().source(job->dbname);
+		uint32_t ticket = 0;
+		CircuitBreaker::Verdict verdict = source ? source->breaker().admit(&ticket) : CircuitBreaker::PASS;
+		if (verdict == CircuitBreaker::REFUSE) {
+			refuse(loop, job);
+			continue;
+		}
+
+		bool found = false;
+		Connection *conn = MYSQL_FACTORY::instance().tryGetConnection(job->dbname, &found);
+		if (conn == NULL && verdict == CircuitBreaker::PROBE)
+			source->breaker().abandon(ticket);
+		if (!found) {
+			if (job->callback)
+				job->callback->onException(Exception(-1, "get connection failed"));
+			finish(loop, job, 2006);
+			continue;
+		}
+		if (conn == NULL) {
+			loop->waiting.push_back(job);
+			continue;
+		}
+
+		//a pooled connection may have died with the source, the probe has to reach it
+		if (verdict == CircuitBreaker::PROBE && conn->connected())
+			conn->disconnect();
+		if (!conn->connected() && !source->breaker().takeToken()) {
+			conn->close();
+			if (verdict == CircuitBreaker::PROBE)
+				source->breaker().abandon(ticket);
+			refuse(loop, job);
+			continue;
+		}
+
+		job->source = source;
+		job->probe = (verdict == CircuitBreaker::PROBE);
+		job->ticket = ticket;
+		job->conn = conn;
+		start(loop, job);
+#else
+		//no non-blocking client, the statement runs to completion right here
+		MySQLTemplate tpl(job->dbname);
+		finish(loop, job, tpl.execSQL(job->callback, job->sql.c_str(), job->has_params ? &job->params.params() : NULL));
+#endif
+	}
+}
+
+void AsyncEngine::start(Loop *loop, Job *job) {
+	job->pos = loop->active.insert(loop->active.end(), job);
+	job->reused = job->conn->connected();
+	job->state = Job::CONNECTING;
+	job->deadline = nowMs() + connect_timeout_ * 1000;
+	step(loop, job);
+}
+
+/*
+ * advance job as far as its connection allows without blocking, then wait
+ * for the socket. The loop runs again when a step completes, so a statement
+ * on a connected connection goes out without waiting for an event.
+ */
+void AsyncEngine::step(Loop *loop, Job *job) {
+#ifdef MYSQLDB_HAVE_NONBLOCKING
+	static const std::string COMMIT = "commit";
+	Connection *conn = job->conn;
+
+	for (;;) {
+		net_async_status status = NET_ASYNC_ERROR;
+		switch (job->state) {
+			case Job::WAITING:
+				return;
+
+			case Job::CONNECTING:
+				status = conn->connectNonblocking();
+				if (status == NET_ASYNC_COMPLETE) {
+					if (!job->reused)
+						report(job, true);
+					try {
+						Statement stmt = conn->createStatement();
+						if (job->has_params) {
+							stmt.bindParams(*COMPILED_SQL_CACHE::instance().compile(job->sql.c_str()), job->params.params());
+						} else {
+							stmt.prepare(job->sql);
+						}
+						job->text = stmt.preview();
+					} catch (Exception &e) {
+						fail(loop, job, e);
+						return;
+					}
+					job->state = Job::QUERYING;
+					job->deadline = nowMs() + read_timeout_ * 1000;
+					continue;
+				}
+				break;
+
+			case Job::QUERYING:
+				status = conn->queryNonblocking(job->text);
+				if (status == NET_ASYNC_COMPLETE) {
+					job->state = Job::STORING;
+					continue;
+				}
+				break;
+
+			case Job::STORING: {
+				MYSQL_RES *res = NULL;
+				status = conn->storeResultNonblocking(&res);
+				if (status != NET_ASYNC_COMPLETE)
+					break;
+				if (res == NULL && mysql_field_count(conn->handle()) != 0) {
+					status = NET_ASYNC_ERROR;
+					break;
+				}
+
+				boost::shared_ptr<MYSQL_RES> pResult(res, FreeMySQLResult());
+				ResultSet result(pResult, mysql_affected_rows(conn->handle()), mysql_insert_id(conn->handle()));
+				job->delivered = true;
+				try {
+					if (job->callback)
+						job->callback->onResult(result);
+				} catch (Exception &e) {
+					fail(loop, job, e);
+					return;
+				}
+				if (conn->autocommit()) {
+					finish(loop, job, 0);
+					return;
+				}
+				job->state = Job::COMMITTING;
+				continue;
+			}
+
+			case Job::COMMITTING:
+				status = conn->queryNonblocking(COMMIT);
+				if (status == NET_ASYNC_COMPLETE) {
+					finish(loop, job, 0);
+					return;
+				}
+				break;
+		}
+
+		if (status == NET_ASYNC_NOT_READY) {
+			watch(loop, job);
+			return;
+		}
+		fail(loop, job, Exception(conn->handle()));
+		return;
+	}
+#endif
+}
+
+/*
+ * edge triggered for both directions: a step blocked on sending resumes
+ * once the socket drains, one blocked on the reply once data arrives.
+ */
+void AsyncEngine::watch(Loop *loop, Job *job) {
+#ifdef MYSQLDB_HAVE_NONBLOCKING
+	int fd = job->conn->socket();
+	if (fd == job->fd)
+		return;
+	if (job->fd >= 0)
+		epoll_ctl(loop->epfd, EPOLL_CTL_DEL, job->fd, NULL);
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	ev.data.ptr = job;
+	job->fd = (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == 0) ? fd : -1;
+#endif
+}
+
+void AsyncEngine::expire(Loop *loop) {
+	uint64_t now = nowMs();
+	for (std::list<Job *>::iterator it = loop->active.begin(); it != loop->active.end(); ) {
+		Job *job = *it++;
+		if (job->deadline > now)
+			continue;
+
+		job->reused = false;
+		fail(loop, job, Exception(CR_SERVER_LOST, "Lost connection to MySQL server (%s timed out)",
+		                          job->state == Job::CONNECTING ? "connect" : "query"));
+	}
+}
+
+void AsyncEngine::fail(Loop *loop, Job *job, const Exception &e) {
+	int code = e.code();
+	Connection *conn = job->conn;
+
+	if (job->fd >= 0) {
+		epoll_ctl(loop->epfd, EPOLL_CTL_DEL, job->fd, NULL);
+		job->fd = -1;
+	}
+
+	if (conn != NULL && code >= 2000 && code <= 2018) {
+		//Fatal error, unrecoverable
+		conn->disconnect();
+		report(job, false);
+		Source *source = job->source;
+		if (job->reused && !job->delivered
+		    && (source == NULL || (source->breaker().state() == CircuitBreaker::CLOSED && source->breaker().takeToken()))) {
+			//reconnect once, as MySQLTemplate does
+			job->reused = false;
+			job->state = Job::CONNECTING;
+			job->deadline = nowMs() + connect_timeout_ * 1000;
+			step(loop, job);
+			return;
+		}
+	} else if (conn != NULL) {
+		//the server answered
+		if (code > 0)
+			report(job, true);
+		if (!conn->autocommit()) {
+			//dropping the connection rolls back without a blocking round trip
+			conn->disconnect();
+		}
+	}
+
+	if (job->callback)
+		job->callback->onException(e);
+	finish(loop, job, code);
+}
+
+void AsyncEngine::refuse(Loop *loop, Job *job) {
+	if (job->callback)
+		job->callback->onException(Exception(SOURCE_UNAVAILABLE, "%s is not answering, not tried", job->dbname.c_str()));
+	finish(loop, job, SOURCE_UNAVAILABLE);
+}
+
+//tell the breaker of job's source whether it answered, a probe only once
+void AsyncEngine::report(Job *job, bool ok) {
+	if (job->source == NULL)
+		return;
+	CircuitBreaker &breaker = job->source->breaker();
+	if (job->probe) {
+		job->probe = false;
+		breaker.probed(ok, job->ticket);
+	} else if (ok) {
+		breaker.succeeded();
+	} else {
+		breaker.failed();
+	}
+}
+
+void AsyncEngine::finish(Loop *loop, Job *job, int code) {
+	if (code == 0)
+		report(job, true);
+	else if (job->probe && job->source != NULL)
+		job->source->breaker().abandon(job->ticket);
+	if (job->fd >= 0) {
+		epoll_ctl(loop->epfd, EPOLL_CTL_DEL, job->fd, NULL);
+		job->fd = -1;
+	}
+	if (job->conn != NULL) {
+		loop->active.erase(job->pos);
+		job->conn->close();
+		job->conn = NULL;
+	}
+
+	job->promise.set_value(code);
+	delete job;
+}
+
+}	//mysqldb
+}	//server
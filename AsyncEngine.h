@@ -0,0 +1,109 @@
+#ifndef MYSQLLIB_ASYNC_ENGINE_H
+#define MYSQLLIB_ASYNC_ENGINE_H
+
+#include "MySQLTemplate.h"
+#include <pthread.h>
+#include <atomic>
+#include <future>
+
+namespace server {
+namespace mysqldb {
+
+/*
+ * Runs statements on pooled connections without blocking the caller. A few
+ * I/O threads each drive many connections through the client library's
+ * non-blocking connect/query/store calls and one epoll set, so they can keep
+ * a whole pool busy. Connections are taken from the MySQLFactory pools
+ * without waiting and go back as soon as their statement finished.
+ *
+ * Statements always go out through the text protocol.
+ *
+ * Checkouts go through the breaker and reconnect budget of their source as
+ * those of MySQLTemplate do, a refused one fails with SOURCE_UNAVAILABLE.
+ *
+ * Without the non-blocking API (client older than 8.0.16) each I/O thread
+ * runs its statements one at a time, the caller still never blocks.
+ */
+class AsyncEngine {
+public:
+	explicit AsyncEngine(unsigned int threads = 1);
+
+	//stops the I/O threads, statements not yet finished fail
+	virtual ~AsyncEngine();
+
+	/*
+	 * queue sql for a connection of source dbname. The callback runs on an
+	 * I/O thread and must outlive the returned future, which yields 0 or the
+	 * error code MySQLTemplate::execute would have returned. args are copied.
+	 */
+	std::future<int> submit(const std::string &dbname, Callback *callback, const char *sql,
+	                        const ParamList *args);
+
+	//seconds allowed for a connect and for a statement, before it fails with 2013
+	inline void setTimeouts(unsigned int connect_timeout, unsigned int read_timeout) {
+		connect_timeout_ = connect_timeout;
+		read_timeout_ = read_timeout;
+	}
+
+	void stop();
+
+private:
+	struct Job;
+	struct Loop;
+
+	AsyncEngine(const AsyncEngine &);
+	AsyncEngine &operator =(const AsyncEngine &);
+
+	static void *run(void *arg);
+
+	void dispatch(Loop *loop);
+
+	void start(Loop *loop, Job *job);
+
+	void step(Loop *loop, Job *job);
+
+	void watch(Loop *loop, Job *job);
+
+	void expire(Loop *loop);
+
+	void fail(Loop *loop, Job *job, const Exception &e);
+
+	//fail job with SOURCE_UNAVAILABLE, its source's breaker refused it
+	void refuse(Loop *loop, Job *job);
+
+	void report(Job *job, bool ok);
+
+	void finish(Loop *loop, Job *job, int code);
+
+	std::vector<Loop *> loops_;
+	std::atomic<unsigned int> next_;
+	unsigned int connect_timeout_;
+	unsigned int read_timeout_;
+};	//AsyncEngine
+
+/* execute() of MySQLTemplate, returning a future instead of blocking */
+class AsyncTemplate {
+public:
+	AsyncTemplate(AsyncEngine &engine, const std::string &dbname): engine_(engine), dbname_(dbname) {}
+
+	std::future<int> execute(Callback *callback, const char *sql) {
+		return engine_.submit(dbname_, callback, sql, NULL);
+	}
+
+	template<typename... Args>
+	std::future<int> execute(Callback *callback, const char *sql, const Args &... args) {
+		const Parameter param[] = { Parameter(args)... };
+		ParamList list(param, sizeof...(Args));
+
+		return engine_.submit(dbname_, callback, sql, &list);
+	}
+
+private:
+	AsyncEngine &engine_;
+	std::string dbname_;
+};	//AsyncTemplate
+
+}	//mysqldb
+}	//server
+
+#endif	//MYSQLLIB_ASYNC_ENGINE_H
@@ -0,0 +1,117 @@
+#include "ColumnarResult.h"
+
+namespace server {
+namespace mysqldb {
+
+/* ColumnVector */
+ColumnVector::ColumnVector(const char *name, Kind kind): name_(name ? name : ""), kind_(kind), rows_(0) {
+	if (kind_ == KIND_TEXT)
+		offsets_.push_back(0);
+}
+
+ColumnVector::Kind ColumnVector::kindOf(const MYSQL_FIELD &field) {
+	switch (field.type) {
+		case MYSQL_TYPE_TINY:
+		case MYSQL_TYPE_SHORT:
+		case MYSQL_TYPE_INT24:
+		case MYSQL_TYPE_LONG:
+		case MYSQL_TYPE_YEAR:
+			return KIND_INT;
+		case MYSQL_TYPE_LONGLONG:
+			return (field.flags & UNSIGNED_FLAG) ? KIND_UINT : KIND_INT;
+		case MYSQL_TYPE_FLOAT:
+		case MYSQL_TYPE_DOUBLE:
+			return KIND_DOUBLE;
+		default:
+			return KIND_TEXT;
+	}
+}
+
+size_t ColumnVector::nullCount() const {
+	size_t valid = 0;
+	for (size_t i = 0; i < valid_.size(); ++i)
+		valid += __builtin_popcountll(valid_[i]);
+	return rows_ - valid;
+}
+
+void ColumnVector::reserve(size_t rows) {
+	valid_.reserve((rows + 63) / 64);
+	switch (kind_) {
+		case KIND_INT:
+			ints_.reserve(rows);
+			break;
+		case KIND_UINT:
+			uints_.reserve(rows);
+			break;
+		case KIND_DOUBLE:
+			doubles_.reserve(rows);
+			break;
+		default:
+			offsets_.reserve(rows + 1);
+			break;
+	}
+}
+
+void ColumnVector::append(const ResultSet &result, int index) {
+	size_t row = rows_++;
+	if ((row & 63) == 0)
+		valid_.push_back(0);
+
+	bool null = result.isNull(index);
+	if (!null)
+		valid_.back() |= 1ULL << (row & 63);
+
+	switch (kind_) {
+		case KIND_INT:
+			ints_.push_back(null ? 0 : result.getInt(index));
+			break;
+		case KIND_UINT:
+			uints_.push_back(null ? 0 : result.get(index).to<uint64_t>(0));
+			break;
+		case KIND_DOUBLE:
+			doubles_.push_back(null ? 0 : result.getDouble(index));
+			break;
+		default:
+			if (!null) {
+				Column c = result.get(index);
+				text_.insert(text_.end(), c.data(), c.data() + c.size());
+			}
+			offsets_.push_back(text_.size());
+			break;
+	}
+}
+
+/* ColumnarResultSet */
+void ColumnarResultSet::onResult(ResultSet &result) {
+	result_.clear();
+	rows_ = 0;
+
+	uint32_t columns = result.getColumns();
+	MYSQL_FIELD *fields = result.fields();
+	if (fields == NULL)
+		return;
+
+	uint64_t rows = result.getRows();
+	result_.reserve(columns);
+	for (uint32_t i = 0; i < columns; ++i) {
+		result_.push_back(ColumnVector(fields[i].name, ColumnVector::kindOf(fields[i])));
+		result_.back().reserve(rows);
+	}
+
+	while (result.next()) {
+		for (uint32_t i = 0; i < columns; ++i)
+			result_[i].append(result, i + 1);
+		++rows_;
+	}
+}
+
+const ColumnVector *ColumnarResultSet::find(const char *name) const {
+	for (size_t i = 0; i < result_.size(); ++i) {
+		if (result_[i].name() == name)
+			return &result_[i];
+	}
+	return NULL;
+}
+
+}	//mysqldb
+}	//server
@@ -0,0 +1,98 @@
+#ifndef MYSQLLIB_COLUMNAR_RESULT_H
+#define MYSQLLIB_COLUMNAR_RESULT_H
+
+#include "MySQLTemplate.h"
+
+namespace server {
+namespace mysqldb {
+
+/*
+ * One column of a ColumnarResultSet. Integer and floating point columns are
+ * parsed into a native array, everything else (DECIMAL included, to stay
+ * exact) is kept as text: one contiguous buffer plus size()+1 offsets.
+ * A bit per row marks the values that are not NULL, NULL numbers read as 0.
+ */
+class ColumnVector {
+public:
+	enum Kind {
+		KIND_INT	= 0,
+		KIND_UINT	= 1,	//BIGINT UNSIGNED
+		KIND_DOUBLE	= 2,
+		KIND_TEXT	= 3,
+	};
+
+	ColumnVector(const char *name, Kind kind);
+
+	//kind a column of this type is stored as
+	static Kind kindOf(const MYSQL_FIELD &field);
+
+	inline const std::string &name() const { return name_; }
+
+	inline Kind kind() const { return kind_; }
+
+	inline size_t size() const { return rows_; }
+
+	inline bool null(size_t row) const { return (valid_[row >> 6] & (1ULL << (row & 63))) == 0; }
+
+	size_t nullCount() const;
+
+	//values of a KIND_INT, KIND_UINT or KIND_DOUBLE column, size() of them
+	inline const int64_t *ints() const { return ints_.data(); }
+
+	inline const uint64_t *uints() const { return uints_.data(); }
+
+	inline const double *doubles() const { return doubles_.data(); }
+
+	//value of a KIND_TEXT column, valid as long as the column
+	inline std::string_view text(size_t row) const {
+		return std::string_view(text_.data() + offsets_[row], offsets_[row + 1] - offsets_[row]);
+	}
+
+	inline const char *textData() const { return text_.data(); }
+
+	inline const size_t *offsets() const { return offsets_.data(); }
+
+	void reserve(size_t rows);
+
+	//cell index (1-based) of the current row of result
+	void append(const ResultSet &result, int index);
+
+private:
+	std::string name_;
+	Kind kind_;
+	size_t rows_;
+	std::vector<uint64_t> valid_;
+	std::vector<int64_t> ints_;
+	std::vector<uint64_t> uints_;
+	std::vector<double> doubles_;
+	std::vector<char> text_;
+	std::vector<size_t> offsets_;
+};	//ColumnVector
+
+/*
+ * the whole result column by column, for scans and aggregations over many
+ * rows. Buffers are sized from the row count of buffered results up front.
+ */
+struct ColumnarResultSet : public Callback
+{
+	virtual void onResult(ResultSet &result);
+
+	virtual void onException(const Exception &ex)
+	{
+		error_ = ex.code();
+		errorMsg_ = ex.what();
+	}
+
+	//column called name, NULL if there is none
+	const ColumnVector *find(const char *name) const;
+
+	std::vector<ColumnVector> result_ ;
+	size_t rows_ ;
+	int16_t error_ ;
+	std::string errorMsg_ ;
+};
+
+}	//mysqldb
+}	//server
+
+#endif	//MYSQLLIB_COLUMNAR_RESULT_H
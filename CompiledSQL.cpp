@@ -0,0 +1,332 @@
+#include "CompiledSQL.h"
+#include <string.h>
+#include <strings.h>
+#include <algorithm>
+
+using namespace server::mysqldb;
+
+/* CompiledSQL */
+CompiledSQL::CompiledSQL(const char *sql)
+: text_(sql), arity_(0), literal_size_(0), values_begin_(std::string::npos), values_end_(std::string::npos),
+  kind_(KIND_OTHER) {
+    compile();
+}
+
+CompiledSQL::CompiledSQL(const std::string &sql)
+: text_(sql), arity_(0), literal_size_(0), values_begin_(std::string::npos), values_end_(std::string::npos),
+  kind_(KIND_OTHER) {
+    compile();
+}
+
+void CompiledSQL::compile() {
+    const char *p = text_.data();
+    size_t size = text_.size();
+    int max_index = 0;
+
+    for (size_t i = 0; i < size; ++i) {
+        char c = p[i];
+        if (c == '\'' || c == '"' || c == '`') {
+            i = skipQuoted(p, size, i);
+            continue;
+        }
+        if (c != ':' || i + 1 >= size)
+            continue;
+
+        size_t j = i + 1;
+        if (p[j] >= '1' && p[j] <= '9') {
+            int idx = 0;
+            while (j < size && p[j] >= '0' && p[j] <= '9')
+                idx = idx * 10 + (p[j++] - '0');
+            Slot s = { (uint32_t) i, (uint32_t) (j - i), idx };
+            slots_.push_back(s);
+            if (idx > max_index)
+                max_index = idx;
+        } else if (isNameStart(p[j])) {
+            while (j < size && isNameChar(p[j]))
+                ++j;
+            std::string name(p + i + 1, j - i - 1);
+            int ordinal = 0;
+            while (ordinal < (int) names_.size() && names_[ordinal] != name)
+                ++ordinal;
+            if (ordinal == (int) names_.size())
+                names_.push_back(name);
+            //resolved to a real index once the highest ":N" is known
+            Slot s = { (uint32_t) i, (uint32_t) (j - i), -(ordinal + 1) };
+            slots_.push_back(s);
+        } else {
+            continue;
+        }
+        i = j - 1;
+    }
+
+    literal_size_ = size;
+    size_t last = 0;
+    for (std::vector<Slot>::iterator it = slots_.begin(); it != slots_.end(); ++it) {
+        if (it->index < 0)
+            it->index = max_index - it->index;
+        literal_size_ -= it->length;
+        prepared_text_.append(p + last, it->offset - last);
+        prepared_text_.append(1, '?');
+        last = it->offset + it->length;
+    }
+    prepared_text_.append(p + last, size - last);
+    arity_ = max_index + (int) names_.size();
+    findValuesGroup();
+    findTables();
+}
+
+void CompiledSQL::findValuesGroup() {
+    const char *p = text_.data();
+    size_t size = text_.size();
+
+    for (size_t i = 0; i < size; ++i) {
+        char c = p[i];
+        if (c == '\'' || c == '"' || c == '`') {
+            i = skipQuoted(p, size, i);
+            continue;
+        }
+        if ((c != 'v' && c != 'V') || (i > 0 && isNameChar(p[i - 1])))
+            continue;
+
+        //VALUES or VALUE, then the first parenthesized row
+        size_t j = i + 5;
+        if (j > size || strncasecmp(p + i, "value", 5) != 0)
+            continue;
+        if (j < size && (p[j] == 's' || p[j] == 'S'))
+            ++j;
+        if (j < size && isNameChar(p[j]))
+            continue;
+        while (j < size && (p[j] == ' ' || p[j] == '\t' || p[j] == '\r' || p[j] == '\n'))
+            ++j;
+        if (j >= size || p[j] != '(')
+            return;
+
+        int depth = 0;
+        for (size_t k = j; k < size; ++k) {
+            if (p[k] == '\'' || p[k] == '"' || p[k] == '`') {
+                k = skipQuoted(p, size, k);
+            } else if (p[k] == '(') {
+                ++depth;
+            } else if (p[k] == ')' && --depth == 0) {
+                values_begin_ = j;
+                values_end_ = k + 1;
+                return;
+            }
+        }
+        return;
+    }
+}
+
+/*
+ * next word (an identifier, possibly `quoted` and dotted) or single
+ * character of p from i on. Blanks, comments and string literals are skipped.
+ */
+static bool nextToken(const char *p, size_t size, size_t *i, size_t *begin, size_t *end) {
+    while (*i < size) {
+        char c = p[*i];
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+            ++*i;
+        } else if (c == '#' || (c == '-' && *i + 1 < size && p[*i + 1] == '-')) {
+            while (*i < size && p[*i] != '\n')
+                ++*i;
+        } else if (c == '/' && *i + 1 < size && p[*i + 1] == '*') {
+            const char *close = strstr(p + *i + 2, "*/");
+            *i = close ? close - p + 2 : size;
+        } else if (c == '\'' || c == '"') {
+            *i = skipQuoted(p, size, *i) + 1;
+        } else if (c == '`' || isNameStart(c)) {
+            *begin = *i;
+            for (;;) {
+                if (*i < size && p[*i] == '`') {
+                    *i = skipQuoted(p, size, *i) + 1;
+                } else {
+                    while (*i < size && (isNameChar(p[*i]) || p[*i] == '$'))
+                        ++*i;
+                }
+                if (*i + 1 < size && p[*i] == '.' && (p[*i + 1] == '`' || isNameStart(p[*i + 1]))) {
+                    ++*i;
+                    continue;
+                }
+                break;
+            }
+            *end = (*i < size) ? *i : size;
+            return true;
+        } else {
+            *begin = (*i)++;
+            *end = *i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool sameWord(const char *p, size_t begin, size_t end, const char *word) {
+    size_t n = strlen(word);
+    return end - begin == n && strncasecmp(p + begin, word, n) == 0;
+}
+
+/*
+ * functions whose result depends on the session or that take locks, a
+ * SELECT calling one must run where the rest of the session runs
+ */
+static bool sessionWord(const char *p, size_t begin, size_t end) {
+    static const char *words[] = { "get_lock", "release_lock", "release_all_locks", "is_free_lock", "is_used_lock",
+                                   "last_insert_id", "found_rows", "row_count", "connection_id", NULL };
+    for (const char **w = words; *w != NULL; ++w) {
+        if (sameWord(p, begin, end, *w))
+            return true;
+    }
+    return false;
+}
+
+/* words that end a table list, anything else after a table is an alias */
+static bool clauseWord(const char *p, size_t begin, size_t end) {
+    static const char *words[] = { "where", "on", "using", "group", "order", "limit", "having", "union",
+                                   "left", "right", "inner", "outer", "cross", "natural", "straight_join",
+                                   "set", "values", "value", "select", "partition", "for", "lock", "force",
+                                   "use", "ignore", "window", "into", "procedure", NULL };
+    for (const char **w = words; *w != NULL; ++w) {
+        if (sameWord(p, begin, end, *w))
+            return true;
+    }
+    return false;
+}
+
+void CompiledSQL::findTables() {
+    const char *p = text_.data();
+    size_t size = text_.size();
+    size_t i = 0, begin = 0, end = 0;
+    size_t prev_begin = 0, prev_end = 0;
+    bool first = true;
+    int expect = 0;		//1: a table comes next, 2: after a table of a list
+    bool pinned = false;	//a SELECT locking rows, using the session or writing INTO
+
+    while (nextToken(p, size, &i, &begin, &end)) {
+        bool word = (p[begin] == '`' || isNameStart(p[begin]));
+        if (!word) {
+            //@user and @@system variables
+            if (p[begin] == '@')
+                pinned = true;
+            if (expect == 2 && p[begin] == ',')
+                expect = 1;
+            else if (!(first && p[begin] == '('))
+                expect = 0;
+            continue;
+        }
+
+        if (first) {
+            first = false;
+            if (sameWord(p, begin, end, "select")) {
+                kind_ = KIND_SELECT;
+            } else if (sameWord(p, begin, end, "insert") || sameWord(p, begin, end, "replace")
+                       || sameWord(p, begin, end, "delete") || sameWord(p, begin, end, "truncate")
+                       || sameWord(p, begin, end, "alter") || sameWord(p, begin, end, "drop")
+                       || sameWord(p, begin, end, "create") || sameWord(p, begin, end, "rename")) {
+                kind_ = KIND_WRITE;
+            } else if (sameWord(p, begin, end, "update")) {
+                kind_ = KIND_WRITE;
+                expect = 1;
+            }
+        } else if (kind_ == KIND_SELECT
+                   && ((sameWord(p, prev_begin, prev_end, "for")
+                        && (sameWord(p, begin, end, "update") || sameWord(p, begin, end, "share")))
+                       || (sameWord(p, prev_begin, prev_end, "lock") && sameWord(p, begin, end, "in"))
+                       || sameWord(p, begin, end, "into") || sessionWord(p, begin, end))) {
+            //FOR UPDATE, FOR SHARE, LOCK IN SHARE MODE, INTO @var or OUTFILE
+            pinned = true;
+            expect = 0;
+        } else if (expect == 1 && !sameWord(p, begin, end, "select")) {
+            //the table name itself, lower case and without database or quotes
+            std::string name;
+            for (size_t k = begin; k < end; ++k) {
+                if (p[k] == '.' )
+                    name.clear();
+                else if (p[k] != '`')
+                    name.push_back((p[k] >= 'A' && p[k] <= 'Z') ? p[k] - 'A' + 'a' : p[k]);
+            }
+            if (!name.empty() && std::find(tables_.begin(), tables_.end(), name) == tables_.end())
+                tables_.push_back(name);
+            expect = 2;
+        } else if (sameWord(p, begin, end, "from") || sameWord(p, begin, end, "join")
+                   || sameWord(p, begin, end, "into") || sameWord(p, begin, end, "table")
+                   || (sameWord(p, begin, end, "update") && !sameWord(p, prev_begin, prev_end, "for")
+                       && !sameWord(p, prev_begin, prev_end, "key"))) {
+            expect = 1;
+        } else if (expect == 2 && clauseWord(p, begin, end)) {
+            expect = 0;
+        }
+        prev_begin = begin;
+        prev_end = end;
+    }
+    if (pinned && kind_ == KIND_SELECT)
+        kind_ = KIND_PINNED_READ;
+}
+
+int CompiledSQL::indexOf(const char *name) const {
+    for (std::vector<std::string>::size_type i = 0; i < names_.size(); ++i) {
+        if (names_[i] == name)
+            return arity_ - (int) names_.size() + (int) i + 1;
+    }
+    return -1;
+}
+
+/* CompiledSQLCache */
+CompiledSQLCache::CompiledSQLCache(): capacity_(4096) {
+    pthread_rwlock_init(&cache_lock_, NULL);
+}
+
+CompiledSQLCache::~CompiledSQLCache() {
+    pthread_rwlock_destroy(&cache_lock_);
+}
+
+uint64_t CompiledSQLCache::hash(const char *sql, size_t size) {
+    //FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; ++i) {
+        h ^= (unsigned char) sql[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+CompiledSQLPtr CompiledSQLCache::compile(const char *sql) {
+    size_t size = strlen(sql);
+    uint64_t key = hash(sql, size);
+
+    pthread_rwlock_rdlock(&cache_lock_);
+    CACHE_TYPE::const_iterator it = cache_.find(key);
+    if (it != cache_.end() && it->second->text().compare(0, std::string::npos, sql, size) == 0) {
+        CompiledSQLPtr tpl = it->second;
+        pthread_rwlock_unlock(&cache_lock_);
+        return tpl;
+    }
+    bool collision = (it != cache_.end());
+    pthread_rwlock_unlock(&cache_lock_);
+
+    CompiledSQLPtr tpl(new CompiledSQL(sql));
+    if (collision)
+        return tpl;
+
+    pthread_rwlock_wrlock(&cache_lock_);
+    if (cache_.size() < capacity_) {
+        //another thread may have won the race, keep whichever got in first
+        std::pair<CACHE_TYPE::iterator, bool> ret = cache_.insert(std::make_pair(key, tpl));
+        if (!ret.second && ret.first->second->text() == tpl->text())
+            tpl = ret.first->second;
+    }
+    pthread_rwlock_unlock(&cache_lock_);
+    return tpl;
+}
+
+void CompiledSQLCache::setCapacity(size_t capacity) {
+    pthread_rwlock_wrlock(&cache_lock_);
+    capacity_ = capacity;
+    pthread_rwlock_unlock(&cache_lock_);
+}
+
+size_t CompiledSQLCache::size() {
+    pthread_rwlock_rdlock(&cache_lock_);
+    size_t n = cache_.size();
+    pthread_rwlock_unlock(&cache_lock_);
+    return n;
+}
@@ -0,0 +1,212 @@
+#ifndef MYSQLLIB_COMPILED_SQL_H
+#define MYSQLLIB_COMPILED_SQL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <boost/shared_ptr.hpp>
+#include "singleton.h"
+
+namespace server {
+	namespace mysqldb {
+
+		constexpr bool isNameStart(char c) {
+			return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+		}
+
+		constexpr bool isNameChar(char c) {
+			return isNameStart(c) || (c >= '0' && c <= '9');
+		}
+
+		/* index of the quote closing the literal opened at p[i], honoring escapes */
+		constexpr size_t skipQuoted(const char *p, size_t size, size_t i) {
+			char c = p[i];
+			for (++i; i < size; ++i) {
+				if (p[i] == '\\' && c != '`') {
+					++i;
+				} else if (p[i] == c) {
+					if (i + 1 < size && p[i + 1] == c)
+						++i;
+					else
+						break;
+				}
+			}
+			return i;
+		}
+
+		/* true if ":name" at p[at] already appeared before it */
+		constexpr bool seenName(const char *p, size_t size, size_t at, size_t length) {
+			for (size_t i = 0; i < at; ++i) {
+				if (p[i] == '\'' || p[i] == '"' || p[i] == '`') {
+					i = skipQuoted(p, size, i);
+					continue;
+				}
+				if (p[i] != ':' || !isNameStart(p[i + 1]))
+					continue;
+				size_t j = i + 1;
+				while (j < size && isNameChar(p[j]))
+					++j;
+				bool same = (j - i == length);
+				for (size_t k = 1; same && k < length; ++k)
+					same = (p[i + k] == p[at + k]);
+				if (same)
+					return true;
+				i = j - 1;
+			}
+			return false;
+		}
+
+		/*
+		 * CompiledSQL::arity() of sql, usable in constant expressions so
+		 * SQL_EXECUTE can check literal statements at compile time.
+		 */
+		constexpr int placeholderArity(const char *sql) {
+			size_t size = 0;
+			while (sql[size] != '\0')
+				++size;
+
+			int max_index = 0, names = 0;
+			for (size_t i = 0; i < size; ++i) {
+				char c = sql[i];
+				if (c == '\'' || c == '"' || c == '`') {
+					i = skipQuoted(sql, size, i);
+					continue;
+				}
+				if (c != ':' || i + 1 >= size)
+					continue;
+
+				size_t j = i + 1;
+				if (sql[j] >= '1' && sql[j] <= '9') {
+					int idx = 0;
+					while (j < size && sql[j] >= '0' && sql[j] <= '9')
+						idx = idx * 10 + (sql[j++] - '0');
+					if (idx > max_index)
+						max_index = idx;
+				} else if (isNameStart(sql[j])) {
+					while (j < size && isNameChar(sql[j]))
+						++j;
+					if (!seenName(sql, size, i, j - i))
+						++names;
+				} else {
+					continue;
+				}
+				i = j - 1;
+			}
+			return max_index + names;
+		}
+
+		/*
+		 * SQL text with its placeholders located once, so a statement can be
+		 * rendered in a single forward pass.
+		 *
+		 * ":N" binds the N-th argument (1-based). ":name" placeholders are
+		 * numbered after the highest ":N", in order of first appearance, so
+		 * "where a=:id and b=:name or c=:id" takes two arguments.
+		 * Colons inside quoted literals are never treated as placeholders.
+		 */
+		class CompiledSQL {
+		public:
+			enum Kind {
+				KIND_OTHER	= 0,
+				KIND_SELECT	= 1,
+				KIND_WRITE	= 2,	//INSERT, UPDATE, DELETE, REPLACE and DDL
+				KIND_PINNED_READ	= 3,	//SELECT locking rows or using the session, on the primary and never cached
+			};
+
+			struct Slot {
+				uint32_t offset;	//position of the ':' in text()
+				uint32_t length;	//length of the placeholder including ':'
+				int index;		//1-based argument index
+			};
+
+			explicit CompiledSQL(const char *sql);
+
+			explicit CompiledSQL(const std::string &sql);
+
+			~CompiledSQL() {}
+
+			inline const std::string &text() const { return text_; }
+
+			inline const std::vector<Slot> &slots() const { return slots_; }
+
+			//text() with every placeholder replaced by '?', for server side prepare
+			inline const std::string &preparedText() const { return prepared_text_; }
+
+			//number of arguments the statement expects
+			inline int arity() const { return arity_; }
+
+			//bytes of text() that are copied verbatim when rendering
+			inline size_t literalSize() const { return literal_size_; }
+
+			//argument index of a ":name" placeholder, -1 if there is none
+			int indexOf(const char *name) const;
+
+			//the "(...)" row after VALUES as [begin, end) of text(), npos if none
+			inline size_t valuesBegin() const { return values_begin_; }
+
+			inline size_t valuesEnd() const { return values_end_; }
+
+			inline Kind kind() const { return kind_; }
+
+			/*
+			 * lower case names of the tables the statement reads or writes,
+			 * without database prefix. Found by a plain scan of FROM, JOIN,
+			 * INTO, UPDATE and TABLE clauses, so some may be missing.
+			 */
+			inline const std::vector<std::string> &tables() const { return tables_; }
+
+		private:
+			void compile();
+
+			void findValuesGroup();
+
+			void findTables();
+
+			std::string text_;
+			std::string prepared_text_;
+			std::vector<Slot> slots_;
+			std::vector<std::string> names_;
+			int arity_;
+			size_t literal_size_;
+			size_t values_begin_;
+			size_t values_end_;
+			Kind kind_;
+			std::vector<std::string> tables_;
+		};	//CompiledSQL
+
+		typedef boost::shared_ptr<const CompiledSQL> CompiledSQLPtr;
+
+		/*
+		 * Process wide cache of compiled statements keyed by a hash of the SQL
+		 * text. Statements past the capacity are compiled but not cached, so
+		 * callers formatting values into the text cannot grow it unbounded.
+		 */
+		class CompiledSQLCache {
+		public:
+			CompiledSQLCache();
+
+			~CompiledSQLCache();
+
+			CompiledSQLPtr compile(const char *sql);
+
+			void setCapacity(size_t capacity);
+
+			size_t size();
+
+		private:
+			static uint64_t hash(const char *sql, size_t size);
+
+			typedef std::map<uint64_t, CompiledSQLPtr> CACHE_TYPE;
+			CACHE_TYPE cache_;
+			size_t capacity_;
+			pthread_rwlock_t cache_lock_;
+		};	//CompiledSQLCache
+
+		typedef singleton_default<CompiledSQLCache> COMPILED_SQL_CACHE;
+
+	}	//mysqldb
+}	//server
+#endif	//MYSQLLIB_COMPILED_SQL_H
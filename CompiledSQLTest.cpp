@@ -0,0 +1,47 @@
+#include "CompiledSQL.h"
+#include <stdio.h>
+
+using namespace server::mysqldb;
+
+static int failures = 0;
+
+static void expectKind(const char *sql, CompiledSQL::Kind kind) {
+    CompiledSQL tpl(sql);
+    if (tpl.kind() != kind) {
+        printf("FAIL kind %d, expected %d: %s\n", tpl.kind(), kind, sql);
+        ++failures;
+    }
+}
+
+int
+main()
+{
+    expectKind("select * from t where id=:1", CompiledSQL::KIND_SELECT);
+    expectKind("select a, b from t1 join t2 on t1.id = t2.id order by a", CompiledSQL::KIND_SELECT);
+    expectKind("select * from t where note = 'for update'", CompiledSQL::KIND_SELECT);
+    expectKind("select `for`, `update` from t", CompiledSQL::KIND_SELECT);
+    expectKind("update t set a=1 where id=:1", CompiledSQL::KIND_WRITE);
+    expectKind("insert into t select * from u for update", CompiledSQL::KIND_WRITE);
+
+    //locking reads
+    expectKind("select * from t where id=:1 for update", CompiledSQL::KIND_PINNED_READ);
+    expectKind("SELECT * FROM t WHERE id=:1 FOR UPDATE NOWAIT", CompiledSQL::KIND_PINNED_READ);
+    expectKind("select * from t where id=:1 for share", CompiledSQL::KIND_PINNED_READ);
+    expectKind("select * from t where id=:1 lock in share mode", CompiledSQL::KIND_PINNED_READ);
+    expectKind("select get_lock('job', 10)", CompiledSQL::KIND_PINNED_READ);
+    expectKind("select RELEASE_LOCK('job')", CompiledSQL::KIND_PINNED_READ);
+    expectKind("select is_free_lock('job')", CompiledSQL::KIND_PINNED_READ);
+
+    //reads of the session
+    expectKind("select last_insert_id()", CompiledSQL::KIND_PINNED_READ);
+    expectKind("select found_rows()", CompiledSQL::KIND_PINNED_READ);
+    expectKind("select row_count()", CompiledSQL::KIND_PINNED_READ);
+    expectKind("select @total", CompiledSQL::KIND_PINNED_READ);
+    expectKind("select @@session.sql_mode", CompiledSQL::KIND_PINNED_READ);
+    expectKind("select count(*) into @n from t", CompiledSQL::KIND_PINNED_READ);
+    expectKind("select * from t into outfile '/tmp/t.csv'", CompiledSQL::KIND_PINNED_READ);
+
+    if (failures == 0)
+        printf("CompiledSQLTest: all passed\n");
+    return failures == 0 ? 0 : 1;
+}
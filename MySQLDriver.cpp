@@ -1,16 +1,23 @@
 #include "MySQLDriver.h"
 #include "MySQLFactory.h"
+#include "CompiledSQL.h"
+#include <charconv>
+#include <cmath>
+#include <algorithm>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
 
 using namespace server::mysqldb;
 
 /* ResultSet */
 ResultSet::ResultSet()
-: row_(NULL), affected_rows_(0), lastid_(0), columns_(0) {
+: cursor_(0), row_(NULL), affected_rows_(0), lastid_(0), columns_(0) {
 
 }
 
 ResultSet::ResultSet(boost::shared_ptr<MYSQL_RES> result, uint32_t affected_rows, uint64_t lastid) 
-: result_(result), row_(NULL), affected_rows_(affected_rows), lastid_(lastid) {
+: result_(result), cursor_(0), row_(NULL), affected_rows_(affected_rows), lastid_(lastid) {
 
     if (result.get() != NULL)
     {
@@ -22,45 +29,150 @@ ResultSet::ResultSet(boost::shared_ptr<MYSQL_RES> result, uint32_t affected_rows
     }
 }
 
+ResultSet::ResultSet(boost::shared_ptr<PreparedResult> result, uint32_t affected_rows, uint64_t lastid)
+: prepared_(result), cursor_(0), row_(NULL), affected_rows_(affected_rows), lastid_(lastid), columns_(0) {
+
+    if (result.get() != NULL)
+    {
+        result_ = result->metadata();
+        columns_ = mysql_num_fields(result_.get());
+    }
+}
+
+ResultSet::ResultSet(boost::shared_ptr<StreamResult> result, uint32_t affected_rows, uint64_t lastid)
+: stream_(result), cursor_(0), row_(NULL), affected_rows_(affected_rows), lastid_(lastid), columns_(0) {
+
+    if (result.get() != NULL)
+    {
+        columns_ = result->columns();
+    }
+}
+
+ResultSet::ResultSet(ResultSnapshotPtr result)
+: snapshot_(result), cursor_(0), row_(NULL), lengths_(NULL), affected_rows_(0), lastid_(0), columns_(0) {
+
+    if (result.get() != NULL)
+    {
+        affected_rows_ = result->affectedRows();
+        lastid_ = result->lastId();
+        columns_ = result->columns();
+    }
+}
+
 ResultSet::~ResultSet() {
 }
 
-Column ResultSet::get(int index) const {
-    if (row_ == NULL)
+void ResultSet::cancel() {
+    if (stream_.get() != NULL)
+        stream_->cancel();
+}
+
+void ResultSet::close(Connection *conn) {
+    if (stream_.get() != NULL)
+        stream_->close(conn);
+}
+
+bool ResultSet::streamed() const {
+    return stream_.get() != NULL && stream_->streamed();
+}
+
+unsigned int ResultSet::column(int index) const {
+    if (prepared_.get() == NULL && stream_.get() == NULL && row_ == NULL)
         throw Exception(-1, "End of result set");
 
-    unsigned int columns = mysql_num_fields(result_.get());
-    if (index == 0 || index > (int)columns) {
+    if (index <= 0 || index > (int)columns_) {
         throw Exception(-1, "Invalid field index: %d", index);
     }
-    return Column(row_[index - 1], lengths_[index - 1]);
+    return index - 1;
 }
 
-Column ResultSet::get(const char *name) const {
-    if (row_ == NULL)
-        throw Exception(-1, "End of result set");
-
-    MYSQL_FIELD *fields = mysql_fetch_fields(result_.get());
-    unsigned int columns = mysql_num_fields(result_.get());
+int ResultSet::indexOf(const char *name) const {
+    if (names_.get() == NULL) {
+        MYSQL_FIELD *fields = this->fields();
+        if (fields == NULL)
+            throw Exception(-1, "Invalid field name: %s", name);
+        names_.reset(new ColumnIndex(fields, columns_));
+    }
 
-    for (unsigned int i = 0; i != columns; ++i) {
-        if (strcmp(fields[i].name, name) == 0) {
-            return Column(row_[i], lengths_[i]);
-        }
+    int index = names_->find(name);
+    if (index == 0) {
+        throw Exception(-1, "Invalid field name: %s", name);
     }
+    return index;
+}
+
+ColumnHandle ResultSet::handle(const char *name) const {
+    return ColumnHandle(indexOf(name));
+}
 
-    throw Exception(-1, "Invalid field name: %s", name);
+Column ResultSet::get(int index) const {
+    unsigned int i = column(index);
+    if (prepared_.get() != NULL)
+        return prepared_->get(i);
+    if (stream_.get() != NULL)
+        return stream_->get(i);
+    return Column(row_[i], lengths_[i]);
+}
+
+Column ResultSet::get(const char *name) const {
+    return get(indexOf(name));
+}
+
+bool ResultSet::isNull(int index) const {
+    if (prepared_.get() != NULL)
+        return prepared_->null(column(index));
+    return get(index).null();
 }
 
 MYSQL_FIELD* ResultSet::getFields()
 {
+    if (stream_.get() != NULL)
+        return stream_->fields();
+
     if (result_.get() == NULL)
         return NULL;
 
     return mysql_fetch_field(result_.get()) ;
         
 }
+
+MYSQL_FIELD *ResultSet::fields() const {
+    if (stream_.get() != NULL)
+        return stream_->fields();
+    if (snapshot_.get() != NULL)
+        return snapshot_->fields();
+    if (result_.get() == NULL)
+        return NULL;
+    return mysql_fetch_fields(result_.get());
+}
+
+uint64_t ResultSet::getRows() const {
+    if (prepared_.get() != NULL)
+        return prepared_->rows();
+    if (snapshot_.get() != NULL)
+        return snapshot_->rows();
+    if (stream_.get() != NULL || result_.get() == NULL)
+        return 0;
+    return mysql_num_rows(result_.get());
+}
+
 bool ResultSet::next() {
+    if (prepared_.get() != NULL)
+        return prepared_->next();
+
+    if (stream_.get() != NULL)
+        return stream_->next();
+
+    if (snapshot_.get() != NULL) {
+        if (cursor_ == snapshot_->rows()) {
+            row_ = NULL;
+            return false;
+        }
+        lengths_ = snapshot_->lengths(cursor_);
+        row_ = snapshot_->row(cursor_++);
+        return true;
+    }
+
     if (result_.get() == NULL)
         return false;
 
@@ -73,11 +185,33 @@ bool ResultSet::next() {
 }
 
 long long ResultSet::getInt(int index, long long df /* =0 */) const {
+    if (prepared_.get() != NULL)
+        return prepared_->getInt(column(index), df);
     return get(index).toInt(df);
 }
 
 long long ResultSet::getInt(const char *name, long long df /* =0 */) const {
-    return get(name).toInt(df);
+    return getInt(indexOf(name), df);
+}
+
+double ResultSet::getDouble(int index, double df /* =0 */) const {
+    if (prepared_.get() != NULL)
+        return prepared_->getDouble(column(index), df);
+    return get(index).toDouble(df);
+}
+
+double ResultSet::getDouble(const char *name, double df /* =0 */) const {
+    return getDouble(indexOf(name), df);
+}
+
+bool ResultSet::getTime(int index, MYSQL_TIME *out) const {
+    if (prepared_.get() != NULL)
+        return prepared_->getTime(column(index), out);
+    return get(index).toTime(out);
+}
+
+bool ResultSet::getTime(const char *name, MYSQL_TIME *out) const {
+    return getTime(indexOf(name), out);
 }
 
 std::string ResultSet::getString(int index) const {
@@ -88,6 +222,242 @@ std::string ResultSet::getString(const char *name) const {
     return get(name).toString();
 }
 
+/* ResultSnapshot */
+ResultSnapshot::ResultSnapshot(ResultSet &result)
+: columns_(result.getColumns()), affected_rows_(result.getAffectedRows()), lastid_(result.getLastId()) {
+    std::vector<size_t> offsets;
+    uint64_t rows = result.getRows();
+    offsets.reserve(rows * columns_);
+    lengths_.reserve(rows * columns_);
+
+    while (result.next()) {
+        for (uint32_t i = 0; i < columns_; ++i) {
+            Column c = result.get(i + 1);
+            if (c.null()) {
+                offsets.push_back(std::string::npos);
+                lengths_.push_back(0);
+                continue;
+            }
+            offsets.push_back(text_.size());
+            lengths_.push_back(c.size());
+            text_.insert(text_.end(), c.data(), c.data() + c.size());
+            text_.push_back('\0');
+        }
+    }
+
+    seal(offsets, result.fields());
+}
+
+ResultSnapshot::ResultSnapshot(const ResultSnapshot &layout, const std::vector<const char *> &cells,
+                               const std::vector<unsigned long> &lengths, uint32_t affected_rows)
+: columns_(layout.columns_), affected_rows_(affected_rows), lastid_(0) {
+    std::vector<size_t> offsets;
+    offsets.reserve(cells.size());
+    lengths_.reserve(cells.size());
+    size_t bytes = 0;
+    for (size_t i = 0; i < cells.size(); ++i)
+        bytes += cells[i] ? lengths[i] + 1 : 0;
+    text_.reserve(bytes);
+
+    for (size_t i = 0; i < cells.size(); ++i) {
+        if (cells[i] == NULL) {
+            offsets.push_back(std::string::npos);
+            lengths_.push_back(0);
+            continue;
+        }
+        offsets.push_back(text_.size());
+        lengths_.push_back(lengths[i]);
+        text_.insert(text_.end(), cells[i], cells[i] + lengths[i]);
+        text_.push_back('\0');
+    }
+
+    seal(offsets, layout.fields());
+}
+
+void ResultSnapshot::seal(const std::vector<size_t> &offsets, const MYSQL_FIELD *fields) {
+    //names last, pointers are taken once text_ stops growing
+    std::vector<size_t> names;
+    if (fields != NULL) {
+        for (uint32_t i = 0; i < columns_; ++i) {
+            const char *parts[] = { fields[i].name, fields[i].org_name, fields[i].table, fields[i].org_table, fields[i].db };
+            for (size_t k = 0; k < sizeof(parts) / sizeof(parts[0]); ++k) {
+                names.push_back(text_.size());
+                if (parts[k] != NULL)
+                    text_.insert(text_.end(), parts[k], parts[k] + strlen(parts[k]));
+                text_.push_back('\0');
+            }
+        }
+    }
+
+    char *base = text_.empty() ? NULL : &text_[0];
+    cells_.resize(offsets.size());
+    for (size_t i = 0; i < offsets.size(); ++i)
+        cells_[i] = (offsets[i] == std::string::npos) ? NULL : base + offsets[i];
+
+    if (fields != NULL) {
+        fields_.assign(fields, fields + columns_);
+        static char empty[] = "";
+        for (uint32_t i = 0; i < columns_; ++i) {
+            MYSQL_FIELD &f = fields_[i];
+            const size_t *at = &names[i * 5];
+            f.name = base + at[0];
+            f.org_name = base + at[1];
+            f.table = base + at[2];
+            f.org_table = base + at[3];
+            f.db = base + at[4];
+            f.catalog = empty;
+            f.def = NULL;
+        }
+    }
+}
+
+size_t ResultSnapshot::bytes() const {
+    return sizeof(*this) + text_.capacity() + fields_.capacity() * sizeof(MYSQL_FIELD)
+        + cells_.capacity() * (sizeof(char *) + sizeof(unsigned long));
+}
+
+/* ParamCopy */
+void ParamCopy::assign(const ParamList &args) {
+    params_.clear();
+    strings_.clear();
+    vectors_.clear();
+    str_vectors_.clear();
+    times_.clear();
+    params_.reserve(args.size);
+
+    for (const Parameter *it = args.data; it != args.data + args.size; ++it) {
+        switch (it->type) {
+            case Parameter::STRING:
+                if (it->data.string == NULL) {
+                    params_.push_back(*it);
+                    break;
+                }
+                strings_.push_back(it->data.string);
+                params_.push_back(Parameter(strings_.back().c_str()));
+                break;
+            case Parameter::BLOB:
+                strings_.push_back(*it->data.blob);
+                params_.push_back(Parameter(strings_.back()));
+                break;
+            case Parameter::STRING_VIEW:
+                strings_.push_back(std::string(it->data.view.data, it->data.view.size));
+                params_.push_back(Parameter(std::string_view(strings_.back())));
+                break;
+            case Parameter::INT_VECTOR:
+                vectors_.push_back(*it->data.int_vec);
+                params_.push_back(Parameter(vectors_.back()));
+                break;
+            case Parameter::STRING_VECTOR:
+                str_vectors_.push_back(*it->data.str_vec);
+                params_.push_back(Parameter(str_vectors_.back()));
+                break;
+            case Parameter::DATETIME:
+                times_.push_back(*it->data.time);
+                params_.push_back(Parameter(times_.back()));
+                break;
+            default:
+                params_.push_back(*it);
+                break;
+        }
+    }
+}
+
+/* ColumnIndex */
+ColumnIndex::ColumnIndex(const MYSQL_FIELD *fields, unsigned int columns): mask_(0) {
+    //at most half full, so probe chains stay short
+    uint32_t size = 8;
+    while (size < columns * 2)
+        size <<= 1;
+    mask_ = size - 1;
+    Slot empty = { 0, 0 };
+    slots_.assign(size, empty);
+    names_.reserve(columns);
+
+    for (unsigned int i = 0; i < columns; ++i) {
+        names_.push_back(fields[i].name);
+        //duplicate names resolve to the first column, as the linear scan did
+        if (find(fields[i].name) != 0)
+            continue;
+        uint32_t h = hash(fields[i].name);
+        uint32_t pos = h & mask_;
+        while (slots_[pos].index != 0)
+            pos = (pos + 1) & mask_;
+        slots_[pos].hash = h;
+        slots_[pos].index = (int)i + 1;
+    }
+}
+
+uint32_t ColumnIndex::hash(const char *name) {
+    //FNV-1a
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *) name; *p != '\0'; ++p) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+int ColumnIndex::find(const char *name) const {
+    uint32_t h = hash(name);
+    for (uint32_t pos = h & mask_; slots_[pos].index != 0; pos = (pos + 1) & mask_) {
+        const Slot &slot = slots_[pos];
+        if (slot.hash == h && strcmp(names_[slot.index - 1], name) == 0)
+            return slot.index;
+    }
+    return 0;
+}
+
+/* Column */
+bool Column::toTime(MYSQL_TIME *out) const {
+    if (null())
+        return false;
+
+    //"YYYY-MM-DD[ hh:mm:ss[.ffffff]]" or "[-]hhh:mm:ss[.ffffff]"
+    unsigned long part[7] = {0, 0, 0, 0, 0, 0, 0};
+    unsigned int parts = 0, frac_digits = 0;
+    const char *p = data_, *end = data_ + size_;
+    bool neg = (p != end && *p == '-');
+    if (neg)
+        ++p;
+    bool is_date = (end - p > 4 && p[4] == '-');
+
+    while (p != end && parts < 7) {
+        if (*p >= '0' && *p <= '9') {
+            unsigned long v = 0;
+            const char *begin = p;
+            while (p != end && *p >= '0' && *p <= '9')
+                v = v * 10 + (*p++ - '0');
+            if (parts == (is_date ? 6u : 3u))
+                frac_digits = p - begin;
+            part[parts++] = v;
+        } else {
+            ++p;
+        }
+    }
+
+    memset(out, 0, sizeof(*out));
+    if (is_date) {
+        out->year = part[0];
+        out->month = part[1];
+        out->day = part[2];
+        out->hour = part[3];
+        out->minute = part[4];
+        out->second = part[5];
+        out->second_part = part[6];
+        out->time_type = parts > 3 ? MYSQL_TIMESTAMP_DATETIME : MYSQL_TIMESTAMP_DATE;
+    } else {
+        out->neg = neg;
+        out->hour = part[0];
+        out->minute = part[1];
+        out->second = part[2];
+        out->second_part = part[3];
+        out->time_type = MYSQL_TIMESTAMP_TIME;
+    }
+    for (; frac_digits > 0 && frac_digits < 6; ++frac_digits)
+        out->second_part *= 10;
+    return true;
+}
+
 /* Connection */
 Connection::Connection(const std::string &user, 
                        const std::string &passwd, 
@@ -97,7 +467,7 @@ Connection::Connection(const std::string &user,
                        unsigned int connect_timeout,
                        unsigned int read_timeout,
                        const std::string& charset,
-                       bool autocommit) : connected_(false) {
+                       bool autocommit) : stmt_cache_size_(64), prefer_prepared_(false), max_packet_(0), multi_statements_(false), connected_(false), connecting_(false) {
 #ifdef LINUX
     mysql_thread_init();
 #endif
@@ -133,7 +503,8 @@ void Connection::connect(){
     assert(mysql_init(&mysql_) != NULL);
     mysql_options(&mysql_, MYSQL_OPT_READ_TIMEOUT, &read_timeout_);
     mysql_options(&mysql_, MYSQL_OPT_CONNECT_TIMEOUT , &connect_timeout_);
-    if (mysql_real_connect(&mysql_, host_.c_str(), user_.c_str(), passwd_.c_str(), database_.c_str(), port_, NULL, 0) != &mysql_) {
+    unsigned long flags = multi_statements_ ? CLIENT_MULTI_STATEMENTS : 0;
+    if (mysql_real_connect(&mysql_, host_.c_str(), user_.c_str(), passwd_.c_str(), database_.c_str(), port_, NULL, flags) != &mysql_) {
         throw Exception(&mysql_);
     }
 
@@ -148,19 +519,83 @@ void Connection::connect(){
     connected_ = true;
 }
 
+#ifdef MYSQLDB_HAVE_NONBLOCKING
+net_async_status Connection::connectNonblocking() {
+    if (connected_) {
+        return NET_ASYNC_COMPLETE;
+    }
+
+    if (!connecting_) {
+        assert(mysql_init(&mysql_) != NULL);
+        mysql_options(&mysql_, MYSQL_OPT_READ_TIMEOUT, &read_timeout_);
+        mysql_options(&mysql_, MYSQL_OPT_CONNECT_TIMEOUT , &connect_timeout_);
+        //no round trips of our own in between, let the handshake do "set names"
+        mysql_options(&mysql_, MYSQL_SET_CHARSET_NAME, charset_.c_str());
+        if (!autocommit_) {
+            mysql_options(&mysql_, MYSQL_INIT_COMMAND, "set autocommit=0");
+        }
+        connecting_ = true;
+    }
+
+    unsigned long flags = multi_statements_ ? CLIENT_MULTI_STATEMENTS : 0;
+    net_async_status status = mysql_real_connect_nonblocking(&mysql_, host_.c_str(), user_.c_str(), passwd_.c_str(),
+                                                             database_.c_str(), port_, NULL, flags);
+    if (status == NET_ASYNC_COMPLETE) {
+        connecting_ = false;
+        connected_ = true;
+    }
+    return status;
+}
+
+net_async_status Connection::queryNonblocking(const std::string &sql) {
+    return mysql_real_query_nonblocking(&mysql_, sql.data(), sql.size());
+}
+
+net_async_status Connection::storeResultNonblocking(MYSQL_RES **result) {
+    return mysql_store_result_nonblocking(&mysql_, result);
+}
+#endif
+
 void Connection::reconnect() {
     disconnect();
     connect();
 }
 
+bool Connection::ping() {
+    return connected_ && mysql_ping(&mysql_) == 0;
+}
+
+bool Connection::reset() {
+    if (!connected_) {
+        return false;
+    }
+    //the server drops its prepared statements too
+    clearStatements();
+    if (mysql_reset_connection(&mysql_) != 0) {
+        return false;
+    }
+
+    //session variables are back at the server defaults
+    if (mysql_autocommit(&mysql_, autocommit_) != 0) {
+        return false;
+    }
+    if (!charset_.empty() && mysql_set_character_set(&mysql_, charset_.c_str()) != 0) {
+        return false;
+    }
+    return true;
+}
+
 Statement Connection::createStatement() {
-    return Statement(&mysql_);
+    return Statement(&mysql_, &sql_arena_);
 }
 
 void Connection::disconnect() { 
-    if (connected_) {
+    if (connected_ || connecting_) {
+        clearStatements();
+        max_packet_ = 0;
         mysql_close(&mysql_);
         connected_ = false;
+        connecting_ = false;
     }
 }
 
@@ -168,6 +603,98 @@ void Connection::close() {
     return;  
 }
 
+size_t Connection::maxAllowedPacket() {
+    if (max_packet_ == 0) {
+        if (mysql_query(&mysql_, "select @@max_allowed_packet") != 0) {
+            throw Exception(&mysql_);
+        }
+        MYSQL_RES *result = mysql_store_result(&mysql_);
+        MYSQL_ROW row = (result != NULL) ? mysql_fetch_row(result) : NULL;
+        max_packet_ = (row != NULL && row[0] != NULL) ? strtoull(row[0], NULL, 10) : 0;
+        mysql_free_result(result);
+        if (max_packet_ == 0)
+            max_packet_ = 1 << 20;
+    }
+    return max_packet_;
+}
+
+void Connection::setStmtCacheSize(unsigned int size) {
+    stmt_cache_size_ = size;
+    while (stmt_lru_.size() > stmt_cache_size_) {
+        stmt_index_.erase(stmt_lru_.back().first);
+        stmt_lru_.pop_back();
+    }
+}
+
+void Connection::clearStatements() {
+    stmt_index_.clear();
+    stmt_lru_.clear();
+}
+
+boost::shared_ptr<PreparedStatement> Connection::prepareStatement(const std::string &sql) {
+    std::map<std::string, STMT_LRU::iterator>::iterator it = stmt_index_.find(sql);
+    if (it != stmt_index_.end()) {
+        stmt_lru_.splice(stmt_lru_.begin(), stmt_lru_, it->second);
+        return it->second->second;
+    }
+
+    boost::shared_ptr<PreparedStatement> stmt(new PreparedStatement(&mysql_));
+    stmt->prepare(sql);
+    if (stmt_cache_size_ == 0)
+        return stmt;
+
+    stmt_lru_.push_front(std::make_pair(sql, stmt));
+    stmt_index_[sql] = stmt_lru_.begin();
+    while (stmt_lru_.size() > stmt_cache_size_) {
+        stmt_index_.erase(stmt_lru_.back().first);
+        stmt_lru_.pop_back();
+    }
+    return stmt;
+}
+
+ResultSet Connection::executePrepared(const CompiledSQL &tpl, const ParamList *param) {
+    //an IN list expands to one marker per element, so its text depends on the sizes
+    const std::string *sql = &tpl.preparedText();
+    std::string expanded;
+    if (param != NULL) {
+        const std::vector<CompiledSQL::Slot> &slots = tpl.slots();
+        for (std::vector<CompiledSQL::Slot>::const_iterator it = slots.begin(); it != slots.end(); ++it) {
+            int type = (it->index <= (int)param->size) ? (*param)[it->index - 1].type : -1;
+            if (type == Parameter::INT_VECTOR || type == Parameter::STRING_VECTOR) {
+                sql = &expanded;
+                break;
+            }
+        }
+    }
+    if (sql == &expanded) {
+        const std::string &text = tpl.text();
+        const std::vector<CompiledSQL::Slot> &slots = tpl.slots();
+        size_t last = 0;
+        for (std::vector<CompiledSQL::Slot>::const_iterator it = slots.begin(); it != slots.end(); ++it) {
+            expanded.append(text, last, it->offset - last);
+            last = it->offset + it->length;
+
+            const Parameter &p = (*param)[it->index - 1];
+            size_t markers = (p.type == Parameter::INT_VECTOR) ? p.data.int_vec->size() :
+                             (p.type == Parameter::STRING_VECTOR) ? p.data.str_vec->size() : 1;
+            for (size_t i = 0; i < markers; ++i) {
+                expanded.append(i == 0 ? "?" : ",?");
+            }
+        }
+        expanded.append(text, last, std::string::npos);
+    }
+
+    boost::shared_ptr<PreparedStatement> stmt = prepareStatement(*sql);
+    stmt->bindParams(tpl, param);
+    stmt->execute();
+
+    boost::shared_ptr<PreparedResult> result;
+    if (mysql_stmt_field_count(stmt->handle()) > 0) {
+        result.reset(new PreparedResult(stmt, stmt_cache_size_ > 0));
+    }
+    return ResultSet(result, mysql_stmt_affected_rows(stmt->handle()), mysql_stmt_insert_id(stmt->handle()));
+}
+
 void Connection::begin() {
     if (mysql_query(&mysql_, "begin") != 0) {
         throw Exception(&mysql_);
@@ -203,10 +730,32 @@ void Connection::setCharSet(const std::string &name) {
 }
 
 /* Statement */
-Statement::Statement(MYSQL *mysql): mysql_(mysql) {
+//statements past this size give their buffer up instead of keeping it around
+static const size_t ARENA_LIMIT = 4 << 20;
+
+Statement::Statement(MYSQL *mysql, std::string *arena): mysql_(mysql), arena_(arena), plain_scan_(false) {
+    if (arena_ != NULL) {
+        sql_.swap(*arena_);
+        sql_.clear();
+    }
+}
+
+//copies never own the arena, only the statement created on it gives it back
+Statement::Statement(const Statement &other)
+: mysql_(other.mysql_), arena_(NULL), plain_scan_(other.plain_scan_), sql_(other.sql_) {
+}
+
+Statement &Statement::operator=(const Statement &other) {
+    mysql_ = other.mysql_;
+    plain_scan_ = other.plain_scan_;
+    sql_ = other.sql_;
+    return *this;
 }
 
 Statement::~Statement() {
+    if (arena_ != NULL && sql_.capacity() <= ARENA_LIMIT) {
+        arena_->swap(sql_);
+    }
 }
 
 void Statement::prepare(const std::string &sql) {
@@ -226,111 +775,427 @@ ResultSet Statement::execute() {
     return ResultSet(pResult, affected_row, mysql_insert_id(mysql_) );
 }
 
-static std::string join(const std::vector<int64_t> &vec, const char *c) {
-    char buf[23];
-    std::string out;
+bool Statement::moreResults() {
+    return mysql_more_results(mysql_) != 0;
+}
 
-    for (std::vector<int64_t>::size_type i = 0, j = vec.size(); i < j; ++i) {
-#if __WORDSIZE == 64
-        int len = snprintf(buf, sizeof(buf), "%ld", vec[i]);
-#else
-        int len = snprintf(buf, sizeof(buf), "%lld", vec[i]);
-#endif
-        out.append(buf, len);
-        if (i + 1 < vec.size())
-            out.append(c);
+ResultSet Statement::nextResult() {
+    int rc = mysql_next_result(mysql_);
+    if (rc > 0) {
+        throw Exception(mysql_);
+    } else if (rc < 0) {
+        throw Exception(-1, "No more results");
     }
 
-    return out;
+    MYSQL_RES *result = mysql_store_result(mysql_);
+    if (result == NULL && mysql_field_count(mysql_) != 0) {
+        throw Exception(mysql_);
+    }
+    uint32_t affected_row = mysql_affected_rows(mysql_);
+
+    boost::shared_ptr<MYSQL_RES> pResult(result, FreeMySQLResult());
+
+    return ResultSet(pResult, affected_row, mysql_insert_id(mysql_));
 }
 
-static std::string::size_type replace(std::string &sql, const char *from, const std::string &to, std::string::size_type pos) {
-    sql.erase(pos, strlen(from));
-    sql.insert(pos, to);
-    return pos + to.size();
+void Statement::discardResults() {
+    while (mysql_more_results(mysql_) && mysql_next_result(mysql_) == 0) {
+        mysql_free_result(mysql_store_result(mysql_));
+    }
 }
 
-std::string::size_type Statement::bindInt(std::string::size_type pos, const char *from, int64_t i) {
-    std::string to;
-    to.resize(23);
+ResultSet Statement::executeStream(const StreamOptions &options) {
+    if (mysql_real_query(mysql_, sql_.data(), sql_.size()) != 0) {
+        throw Exception(mysql_);
+    }
+
+    MYSQL_RES *result = mysql_use_result(mysql_);
+    if (result == NULL) {
+        if (mysql_field_count(mysql_) != 0) {
+            throw Exception(mysql_);
+        }
+        //not a select, nothing to stream
+        return ResultSet(boost::shared_ptr<MYSQL_RES>(), mysql_affected_rows(mysql_), mysql_insert_id(mysql_));
+    }
+
+    boost::shared_ptr<StreamResult> stream(new StreamResult(mysql_, result, options));
+    return ResultSet(stream, 0, 0);
+}
+
+static const char DIGIT_PAIRS[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static inline size_t digitsOf(uint64_t v) {
+    size_t n = 1;
+    for (;;) {
+        if (v < 10) return n;
+        if (v < 100) return n + 1;
+        if (v < 1000) return n + 2;
+        if (v < 10000) return n + 3;
+        v /= 10000;
+        n += 4;
+    }
+}
+
+/* exact length of i in decimal */
+static inline size_t sizeOfInt(int64_t i) {
+    return (i < 0) ? digitsOf(0 - (uint64_t) i) + 1 : digitsOf((uint64_t) i);
+}
+
+/* write the len digits of v backwards from to+len, two per step */
+static inline void writeUInt(char *to, uint64_t v, size_t len) {
+    char *p = to + len;
+    while (v >= 100) {
+        const char *d = DIGIT_PAIRS + (v % 100) * 2;
+        v /= 100;
+        *--p = d[1];
+        *--p = d[0];
+    }
+    if (v >= 10) {
+        *--p = DIGIT_PAIRS[v * 2 + 1];
+        *--p = DIGIT_PAIRS[v * 2];
+    } else {
+        *--p = (char) ('0' + v);
+    }
+}
+
+static char *writeDigits(char *to, unsigned long v, int width) {
+    for (int i = width - 1; i >= 0; --i) {
+        to[i] = '0' + v % 10;
+        v /= 10;
+    }
+    return to + width;
+}
+
+/* same text the server sends for temporal columns over the text protocol */
+static size_t formatTime(char *to, const MYSQL_TIME &t, unsigned int decimals) {
+    char *p = to;
+    if (t.time_type == MYSQL_TIMESTAMP_TIME) {
+        if (t.neg)
+            *p++ = '-';
+        p = writeDigits(p, t.hour, t.hour > 99 ? 3 : 2);
+    } else {
+        p = writeDigits(p, t.year, 4);
+        *p++ = '-';
+        p = writeDigits(p, t.month, 2);
+        *p++ = '-';
+        p = writeDigits(p, t.day, 2);
+        if (t.time_type == MYSQL_TIMESTAMP_DATE)
+            return p - to;
+        *p++ = ' ';
+        p = writeDigits(p, t.hour, 2);
+    }
+    *p++ = ':';
+    p = writeDigits(p, t.minute, 2);
+    *p++ = ':';
+    p = writeDigits(p, t.second, 2);
+    if (decimals > 0 && decimals <= 6) {
+        unsigned long frac = t.second_part;
+        for (unsigned int i = decimals; i < 6; ++i)
+            frac /= 10;
+        *p++ = '.';
+        p = writeDigits(p, frac, decimals);
+    }
+    return p - to;
+}
+
+size_t Statement::bindInt(char *to, int64_t i) {
+    if (i < 0) {
+        uint64_t v = 0 - (uint64_t) i;
+        size_t len = digitsOf(v);
+        *to = '-';
+        writeUInt(to + 1, v, len);
+        return len + 1;
+    }
+    size_t len = digitsOf((uint64_t) i);
+    writeUInt(to, (uint64_t) i, len);
+    return len;
+}
+
+Statement &Statement::appendInt(int64_t i) {
+    size_t size = sql_.size();
+    sql_.resize(size + sizeOfInt(i));
+    bindInt(&sql_[size], i);
+    return *this;
+}
 
-    char *buf = (char *) to.data();
-#if __WORDSIZE == 64
-    int len = snprintf(buf, 23, "%ld", i);
+Statement &Statement::appendUInt(uint64_t i) {
+    size_t size = sql_.size();
+    size_t len = digitsOf(i);
+    sql_.resize(size + len);
+    writeUInt(&sql_[size], i, len);
+    return *this;
+}
+
+/*
+ * Bytes mysql_real_escape_string may rewrite. Runs of other bytes are
+ * copied as they are, only the rest of a value from its first special byte
+ * goes through the library.
+ */
+static inline bool needsEscape(unsigned char c) {
+    return c == '\'' || c == '"' || c == '\\' || c == '\n' || c == '\r' || c == '\0' || c == '\032';
+}
+
+static size_t scanPlainScalar(const char *p, size_t size, size_t i) {
+    for (; i < size; ++i) {
+        if (needsEscape((unsigned char) p[i]))
+            break;
+    }
+    return i;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+__attribute__((target("sse2")))
+static size_t scanPlainSSE2(const char *p, size_t size) {
+    const __m128i quote = _mm_set1_epi8('\''), dquote = _mm_set1_epi8('"'), slash = _mm_set1_epi8('\\');
+    const __m128i lf = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r'), nul = _mm_setzero_si128(), sub = _mm_set1_epi8('\032');
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, dquote)),
+                                                _mm_or_si128(_mm_cmpeq_epi8(v, slash), _mm_cmpeq_epi8(v, lf))),
+                                   _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, nul)),
+                                                _mm_cmpeq_epi8(v, sub)));
+        int mask = _mm_movemask_epi8(hit);
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+    return scanPlainScalar(p, size, i);
+}
+
+__attribute__((target("avx2")))
+static size_t scanPlainAVX2(const char *p, size_t size) {
+    const __m256i quote = _mm256_set1_epi8('\''), dquote = _mm256_set1_epi8('"'), slash = _mm256_set1_epi8('\\');
+    const __m256i lf = _mm256_set1_epi8('\n'), cr = _mm256_set1_epi8('\r'), nul = _mm256_setzero_si256(), sub = _mm256_set1_epi8('\032');
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (p + i));
+        __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, dquote)),
+                                                      _mm256_or_si256(_mm256_cmpeq_epi8(v, slash), _mm256_cmpeq_epi8(v, lf))),
+                                      _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, nul)),
+                                                      _mm256_cmpeq_epi8(v, sub)));
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8(hit);
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+    return scanPlainScalar(p, size, i);
+}
+
+static size_t (*resolveScanPlain())(const char *, size_t) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return scanPlainAVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return scanPlainSSE2;
+    return NULL;
+}
+
+static size_t (* const SCAN_PLAIN)(const char *, size_t) = resolveScanPlain();
 #else
-    int len = snprintf(buf, 23, "%lld", i);
+static size_t (* const SCAN_PLAIN)(const char *, size_t) = NULL;
 #endif
-    to.resize(len);
-    return replace(sql_, from, to, pos);
+
+/* length of the prefix of p that needs no escaping */
+static inline size_t scanPlain(const char *p, size_t size) {
+    return (SCAN_PLAIN != NULL) ? SCAN_PLAIN(p, size) : scanPlainScalar(p, size, 0);
+}
+
+/*
+ * Splitting a value before a special byte is only safe when no multibyte
+ * character can contain one, true for the ASCII compatible charsets. gbk,
+ * big5, sjis and friends allow '\\' as a trailing byte and keep going
+ * through the library byte by byte.
+ */
+static bool plainScanSafe(MYSQL *mysql) {
+    const char *name = (mysql != NULL) ? mysql_character_set_name(mysql) : NULL;
+    if (name == NULL)
+        return false;
+    return strncmp(name, "utf8", 4) == 0 || strncmp(name, "latin", 5) == 0
+        || strcmp(name, "ascii") == 0 || strcmp(name, "binary") == 0;
+}
+
+/* upper bound of bindString(), exact when nothing needs escaping */
+static size_t boundOfString(const char *data, size_t size, bool scan) {
+    size_t plain = scan ? scanPlain(data, size) : 0;
+    return plain + (size - plain) * 2 + 2;
 }
 
 std::string Statement::escape(const std::string &fr) {
+    plain_scan_ = plainScanSafe(mysql_);
     std::string to;
-    if (fr.empty()) {
-        to.assign("''");
-    } else {
-        to.resize(fr.size() * 2 + 3);
-        char *buf = (char *) to.data();
-        buf[0] = '\'';
-        int len = mysql_real_escape_string(mysql_, buf + 1, fr.data(), fr.size());
-        buf[len + 1] = '\'';
-        to.resize(len + 2);
-    }
-
+    to.resize(boundOfString(fr.data(), fr.size(), plain_scan_));
+    to.resize(bindString(&to[0], fr.data(), fr.size()));
     return to;
 }
 
-std::string::size_type Statement::bindString(std::string::size_type pos, const char *from, const char *data, size_t size) {
-    std::string to;
+size_t Statement::bindString(char *to, const char *data, size_t size) {
+    to[0] = '\'';
+    size_t len = plain_scan_ ? scanPlain(data, size) : 0;
+    memcpy(to + 1, data, len);
+    if (len < size) {
+        len += mysql_real_escape_string(mysql_, to + 1 + len, data + len, size - len);
+    }
+    to[len + 1] = '\'';
+    return len + 2;
+}
+
+//longest shortest-round-trip double, "-2.2250738585072014e-308"
+static const size_t DOUBLE_SIZE = 24;
 
-    if (size == 0) {
-        to.assign("''");
-    } else {      
-        to.resize(size * 2 + 3);
-        char *buf = (char *) to.data();
-        buf[0] = '\'';
-        int len = mysql_real_escape_string(mysql_, buf + 1, data, size);
-        buf[len + 1] = '\'';
-        to.resize(len + 2);
-    }             
-    return replace(sql_, from, to, pos);
+//quoted "-838:59:59.000000" or "2024-01-31 23:59:59.000000"
+static const size_t TIME_SIZE = 28;
+
+static size_t boundOf(const Parameter &p, bool scan) {
+    switch (p.type) {
+        case Parameter::INTEGER:
+            return sizeOfInt(p.data.integer);
+        case Parameter::STRING:
+            return boundOfString(p.data.string, strlen(p.data.string), scan);
+        case Parameter::BLOB:
+            return boundOfString(p.data.blob->data(), p.data.blob->size(), scan);
+        case Parameter::INT_VECTOR:
+            {
+                //exact, a 5000 element list is sized in one pass
+                const std::vector<int64_t> &vec = *(p.data.int_vec);
+                size_t size = vec.empty() ? 0 : vec.size() - 1;
+                for (std::vector<int64_t>::const_iterator it = vec.begin(); it != vec.end(); ++it) {
+                    size += sizeOfInt(*it);
+                }
+                return size;
+            }
+        case Parameter::UINT64:
+            return digitsOf(p.data.uinteger);
+        case Parameter::DOUBLE:
+            return DOUBLE_SIZE;
+        case Parameter::NULL_VALUE:
+            return 4;
+        case Parameter::DATETIME:
+            return TIME_SIZE;
+        case Parameter::STRING_VIEW:
+            return boundOfString(p.data.view.data, p.data.view.size, scan);
+        case Parameter::STRING_VECTOR:
+            {
+                const std::vector<std::string> &vec = *(p.data.str_vec);
+                size_t size = vec.empty() ? 0 : vec.size() - 1;
+                for (std::vector<std::string>::const_iterator it = vec.begin(); it != vec.end(); ++it) {
+                    size += boundOfString(it->data(), it->size(), scan);
+                }
+                return size;
+            }
+        default:
+            return 0;
+    }
 }
 
 void Statement::bindParams(const std::vector<Parameter> &param) {
-    int idx;
-    char from[4];
-    std::string::size_type pos = 0;
+    CompiledSQL tpl(sql_);
+    bindParams(tpl, param);
+}
 
-    do {
-        pos = sql_.find(":", pos);
-        if (pos == std::string::npos)
-            break;
+static bool slotBefore(const CompiledSQL::Slot &slot, size_t offset) {
+    return slot.offset < offset;
+}
 
-        idx = atoi(sql_.c_str() + pos + 1);
-        assert(idx != 0 && (int)param.size() >= idx);
-        snprintf(from, sizeof(from), ":%d", idx);
-        const Parameter &p = param[idx - 1];
+/* upper bound of rendering text()[from, to) */
+static size_t boundOf(const CompiledSQL &tpl, size_t from, size_t to, const Parameter *param, bool scan) {
+    const std::vector<CompiledSQL::Slot> &slots = tpl.slots();
+    size_t bound = to - from;
+    for (std::vector<CompiledSQL::Slot>::const_iterator it = std::lower_bound(slots.begin(), slots.end(), from, slotBefore);
+         it != slots.end() && it->offset < to; ++it) {
+        bound += boundOf(param[it->index - 1], scan) - it->length;
+    }
+    return bound;
+}
 
+char *Statement::render(char *pos, const CompiledSQL &tpl, size_t from, size_t to, const Parameter *param) {
+    const std::vector<CompiledSQL::Slot> &slots = tpl.slots();
+    const char *text = tpl.text().data();
+    size_t last = from;
+
+    for (std::vector<CompiledSQL::Slot>::const_iterator it = std::lower_bound(slots.begin(), slots.end(), from, slotBefore);
+         it != slots.end() && it->offset < to; ++it) {
+        memcpy(pos, text + last, it->offset - last);
+        pos += it->offset - last;
+        last = it->offset + it->length;
+
+        const Parameter &p = param[it->index - 1];
         switch (p.type) {
             case Parameter::INTEGER:
                 {
-                    pos = bindInt(pos, from, p.data.integer);
+                    pos += bindInt(pos, p.data.integer);
                     break;
                 }
             case Parameter::STRING:
                 {
-                    pos = bindString(pos, from, p.data.string, strlen(p.data.string));
+                    pos += bindString(pos, p.data.string, strlen(p.data.string));
                     break;
                 }
             case Parameter::BLOB:
                 {
-                    pos = bindString(pos, from, p.data.blob->data(), p.data.blob->size());
+                    pos += bindString(pos, p.data.blob->data(), p.data.blob->size());
                     break;
                 }
             case Parameter::INT_VECTOR:
                 {
-                    std::string vec = join(*(p.data.int_vec), ",");
-                    pos = replace(sql_, from, vec, pos);
+                    const std::vector<int64_t> &vec = *(p.data.int_vec);
+                    for (std::vector<int64_t>::size_type i = 0; i < vec.size(); ++i) {
+                        if (i != 0)
+                            *pos++ = ',';
+                        pos += bindInt(pos, vec[i]);
+                    }
+                    break;
+                }
+            case Parameter::UINT64:
+                {
+                    size_t len = digitsOf(p.data.uinteger);
+                    writeUInt(pos, p.data.uinteger, len);
+                    pos += len;
+                    break;
+                }
+            case Parameter::DOUBLE:
+                {
+                    if (!std::isfinite(p.data.real)) {
+                        throw Exception(-1, "Parameter %d is not a finite number", it->index);
+                    }
+                    pos = std::to_chars(pos, pos + DOUBLE_SIZE, p.data.real).ptr;
+                    break;
+                }
+            case Parameter::NULL_VALUE:
+                {
+                    memcpy(pos, "NULL", 4);
+                    pos += 4;
+                    break;
+                }
+            case Parameter::DATETIME:
+                {
+                    const MYSQL_TIME &t = *(p.data.time);
+                    *pos++ = '\'';
+                    pos += formatTime(pos, t, t.second_part != 0 ? 6 : 0);
+                    *pos++ = '\'';
+                    break;
+                }
+            case Parameter::STRING_VIEW:
+                {
+                    pos += bindString(pos, p.data.view.data, p.data.view.size);
+                    break;
+                }
+            case Parameter::STRING_VECTOR:
+                {
+                    const std::vector<std::string> &vec = *(p.data.str_vec);
+                    for (std::vector<std::string>::size_type i = 0; i < vec.size(); ++i) {
+                        if (i != 0)
+                            *pos++ = ',';
+                        pos += bindString(pos, vec[i].data(), vec[i].size());
+                    }
                     break;
                 }
             default:
@@ -338,5 +1203,637 @@ void Statement::bindParams(const std::vector<Parameter> &param) {
                     break;
                 }
         }
-    } while (pos < sql_.size());
+    }
+    memcpy(pos, text + last, to - last);
+    return pos + (to - last);
+}
+
+void Statement::bindParams(const CompiledSQL &tpl, const ParamList &param) {
+    if (tpl.arity() > (int)param.size) {
+        throw Exception(-1, "Too few parameters: %d expected, %d given", tpl.arity(), (int)param.size);
+    }
+
+    //size the output once, then copy literals and values in a single pass
+    size_t size = tpl.text().size();
+    const Parameter *values = param.data;
+    plain_scan_ = plainScanSafe(mysql_);
+    sql_.resize(boundOf(tpl, 0, size, values, plain_scan_));
+    char *pos = render(&sql_[0], tpl, 0, size, values);
+    sql_.resize(pos - sql_.data());
+}
+
+size_t Statement::bindBatch(const CompiledSQL &tpl, const Parameter *rows, size_t count, size_t columns, size_t limit) {
+    size_t begin = tpl.valuesBegin(), end = tpl.valuesEnd(), size = tpl.text().size();
+    if (begin == std::string::npos) {
+        throw Exception(-1, "No VALUES (...) row in batch statement: %s", tpl.text().c_str());
+    }
+    if (tpl.arity() > (int)columns) {
+        throw Exception(-1, "Too few parameters: %d expected, %d given", tpl.arity(), (int)columns);
+    }
+
+    //placeholders outside the row take the values of the first row
+    plain_scan_ = plainScanSafe(mysql_);
+    size_t bound = boundOf(tpl, 0, begin, rows, plain_scan_) + boundOf(tpl, end, size, rows, plain_scan_);
+    size_t n = 0;
+    for (; n < count; ++n) {
+        size_t row = boundOf(tpl, begin, end, rows + n * columns, plain_scan_) + (n > 0 ? 1 : 0);
+        if (n > 0 && bound + row > limit)
+            break;
+        bound += row;
+    }
+
+    sql_.resize(bound);
+    char *pos = render(&sql_[0], tpl, 0, begin, rows);
+    for (size_t i = 0; i < n; ++i) {
+        if (i > 0)
+            *pos++ = ',';
+        pos = render(pos, tpl, begin, end, rows + i * columns);
+    }
+    pos = render(pos, tpl, end, size, rows);
+    sql_.resize(pos - sql_.data());
+    return n;
+}
+
+/* PreparedStatement */
+PreparedStatement::PreparedStatement(MYSQL *mysql): generation_(0) {
+    stmt_ = mysql_stmt_init(mysql);
+    if (stmt_ == NULL) {
+        throw Exception(mysql);
+    }
+}
+
+PreparedStatement::~PreparedStatement() {
+    mysql_stmt_close(stmt_);
+}
+
+void PreparedStatement::prepare(const std::string &sql) {
+    if (mysql_stmt_prepare(stmt_, sql.data(), sql.size()) != 0) {
+        throw Exception(stmt_);
+    }
+
+    //lets PreparedResult size its column buffers from the stored rows
+    my_bool update_max_length = 1;
+    mysql_stmt_attr_set(stmt_, STMT_ATTR_UPDATE_MAX_LENGTH, &update_max_length);
+}
+
+void PreparedStatement::bindParams(const CompiledSQL &tpl, const ParamList *param) {
+    binds_.clear();
+
+    if (param != NULL) {
+        const std::vector<CompiledSQL::Slot> &slots = tpl.slots();
+        if (tpl.arity() > (int)param->size) {
+            throw Exception(-1, "Too few parameters: %d expected, %d given", tpl.arity(), (int)param->size);
+        }
+
+        for (std::vector<CompiledSQL::Slot>::const_iterator it = slots.begin(); it != slots.end(); ++it) {
+            const Parameter &p = (*param)[it->index - 1];
+            MYSQL_BIND b;
+            memset(&b, 0, sizeof(b));
+
+            switch (p.type) {
+                case Parameter::INTEGER:
+                    {
+                        b.buffer_type = MYSQL_TYPE_LONGLONG;
+                        b.buffer = (void *) &p.data.integer;
+                        binds_.push_back(b);
+                        break;
+                    }
+                case Parameter::STRING:
+                    {
+                        b.buffer_type = MYSQL_TYPE_STRING;
+                        b.buffer = (void *) p.data.string;
+                        b.buffer_length = strlen(p.data.string);
+                        binds_.push_back(b);
+                        break;
+                    }
+                case Parameter::BLOB:
+                    {
+                        b.buffer_type = MYSQL_TYPE_BLOB;
+                        b.buffer = (void *) p.data.blob->data();
+                        b.buffer_length = p.data.blob->size();
+                        binds_.push_back(b);
+                        break;
+                    }
+                case Parameter::INT_VECTOR:
+                    {
+                        const std::vector<int64_t> &vec = *(p.data.int_vec);
+                        b.buffer_type = MYSQL_TYPE_LONGLONG;
+                        for (std::vector<int64_t>::size_type i = 0; i < vec.size(); ++i) {
+                            b.buffer = (void *) &vec[i];
+                            binds_.push_back(b);
+                        }
+                        break;
+                    }
+                case Parameter::UINT64:
+                    {
+                        b.buffer_type = MYSQL_TYPE_LONGLONG;
+                        b.buffer = (void *) &p.data.uinteger;
+                        b.is_unsigned = 1;
+                        binds_.push_back(b);
+                        break;
+                    }
+                case Parameter::DOUBLE:
+                    {
+                        b.buffer_type = MYSQL_TYPE_DOUBLE;
+                        b.buffer = (void *) &p.data.real;
+                        binds_.push_back(b);
+                        break;
+                    }
+                case Parameter::NULL_VALUE:
+                    {
+                        b.buffer_type = MYSQL_TYPE_NULL;
+                        binds_.push_back(b);
+                        break;
+                    }
+                case Parameter::DATETIME:
+                    {
+                        const MYSQL_TIME &t = *(p.data.time);
+                        b.buffer_type = (t.time_type == MYSQL_TIMESTAMP_DATE) ? MYSQL_TYPE_DATE :
+                                        (t.time_type == MYSQL_TIMESTAMP_TIME) ? MYSQL_TYPE_TIME : MYSQL_TYPE_DATETIME;
+                        b.buffer = (void *) &t;
+                        b.buffer_length = sizeof(MYSQL_TIME);
+                        binds_.push_back(b);
+                        break;
+                    }
+                case Parameter::STRING_VIEW:
+                    {
+                        b.buffer_type = MYSQL_TYPE_STRING;
+                        b.buffer = (void *) p.data.view.data;
+                        b.buffer_length = p.data.view.size;
+                        binds_.push_back(b);
+                        break;
+                    }
+                case Parameter::STRING_VECTOR:
+                    {
+                        const std::vector<std::string> &vec = *(p.data.str_vec);
+                        b.buffer_type = MYSQL_TYPE_STRING;
+                        for (std::vector<std::string>::size_type i = 0; i < vec.size(); ++i) {
+                            b.buffer = (void *) vec[i].data();
+                            b.buffer_length = vec[i].size();
+                            binds_.push_back(b);
+                        }
+                        break;
+                    }
+                default:
+                    {
+                        break;
+                    }
+            }
+        }
+    }
+
+    if (binds_.size() != mysql_stmt_param_count(stmt_)) {
+        throw Exception(-1, "Parameter count mismatch: %d expected, %d bound",
+                        (int)mysql_stmt_param_count(stmt_), (int)binds_.size());
+    }
+    if (!binds_.empty() && mysql_stmt_bind_param(stmt_, &binds_[0]) != 0) {
+        throw Exception(stmt_);
+    }
+}
+
+void PreparedStatement::execute() {
+    ++generation_;
+    mysql_stmt_free_result(stmt_);
+    if (mysql_stmt_execute(stmt_) != 0) {
+        throw Exception(stmt_);
+    }
+}
+
+/* PreparedResult */
+static bool isTextual(enum_field_types type) {
+    switch (type) {
+        case MYSQL_TYPE_VARCHAR:
+        case MYSQL_TYPE_VAR_STRING:
+        case MYSQL_TYPE_STRING:
+        case MYSQL_TYPE_TINY_BLOB:
+        case MYSQL_TYPE_MEDIUM_BLOB:
+        case MYSQL_TYPE_LONG_BLOB:
+        case MYSQL_TYPE_BLOB:
+        case MYSQL_TYPE_ENUM:
+        case MYSQL_TYPE_SET:
+        case MYSQL_TYPE_GEOMETRY:
+        case MYSQL_TYPE_JSON:
+        case MYSQL_TYPE_BIT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+PreparedResult::PreparedResult(boost::shared_ptr<PreparedStatement> stmt, bool cached)
+: stmt_(stmt), owned_(cached ? boost::shared_ptr<PreparedStatement>() : stmt), handle_(stmt->handle()), generation_(stmt->generation()), valid_(false), overflowed_(false) {
+    if (mysql_stmt_store_result(handle_) != 0) {
+        throw Exception(handle_);
+    }
+    metadata_ = boost::shared_ptr<MYSQL_RES>(mysql_stmt_result_metadata(handle_), FreeMySQLResult());
+    if (metadata_.get() == NULL) {
+        throw Exception(handle_);
+    }
+
+    unsigned int columns = mysql_num_fields(metadata_.get());
+    MYSQL_FIELD *fields = mysql_fetch_fields(metadata_.get());
+    std::vector<size_t> offsets(columns + 1);
+    cells_.resize(columns);
+
+    //one fixed layout buffer for the whole row, bound once and refilled by every fetch
+    size_t total = 0;
+    for (unsigned int i = 0; i < columns; ++i) {
+        Cell &cell = cells_[i];
+        size_t size;
+        switch (fields[i].type) {
+            case MYSQL_TYPE_TINY:
+            case MYSQL_TYPE_SHORT:
+            case MYSQL_TYPE_INT24:
+            case MYSQL_TYPE_LONG:
+            case MYSQL_TYPE_LONGLONG:
+            case MYSQL_TYPE_YEAR:
+                cell.kind = (fields[i].flags & UNSIGNED_FLAG) ? CELL_UINT : CELL_INT;
+                size = sizeof(int64_t);
+                break;
+            case MYSQL_TYPE_FLOAT:
+            case MYSQL_TYPE_DOUBLE:
+                cell.kind = CELL_DOUBLE;
+                size = sizeof(double);
+                break;
+            case MYSQL_TYPE_DATE:
+            case MYSQL_TYPE_NEWDATE:
+            case MYSQL_TYPE_TIME:
+            case MYSQL_TYPE_DATETIME:
+            case MYSQL_TYPE_TIMESTAMP:
+                cell.kind = CELL_TIME;
+                size = sizeof(MYSQL_TIME);
+                break;
+            default:
+                //strings, blobs and decimals keep their text form
+                cell.kind = CELL_TEXT;
+                size = fields[i].max_length + 1;
+                if (!isTextual(fields[i].type) && size < 66)
+                    size = 66;
+                break;
+        }
+        cell.decimals = fields[i].decimals;
+        offsets[i] = total;
+        total += (size + 7) & ~(size_t)7;
+    }
+    offsets[columns] = total;
+
+    buffer_.resize(total / 8 + 1);
+    scratch_.resize(columns * SCRATCH_SIZE + 1);
+    overflow_.resize(columns);
+    binds_.resize(columns);
+    for (unsigned int i = 0; i < columns; ++i) {
+        MYSQL_BIND &b = binds_[i];
+        memset(&b, 0, sizeof(b));
+        switch (cells_[i].kind) {
+            case CELL_INT:
+            case CELL_UINT:
+                b.buffer_type = MYSQL_TYPE_LONGLONG;
+                b.is_unsigned = (cells_[i].kind == CELL_UINT);
+                break;
+            case CELL_DOUBLE:
+                b.buffer_type = MYSQL_TYPE_DOUBLE;
+                break;
+            case CELL_TIME:
+                b.buffer_type = fields[i].type;
+                break;
+            default:
+                b.buffer_type = MYSQL_TYPE_STRING;
+                break;
+        }
+        b.buffer = (char *) &buffer_[0] + offsets[i];
+        b.buffer_length = offsets[i + 1] - offsets[i];
+        b.length = &cells_[i].length;
+        b.is_null = &cells_[i].is_null;
+        b.error = &cells_[i].error;
+    }
+    if (columns > 0 && mysql_stmt_bind_result(handle_, &binds_[0]) != 0) {
+        throw Exception(handle_);
+    }
+}
+
+PreparedResult::~PreparedResult() {
+}
+
+bool PreparedResult::next() {
+    boost::shared_ptr<PreparedStatement> stmt = owned_.get() != NULL ? owned_ : stmt_.lock();
+    if (stmt.get() == NULL || stmt->generation() != generation_) {
+        throw Exception(-1, "Result set invalidated by a later use of its statement");
+    }
+
+    int rc = mysql_stmt_fetch(handle_);
+    if (rc == MYSQL_NO_DATA) {
+        valid_ = false;
+        return false;
+    } else if (rc != 0 && rc != MYSQL_DATA_TRUNCATED) {
+        valid_ = false;
+        throw Exception(handle_);
+    }
+
+    if (overflowed_) {
+        for (unsigned int i = 0; i < cells_.size(); ++i)
+            overflow_[i].clear();
+        overflowed_ = false;
+    }
+    if (rc == MYSQL_DATA_TRUNCATED) {
+        for (unsigned int i = 0; i < cells_.size(); ++i) {
+            if (cells_[i].kind != CELL_TEXT || !cells_[i].error)
+                continue;
+            overflow_[i].resize(cells_[i].length);
+            MYSQL_BIND b = binds_[i];
+            b.buffer = &overflow_[i][0];
+            b.buffer_length = cells_[i].length;
+            if (mysql_stmt_fetch_column(handle_, &b, i, 0) != 0) {
+                throw Exception(handle_);
+            }
+            overflowed_ = true;
+        }
+    }
+    valid_ = true;
+    return true;
+}
+
+const PreparedResult::Cell &PreparedResult::cell(unsigned int index) const {
+    if (!valid_)
+        throw Exception(-1, "End of result set");
+    return cells_[index];
+}
+
+Column PreparedResult::get(unsigned int index) const {
+    const Cell &c = cell(index);
+    if (c.is_null)
+        return Column(NULL, 0);
+
+    const void *data = binds_[index].buffer;
+    char *text = &scratch_[index * SCRATCH_SIZE];
+    switch (c.kind) {
+        case CELL_INT:
+            return Column(text, snprintf(text, SCRATCH_SIZE, "%lld", (long long) *(const int64_t *) data));
+        case CELL_UINT:
+            return Column(text, snprintf(text, SCRATCH_SIZE, "%llu", (unsigned long long) *(const uint64_t *) data));
+        case CELL_DOUBLE:
+            {
+                std::to_chars_result r = std::to_chars(text, text + SCRATCH_SIZE - 1, *(const double *) data);
+                *r.ptr = '\0';
+                return Column(text, r.ptr - text);
+            }
+        case CELL_TIME:
+            {
+                size_t len = formatTime(text, *(const MYSQL_TIME *) data, c.decimals);
+                text[len] = '\0';
+                return Column(text, len);
+            }
+        default:
+            if (!overflow_[index].empty())
+                return Column(overflow_[index].data(), overflow_[index].size());
+            return Column((const char *) data, c.length);
+    }
+}
+
+long long PreparedResult::getInt(unsigned int index, long long df) const {
+    const Cell &c = cell(index);
+    if (c.is_null)
+        return df;
+
+    const void *data = binds_[index].buffer;
+    switch (c.kind) {
+        case CELL_INT:
+            return *(const int64_t *) data;
+        case CELL_UINT:
+            return (long long) *(const uint64_t *) data;
+        case CELL_DOUBLE:
+            return (long long) *(const double *) data;
+        default:
+            return get(index).toInt(df);
+    }
+}
+
+double PreparedResult::getDouble(unsigned int index, double df) const {
+    const Cell &c = cell(index);
+    if (c.is_null)
+        return df;
+
+    const void *data = binds_[index].buffer;
+    switch (c.kind) {
+        case CELL_INT:
+            return (double) *(const int64_t *) data;
+        case CELL_UINT:
+            return (double) *(const uint64_t *) data;
+        case CELL_DOUBLE:
+            return *(const double *) data;
+        default:
+            return get(index).toDouble(df);
+    }
+}
+
+bool PreparedResult::getTime(unsigned int index, MYSQL_TIME *out) const {
+    const Cell &c = cell(index);
+    if (c.is_null)
+        return false;
+    if (c.kind == CELL_TIME) {
+        *out = *(const MYSQL_TIME *) binds_[index].buffer;
+        return true;
+    }
+    return get(index).toTime(out);
+}
+
+/* StreamResult */
+StreamResult::StreamResult(MYSQL *mysql, MYSQL_RES *result, const StreamOptions &options)
+: mysql_(mysql), result_(result), options_(options), row_(NULL), lengths_(NULL),
+  current_(NULL), ready_(NULL), pos_(0), running_(false), stop_(false),
+  cancelled_(false), eof_(false), closed_(false), streamed_(false) {
+    columns_ = mysql_num_fields(result_);
+
+    //field metadata is copied so it outlives the MYSQL_RES
+    MYSQL_FIELD *fields = mysql_fetch_fields(result_);
+    fields_.assign(fields, fields + columns_);
+    fields_.push_back(MYSQL_FIELD());
+    names_.resize(columns_);
+    for (unsigned int i = 0; i < columns_; ++i) {
+        names_[i] = fields[i].name;
+    }
+    for (unsigned int i = 0; i < columns_; ++i) {
+        MYSQL_FIELD &f = fields_[i];
+        f.name = (char *) names_[i].c_str();
+        f.org_name = f.table = f.org_table = f.db = f.catalog = f.def = NULL;
+    }
+
+    pthread_mutex_init(&lock_, NULL);
+    pthread_cond_init(&cond_, NULL);
+    if (options_.prefetch) {
+        free_.push_back(&blocks_[0]);
+        free_.push_back(&blocks_[1]);
+        free_.push_back(&blocks_[2]);
+        running_ = (pthread_create(&thread_, NULL, prefetchLoop, this) == 0);
+    }
+}
+
+StreamResult::~StreamResult() {
+    close(NULL);
+    pthread_cond_destroy(&cond_);
+    pthread_mutex_destroy(&lock_);
+}
+
+void StreamResult::fill(Block *block) {
+    block->data.clear();
+    block->cells.clear();
+    block->rows = 0;
+    block->eof = false;
+    block->error = 0;
+
+    while (block->rows < options_.block_rows && block->data.size() < options_.block_bytes) {
+        MYSQL_ROW row = mysql_fetch_row(result_);
+        if (row == NULL) {
+            block->error = mysql_errno(mysql_);
+            if (block->error != 0)
+                block->errmsg = mysql_error(mysql_);
+            block->eof = true;
+            return;
+        }
+
+        unsigned long *lengths = mysql_fetch_lengths(result_);
+        for (unsigned int i = 0; i < columns_; ++i) {
+            Cell cell = { block->data.size(), lengths[i], row[i] == NULL };
+            if (!cell.null)
+                block->data.insert(block->data.end(), row[i], row[i] + lengths[i]);
+            block->data.push_back('\0');
+            block->cells.push_back(cell);
+        }
+        ++block->rows;
+    }
+}
+
+void *StreamResult::prefetchLoop(void *arg) {
+    StreamResult *self = (StreamResult *) arg;
+    mysql_thread_init();
+
+    for (;;) {
+        pthread_mutex_lock(&self->lock_);
+        while (self->free_.empty() && !self->stop_)
+            pthread_cond_wait(&self->cond_, &self->lock_);
+        if (self->stop_) {
+            pthread_mutex_unlock(&self->lock_);
+            break;
+        }
+        Block *block = self->free_.back();
+        self->free_.pop_back();
+        pthread_mutex_unlock(&self->lock_);
+
+        self->fill(block);
+
+        pthread_mutex_lock(&self->lock_);
+        while (self->ready_ != NULL && !self->stop_)
+            pthread_cond_wait(&self->cond_, &self->lock_);
+        if (self->stop_) {
+            self->free_.push_back(block);
+            pthread_mutex_unlock(&self->lock_);
+            break;
+        }
+        self->ready_ = block;
+        if (block->eof)
+            self->eof_ = true;
+        pthread_cond_broadcast(&self->cond_);
+        pthread_mutex_unlock(&self->lock_);
+
+        if (block->eof)
+            break;
+    }
+
+    mysql_thread_end();
+    return NULL;
+}
+
+bool StreamResult::next() {
+    if (closed_)
+        throw Exception(-1, "Stream already closed");
+
+    if (!options_.prefetch || !running_) {
+        if (eof_)
+            return false;
+        if ((row_ = mysql_fetch_row(result_)) == NULL) {
+            eof_ = true;
+            if (mysql_errno(mysql_) != 0)
+                throw Exception(mysql_);
+            return false;
+        }
+        lengths_ = mysql_fetch_lengths(result_);
+        streamed_ = true;
+        return true;
+    }
+
+    if (current_ != NULL && pos_ + 1 < current_->rows) {
+        ++pos_;
+        return true;
+    }
+    if (current_ != NULL && current_->eof) {
+        if (current_->error != 0)
+            throw Exception(current_->error, "%s", current_->errmsg.c_str());
+        return false;
+    }
+
+    pthread_mutex_lock(&lock_);
+    if (current_ != NULL) {
+        free_.push_back(current_);
+        pthread_cond_broadcast(&cond_);
+    }
+    while (ready_ == NULL)
+        pthread_cond_wait(&cond_, &lock_);
+    current_ = ready_;
+    ready_ = NULL;
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&lock_);
+
+    pos_ = 0;
+    if (current_->rows > 0) {
+        streamed_ = true;
+        return true;
+    }
+    if (current_->error != 0)
+        throw Exception(current_->error, "%s", current_->errmsg.c_str());
+    return false;
+}
+
+Column StreamResult::get(unsigned int index) const {
+    if (!options_.prefetch || !running_) {
+        if (row_ == NULL)
+            throw Exception(-1, "End of result set");
+        return Column(row_[index], lengths_[index]);
+    }
+
+    if (current_ == NULL || pos_ >= current_->rows)
+        throw Exception(-1, "End of result set");
+    const Cell &cell = current_->cells[pos_ * columns_ + index];
+    if (cell.null)
+        return Column(NULL, 0);
+    return Column(&current_->data[cell.offset], cell.length);
+}
+
+void StreamResult::cancel() {
+    cancelled_ = true;
+}
+
+void StreamResult::stopPrefetch() {
+    if (!running_)
+        return;
+
+    pthread_mutex_lock(&lock_);
+    stop_ = true;
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&lock_);
+    pthread_join(thread_, NULL);
+    running_ = false;
+}
+
+void StreamResult::close(Connection *conn) {
+    if (closed_)
+        return;
+    closed_ = true;
+    stopPrefetch();
+
+    //a cancelled stream drops the connection rather than reading what is left;
+    //once it is closed, freeing the result no longer touches the socket
+    if (cancelled_ && !eof_ && conn != NULL)
+        conn->disconnect();
+    mysql_free_result(result_);
+    result_ = NULL;
+    row_ = NULL;
 }
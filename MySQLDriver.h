@@ -5,8 +5,14 @@
 #include <mysql.h>
 #include <errmsg.h>
 #include <string>
+#include <string_view>
+#include <charconv>
 #include <vector>
+#include <list>
+#include <deque>
+#include <map>
 #include <string.h>
+#include <pthread.h>
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -14,6 +20,12 @@
 #include <stdarg.h>
 #include <string.h>
 #include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+
+//the non-blocking client API appeared in MySQL 8.0.16
+#if defined(MYSQL_VERSION_ID) && MYSQL_VERSION_ID >= 80016 && !defined(MARIADB_BASE_VERSION)
+#define MYSQLDB_HAVE_NONBLOCKING 1
+#endif
 
 namespace server {
 	namespace mysqldb {
@@ -30,7 +42,23 @@ namespace server {
 
 			std::string toString() const { if ( data_ == NULL ) return ""; else return std::string(data_, size_); }
 
-			long long toInt(long long df) const { return null()?df:atoll(data_); }
+			//the bytes of the column without a copy, empty for NULL
+			inline std::string_view view() const { return std::string_view(data_ == NULL ? "" : data_, size_); }
+
+			//the number the column starts with, df for NULL or text that is not one
+			template<typename T>
+			T to(T df) const {
+				T v = df;
+				if (data_ != NULL)
+					std::from_chars(data_, data_ + size_, v);
+				return v;
+			}
+
+			long long toInt(long long df) const { return to<long long>(df); }
+
+			double toDouble(double df) const { return to<double>(df); }
+
+			bool toTime(MYSQL_TIME *out) const;	//false for NULL
 
 			bool null() const { return data_ == NULL; }
 
@@ -55,6 +83,13 @@ namespace server {
 				strncpy(msg_, mysql_error(mysql),sizeof(msg_)-1);
 			}
 
+			explicit Exception(MYSQL_STMT *stmt)
+			{
+				code_ = mysql_stmt_errno(stmt);
+				memset(msg_,0,sizeof(msg_));
+				strncpy(msg_, mysql_stmt_error(stmt),sizeof(msg_)-1);
+			}
+
 			~Exception() {}
 
 			inline int code() const { return code_; }
@@ -79,21 +114,142 @@ namespace server {
 		};
 
 
+		class PreparedResult;
+		class StreamResult;
+		class Connection;
+
+		/*
+		 * name -> index of the columns of one result, an open addressed
+		 * table built once and shared by every row and copy of the
+		 * ResultSet. Names point into the field metadata of the result.
+		 */
+		class ColumnIndex {
+		public:
+			ColumnIndex(const MYSQL_FIELD *fields, unsigned int columns);
+
+			//1-based index of the first column called name, 0 if none is
+			int find(const char *name) const;
+
+		private:
+			static uint32_t hash(const char *name);
+
+			struct Slot {
+				uint32_t hash;
+				int index;	//1-based, 0 marks an empty slot
+			};
+
+			std::vector<Slot> slots_;
+			std::vector<const char *> names_;
+			uint32_t mask_;
+		};	//ColumnIndex
+
+		/* a column looked up by name once, then read by index in every row */
+		struct ColumnHandle {
+			explicit ColumnHandle(int i = 0): index(i) {}
+
+			int index;	//1-based, as ResultSet::get(int)
+		};
+
+		class ResultSet;
+
+		/*
+		 * rows of a result copied out of the client library, in text form.
+		 * It outlives its connection and any number of ResultSets can read
+		 * it at the same time.
+		 */
+		class ResultSnapshot {
+		public:
+			//copies the remaining rows of result
+			explicit ResultSnapshot(ResultSet &result);
+
+			/*
+			 * rows made of cells, columns() of them per row and NULL for
+			 * NULL, copied along with the fields of layout
+			 */
+			ResultSnapshot(const ResultSnapshot &layout, const std::vector<const char *> &cells,
+			               const std::vector<unsigned long> &lengths, uint32_t affected_rows);
+
+			inline uint32_t columns() const { return columns_; }
+
+			inline size_t rows() const { return columns_ ? cells_.size() / columns_ : 0; }
+
+			inline MYSQL_FIELD *fields() const { return fields_.empty() ? NULL : const_cast<MYSQL_FIELD *>(&fields_[0]); }
+
+			inline MYSQL_ROW row(size_t index) const { return const_cast<MYSQL_ROW>(&cells_[index * columns_]); }
+
+			inline unsigned long *lengths(size_t index) const { return const_cast<unsigned long *>(&lengths_[index * columns_]); }
+
+			inline uint32_t affectedRows() const { return affected_rows_; }
+
+			inline uint64_t lastId() const { return lastid_; }
+
+			//memory held, roughly
+			size_t bytes() const;
+
+		private:
+			ResultSnapshot(const ResultSnapshot &);
+			ResultSnapshot &operator =(const ResultSnapshot &);
+
+			//cells and fields pointing into text_, once it stopped growing
+			void seal(const std::vector<size_t> &offsets, const MYSQL_FIELD *fields);
+
+			uint32_t columns_;
+			uint32_t affected_rows_;
+			uint64_t lastid_;
+			std::vector<MYSQL_FIELD> fields_;
+			std::vector<char> text_;			//values and names, NUL terminated
+			std::vector<char *> cells_;			//into text_, NULL for NULL
+			std::vector<unsigned long> lengths_;
+		};	//ResultSnapshot
+
+		typedef boost::shared_ptr<const ResultSnapshot> ResultSnapshotPtr;
+
+		/*
+		 * Rows of one statement. Results of prepared statements and streamed
+		 * results are tied to their connection and only valid inside
+		 * Callback::onResult.
+		 */
 		class ResultSet {
 		public:
 			explicit ResultSet();
 			explicit ResultSet(boost::shared_ptr<MYSQL_RES> result, uint32_t affected_rows, uint64_t lastid);
+			explicit ResultSet(boost::shared_ptr<PreparedResult> result, uint32_t affected_rows, uint64_t lastid);
+			explicit ResultSet(boost::shared_ptr<StreamResult> result, uint32_t affected_rows, uint64_t lastid);
+			explicit ResultSet(ResultSnapshotPtr result);
 
 			~ResultSet();
 
 			bool next();
 
+			//stop a streamed result early, the connection is dropped instead of drained
+			void cancel();
+
+			//finish a streamed result before its connection is reused
+			void close(Connection *conn);
+
+			//true once a streamed result has handed out at least one row
+			bool streamed() const;
+
 			MYSQL_FIELD* getFields()  ;
 
+			//description of every column, NULL if the statement returned none
+			MYSQL_FIELD *fields() const;
+
+			//rows of a buffered result, 0 for a streamed one where it is not known
+			uint64_t getRows() const;
+
 			long long getInt(int index, long long df=0) const;
 
 			long long getInt(const char *name, long long df=0) const;
 
+			double getDouble(int index, double df=0) const;
+
+			double getDouble(const char *name, double df=0) const;
+
+			bool getTime(int index, MYSQL_TIME *out) const;
+
+			bool getTime(const char *name, MYSQL_TIME *out) const;
+
 			std::string getString(int index) const;
 
 			std::string getString(const char *name) const;
@@ -102,6 +258,23 @@ namespace server {
 
 			Column get(const char *name) const;
 
+			bool isNull(int index) const;
+
+			//resolve name before the next() loop, then read with the overloads below
+			ColumnHandle handle(const char *name) const;
+
+			inline long long getInt(ColumnHandle column, long long df=0) const { return getInt(column.index, df); }
+
+			inline double getDouble(ColumnHandle column, double df=0) const { return getDouble(column.index, df); }
+
+			inline bool getTime(ColumnHandle column, MYSQL_TIME *out) const { return getTime(column.index, out); }
+
+			inline std::string getString(ColumnHandle column) const { return getString(column.index); }
+
+			inline Column get(ColumnHandle column) const { return get(column.index); }
+
+			inline bool isNull(ColumnHandle column) const { return isNull(column.index); }
+
 			inline uint32_t getColumns() const { return columns_; }
 
 			inline uint32_t getAffectedRows() const { return affected_rows_; }
@@ -109,7 +282,16 @@ namespace server {
 			inline uint64_t getLastId() const { return lastid_; }
 
 		private:
+			unsigned int column(int index) const;
+
+			int indexOf(const char *name) const;
+
 			boost::shared_ptr<MYSQL_RES> result_;
+			boost::shared_ptr<PreparedResult> prepared_;
+			boost::shared_ptr<StreamResult> stream_;
+			ResultSnapshotPtr snapshot_;
+			size_t cursor_;		//next row of snapshot_
+			mutable boost::shared_ptr<const ColumnIndex> names_;	//built by the first lookup by name
 			MYSQL_ROW row_;
 			unsigned long *lengths_ ;
 
@@ -119,6 +301,10 @@ namespace server {
 		};	//ResultSet
 
 		class Statement;
+		class CompiledSQL;
+		class PreparedStatement;
+		struct Parameter;
+		struct ParamList;
 		class Connection {
 		public:
 			friend class Statement;
@@ -144,6 +330,12 @@ namespace server {
 
 			void reconnect();
 
+			//round trip to the server, false if the connection is gone
+			bool ping();
+
+			//drop session state (variables, temporary tables, statements) without reconnecting
+			bool reset();
+
 			Statement createStatement();
 
 			void begin();
@@ -157,10 +349,57 @@ namespace server {
 			inline bool connected() const { return connected_; }
 
 			bool autocommit() const { return autocommit_ ; }
+
+			//maximum number of prepared statements kept open, 0 disables caching
+			void setStmtCacheSize(unsigned int size);
+
+			inline void setPreferPrepared(bool yes) { prefer_prepared_ = yes; }
+
+			inline bool preferPrepared() const { return prefer_prepared_; }
+
+			ResultSet executePrepared(const CompiledSQL &tpl, const ParamList *param);
+
+			//server's max_allowed_packet, read once per connect
+			size_t maxAllowedPacket();
+
+			//connect with CLIENT_MULTI_STATEMENTS, takes effect on the next connect
+			inline void setMultiStatements(bool yes) { multi_statements_ = yes; }
+
+			inline bool multiStatements() const { return multi_statements_; }
+
+#ifdef MYSQLDB_HAVE_NONBLOCKING
+			/*
+			 * one step of a non-blocking connect, query or store. While they
+			 * return NET_ASYNC_NOT_READY call again once socket() is ready.
+			 */
+			net_async_status connectNonblocking();
+
+			net_async_status queryNonblocking(const std::string &sql);
+
+			net_async_status storeResultNonblocking(MYSQL_RES **result);
+
+			inline int socket() const { return mysql_.net.fd; }
+#endif
+
+			inline MYSQL *handle() { return &mysql_; }
 			
 			virtual void close();   //release this connection to the pool
 		private:
+			boost::shared_ptr<PreparedStatement> prepareStatement(const std::string &sql);
+
+			void clearStatements();
+
+			typedef std::list<std::pair<std::string, boost::shared_ptr<PreparedStatement> > > STMT_LRU;
+			STMT_LRU stmt_lru_;
+			std::map<std::string, STMT_LRU::iterator> stmt_index_;
+			unsigned int stmt_cache_size_;
+			bool prefer_prepared_;
+			size_t max_packet_;
+			bool multi_statements_;
+			std::string sql_arena_;
+
 			bool connected_;
+			bool connecting_;
 			std::string user_;
 			std::string passwd_;
 			std::string database_;
@@ -180,13 +419,27 @@ namespace server {
 				STRING		= 1,
 				BLOB		= 2,
 				INT_VECTOR	= 3,
+				UINT64		= 4,
+				DOUBLE		= 5,
+				NULL_VALUE	= 6,
+				DATETIME	= 7,	//DATE, TIME or DATETIME, by MYSQL_TIME::time_type
+				STRING_VIEW	= 8,
+				STRING_VECTOR	= 9,
 			} type;
 
 			union {
 				int64_t integer;
+				uint64_t uinteger;
+				double real;
 				const char *string;
 				const std::string *blob;
 				const std::vector<int64_t> *int_vec;
+				const MYSQL_TIME *time;
+				struct {
+					const char *data;
+					size_t size;
+				} view;
+				const std::vector<std::string> *str_vec;
 			} data;
 
 			explicit Parameter(int8_t i) {
@@ -228,37 +481,290 @@ namespace server {
 				type = INT_VECTOR;
 				data.int_vec = &vec;
 			}
+
+			explicit Parameter(uint64_t i) {
+				type = UINT64;
+				data.uinteger = i;
+			}
+
+			explicit Parameter(double d) {
+				type = DOUBLE;
+				data.real = d;
+			}
+
+			explicit Parameter(std::nullptr_t) {
+				type = NULL_VALUE;
+				data.integer = 0;
+			}
+
+			explicit Parameter(const MYSQL_TIME &t) {
+				type = DATETIME;
+				data.time = &t;
+			}
+
+			explicit Parameter(std::string_view str) {
+				type = STRING_VIEW;
+				data.view.data = str.data();
+				data.view.size = str.size();
+			}
+
+			explicit Parameter(const std::vector<std::string> &vec) {
+				type = STRING_VECTOR;
+				data.str_vec = &vec;
+			}
 		};      //Parameter
 
+		/*
+		 * arguments of one statement, a view of a caller owned array such as
+		 * the stack array of SQLTemplate::execute or a std::vector
+		 */
+		struct ParamList {
+			ParamList(): data(NULL), size(0) {}
+
+			ParamList(const Parameter *d, size_t n): data(d), size(n) {}
+
+			ParamList(const std::vector<Parameter> &v): data(v.empty() ? NULL : &v[0]), size(v.size()) {}
+
+			inline const Parameter &operator[](size_t index) const { return data[index]; }
+
+			const Parameter *data;
+			size_t size;
+		};	//ParamList
+
+		/*
+		 * owned copy of the arguments of a statement that runs after its
+		 * caller returned. Not copyable, the parameters point into it.
+		 */
+		class ParamCopy {
+		public:
+			ParamCopy() {}
+
+			explicit ParamCopy(const ParamList &args) { assign(args); }
+
+			void assign(const ParamList &args);
+
+			inline const std::vector<Parameter> &params() const { return params_; }
+
+		private:
+			ParamCopy(const ParamCopy &);
+			ParamCopy &operator =(const ParamCopy &);
+
+			std::vector<Parameter> params_;
+			std::deque<std::string> strings_;
+			std::deque<std::vector<int64_t> > vectors_;
+			std::deque<std::vector<std::string> > str_vectors_;
+			std::deque<MYSQL_TIME> times_;
+		};	//ParamCopy
+
+		/*
+		 * Server side prepared statement. Handles are owned by the statement
+		 * cache of their connection and closed when it disconnects, or with
+		 * the cache disabled by the result of their single execution.
+		 */
+		class PreparedStatement {
+		public:
+			explicit PreparedStatement(MYSQL *mysql);
+
+			~PreparedStatement();
+
+			void prepare(const std::string &sql);
+
+			void bindParams(const CompiledSQL &tpl, const ParamList *param);
+
+			void execute();
+
+			inline MYSQL_STMT *handle() const { return stmt_; }
+
+			//bumped by every execute(), invalidates older result sets
+			inline uint64_t generation() const { return generation_; }
+
+		private:
+			PreparedStatement(const PreparedStatement &);
+			PreparedStatement &operator=(const PreparedStatement &);
+
+			MYSQL_STMT *stmt_;
+			std::vector<MYSQL_BIND> binds_;
+			uint64_t generation_;
+		};	//PreparedStatement
+
+		/*
+		 * Binary protocol rows bound to one fixed layout buffer. Integers,
+		 * doubles and temporals are decoded by the client library, text is
+		 * only produced when a caller asks for a Column.
+		 */
+		class PreparedResult {
+		public:
+			//an uncached statement is owned by its result and closed with it
+			PreparedResult(boost::shared_ptr<PreparedStatement> stmt, bool cached);
+
+			~PreparedResult();
+
+			bool next();
+
+			//all indexes are 0-based
+			Column get(unsigned int index) const;
+
+			long long getInt(unsigned int index, long long df) const;
+
+			double getDouble(unsigned int index, double df) const;
+
+			bool getTime(unsigned int index, MYSQL_TIME *out) const;
+
+			inline bool null(unsigned int index) const { return cell(index).is_null; }
+
+			inline uint64_t rows() const { return mysql_stmt_num_rows(handle_); }
+
+			inline const boost::shared_ptr<MYSQL_RES> &metadata() const { return metadata_; }
+
+		private:
+			enum CellKind {
+				CELL_TEXT	= 0,
+				CELL_INT	= 1,
+				CELL_UINT	= 2,
+				CELL_DOUBLE	= 3,
+				CELL_TIME	= 4,
+			};
+
+			enum { SCRATCH_SIZE = 40 };
+
+			struct Cell {
+				unsigned long length;
+				my_bool is_null;
+				my_bool error;
+				CellKind kind;
+				unsigned int decimals;
+			};
+
+			const Cell &cell(unsigned int index) const;
+
+			boost::weak_ptr<PreparedStatement> stmt_;
+			boost::shared_ptr<PreparedStatement> owned_;	//set when the cache does not keep the statement
+			MYSQL_STMT *handle_;
+			uint64_t generation_;
+			boost::shared_ptr<MYSQL_RES> metadata_;
+			std::vector<MYSQL_BIND> binds_;
+			std::vector<Cell> cells_;
+			std::vector<uint64_t> buffer_;		//8-byte aligned column storage
+			mutable std::vector<char> scratch_;	//text form of decoded cells
+			std::vector<std::string> overflow_;	//cells larger than their bound buffer
+			bool valid_;
+			bool overflowed_;
+		};	//PreparedResult
+
+		struct StreamOptions {
+			StreamOptions(): prefetch(false), block_rows(1024), block_bytes(1 << 20) {}
+
+			bool prefetch;				//read the next block on a background thread
+			unsigned int block_rows;	//rows per prefetched block
+			size_t block_bytes;			//bytes per prefetched block
+		};
+
+		/*
+		 * Unbuffered rows read with mysql_use_result. With prefetch enabled a
+		 * background thread fills the next block while the caller works on
+		 * the current one; at most three blocks exist at any time.
+		 */
+		class StreamResult {
+		public:
+			explicit StreamResult(MYSQL *mysql, MYSQL_RES *result, const StreamOptions &options);
+
+			~StreamResult();
+
+			bool next();
+
+			Column get(unsigned int index) const;	//0-based
+
+			inline unsigned int columns() const { return columns_; }
+
+			inline MYSQL_FIELD *fields() { return &fields_[0]; }
+
+			inline bool streamed() const { return streamed_; }
+
+			void cancel();
+
+			void close(Connection *conn);
+
+		private:
+			struct Cell {
+				size_t offset;
+				unsigned long length;
+				bool null;
+			};
+
+			struct Block {
+				std::vector<char> data;
+				std::vector<Cell> cells;
+				unsigned int rows;
+				bool eof;
+				int error;
+				std::string errmsg;
+			};
+
+			StreamResult(const StreamResult &);
+			StreamResult &operator=(const StreamResult &);
+
+			static void *prefetchLoop(void *arg);
+
+			void fill(Block *block);
+
+			void stopPrefetch();
+
+			MYSQL *mysql_;
+			MYSQL_RES *result_;
+			unsigned int columns_;
+			StreamOptions options_;
+			std::vector<MYSQL_FIELD> fields_;
+			std::vector<std::string> names_;
+
+			MYSQL_ROW row_;
+			unsigned long *lengths_;
+
+			Block blocks_[3];
+			Block *current_;
+			Block *ready_;
+			std::vector<Block *> free_;
+			unsigned int pos_;
+			pthread_t thread_;
+			bool running_;
+			bool stop_;
+			pthread_mutex_t lock_;
+			pthread_cond_t cond_;
+
+			bool cancelled_;
+			bool eof_;
+			bool closed_;
+			bool streamed_;
+		};	//StreamResult
+
 		class Statement {
 		public:
-			explicit Statement(MYSQL *mysql);
+			/*
+			 * arena is a buffer of the connection the statement text is built
+			 * in, taken over here and handed back with its capacity by the
+			 * destructor, so rendering on a warm connection does not allocate.
+			 */
+			explicit Statement(MYSQL *mysql, std::string *arena = NULL);
+
+			Statement(const Statement &other);
+
+			Statement &operator=(const Statement &other);
 
 			~Statement();
 
 			inline Statement &operator<<(int i) {
-				char buf[22];
-				int len = snprintf(buf, sizeof(buf), "%d", i);
-				sql_.append(buf, len);
-				return *this;
+				return appendInt(i);
 			}
 
 			inline Statement &operator<<(uint32_t i) {
-				char buf[10];
-				int len = snprintf(buf, sizeof(buf), "%u", i);
-				sql_.append(buf, len);
-				return *this;
+				return appendUInt(i);
+			}
+
+			inline Statement &operator<<(int64_t i) {
+				return appendInt(i);
 			}
 
 			inline Statement &operator<<(uint64_t i) {
-				char buf[22];
-# if __WORDSIZE == 64
-				int len = snprintf(buf, sizeof(buf), "%ld", i);
-# else				
-				int len = snprintf(buf, sizeof(buf), "%lld", i);
-# endif
-				sql_.append(buf, len);
-				return *this;
+				return appendUInt(i);
 			}
 
 			inline Statement &operator<<(const char *str) {
@@ -281,14 +787,41 @@ namespace server {
 
 			void bindParams(const std::vector<Parameter> &param);
 
+			void bindParams(const CompiledSQL &tpl, const ParamList &param);
+
+			/*
+			 * render a multi-row INSERT: the VALUES row of tpl is repeated for
+			 * as many of the count rows (columns values each) as fit in limit
+			 * bytes, at least one. Returns the number of rows rendered.
+			 */
+			size_t bindBatch(const CompiledSQL &tpl, const Parameter *rows, size_t count, size_t columns, size_t limit);
+
 			ResultSet execute();
 
+			//rows are pulled from the server as ResultSet::next() asks for them
+			ResultSet executeStream(const StreamOptions &options);
+
+			//results of a multi statement text after the first one
+			bool moreResults();
+
+			ResultSet nextResult();
+
+			void discardResults();
+
 		private:
-			std::string::size_type bindInt(std::string::size_type pos, const char *from, int64_t i);
+			Statement &appendInt(int64_t i);
+
+			Statement &appendUInt(uint64_t i);
+
+			size_t bindInt(char *to, int64_t i);
+
+			size_t bindString(char *to, const char *data, size_t size);
 
-			std::string::size_type bindString(std::string::size_type pos, const char *from, const char *data, size_t size);
+			char *render(char *pos, const CompiledSQL &tpl, size_t from, size_t to, const Parameter *param);
 
 			MYSQL *mysql_;
+			std::string *arena_;
+			bool plain_scan_;	//charset allows copying unescaped runs as they are
 			std::string sql_;
 		};	//Statment
 
@@ -1,10 +1,21 @@
 #include "MySQLFactory.h"
 #include <pthread.h>
 #include <assert.h>
+#include <sched.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <algorithm>
 namespace server {
     namespace mysqldb {
+        static uint64_t nowMs() {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+        }
+
         /* PoolableConnection */
-        PoolableConnection::PoolableConnection(const MySQLConfig& config):
+        PoolableConnection::PoolableConnection(const MySQLConfig& config, unsigned int slot):
                                  Connection(config.user, 
                                             config.passwd, 
                                             config.database,
@@ -14,8 +25,14 @@ namespace server {
                                             config.read_timeout,
                                             config.charset,
                                             config.autocommit),
-                                 pool_ref_(NULL){
-             
+                                 pool_ref_(NULL),
+                                 slot_(slot),
+                                 idle_since_(0),
+                                 checked_at_(0),
+                                 session_at_(0){
+            setPreferPrepared(config.prepared);
+            setStmtCacheSize(config.stmt_cache_size);
+            setMultiStatements(config.multi_statements);
         }
 
         void PoolableConnection::close() {
@@ -24,65 +41,454 @@ namespace server {
 
         /* ConnectionPool */
         ConnectionPool::ConnectionPool(const MySQLConfig& config)
-                       :config_(config),
+                       :next_(config.maxconns),
+                        state_(config.maxconns),
+                        config_(config),
+                        waiters_(0),
+                        checkouts_(0),
+                        waits_(0),
+                        timeouts_(0),
+                        rejected_(0),
+                        max_waiting_(0),
+                        evictions_(0),
+                        pings_(0),
+                        reconnects_(0),
+                        resets_(0),
                         ref_count_(0){
-            pthread_mutex_init(&cache_lock_, NULL);
-            pthread_cond_init(&cache_not_empty_cond_, NULL);
-            pthread_mutex_init(&ref_count_lock_, NULL);
-            for(int i=0;i<config.maxconns;i++)
+            pthread_mutex_init(&wait_lock_, NULL);
+            pthread_condattr_init(&wait_attr_);
+            pthread_condattr_setclock(&wait_attr_, CLOCK_MONOTONIC);
+            for (int i = 0; i < PoolStats::WAIT_BUCKETS; ++i)
+                wait_us_[i].store(0, std::memory_order_relaxed);
+
+            //one shard per CPU, no more than there are connections
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            size_t shards = (cpus > 0) ? (size_t)cpus : 1;
+            if (shards > config.maxconns)
+                shards = config.maxconns > 0 ? config.maxconns : 1;
+            shards_ = std::vector<Shard>(shards);
+            for (size_t i = 0; i < shards_.size(); ++i)
+                shards_[i].head.store(0, std::memory_order_relaxed);
+
+            for(unsigned int i=0;i<config.maxconns;i++)
             {
-                PoolableConnection *pc = new PoolableConnection(config);
-                cache_.push_back(pc);
+                PoolableConnection *pc = new PoolableConnection(config, i);
+                conns_.push_back(pc);
             }
+            //low slots on top, those are the ones warmUp opens
+            for (unsigned int i = config.maxconns; i > 0; --i)
+                push(shards_[(i - 1) % shards_.size()], conns_[i - 1]);
         }
 
         ConnectionPool::~ConnectionPool() {
             //no ref to the pool == all connections in the pool.
             //disconnect all connections
-            assert(cache_.size() == config_.maxconns); 
-            for(CACHE_TYPE::iterator it=cache_.begin();
-                it!=cache_.end(); ++it) {
+            size_t idle = 0;
+            for (size_t i = 0; i < shards_.size(); ++i) {
+                while (pop(shards_[i]) != NULL)
+                    ++idle;
+            }
+            assert(idle == conns_.size());
+            for(std::vector<PoolableConnection*>::iterator it=conns_.begin();
+                it!=conns_.end(); ++it) {
                 (*it)->disconnect();
                 delete (*it);
             }
+            pthread_condattr_destroy(&wait_attr_);
+            pthread_mutex_destroy(&wait_lock_);
         }
 
-        void ConnectionPool::addRef() {
-            pthread_mutex_lock(&ref_count_lock_);
-            ref_count_++;
-            pthread_mutex_unlock(&ref_count_lock_);
+        void ConnectionPool::addRef(int count) {
+            ref_count_.fetch_add(count, std::memory_order_relaxed);
         }
 
         int ConnectionPool::decRef() {
-            unsigned int ret;
-            pthread_mutex_lock(&ref_count_lock_);
-            ret = --ref_count_; 
-            pthread_mutex_unlock(&ref_count_lock_);
-            return ret;
+            //the last owner must see every write of the others before deleting
+            return ref_count_.fetch_sub(1, std::memory_order_acq_rel) - 1;
         }
 
         int ConnectionPool::refCnt() {
-            return ref_count_;
+            return ref_count_.load(std::memory_order_relaxed);
+        }
+
+        /*
+         * Treiber stack over slots. The tag in the upper half of the head
+         * changes on every update, so a head popped and pushed back between
+         * our load and CAS (ABA) makes the CAS fail.
+         */
+        PoolableConnection* ConnectionPool::pop(Shard &shard) {
+            uint64_t head = shard.head.load(std::memory_order_acquire);
+            for (;;) {
+                uint32_t top = (uint32_t) head;
+                if (top == 0)
+                    return NULL;
+                uint64_t next = ((head >> 32) + 1) << 32 | next_[top - 1].load(std::memory_order_relaxed);
+                if (shard.head.compare_exchange_weak(head, next, std::memory_order_acquire, std::memory_order_acquire))
+                    return conns_[top - 1];
+            }
+        }
+
+        void ConnectionPool::push(Shard &shard, PoolableConnection *c) {
+            uint64_t head = shard.head.load(std::memory_order_relaxed);
+            for (;;) {
+                next_[c->slot_].store((uint32_t) head, std::memory_order_relaxed);
+                uint64_t top = ((head >> 32) + 1) << 32 | (c->slot_ + 1);
+                if (shard.head.compare_exchange_weak(head, top, std::memory_order_release, std::memory_order_relaxed))
+                    return;
+            }
+        }
+
+        ConnectionPool::Shard& ConnectionPool::localShard() {
+            int cpu = sched_getcpu();
+            return shards_[(cpu > 0 ? (size_t)cpu : 0) % shards_.size()];
+        }
+
+        //the local shard first, then steal from the others
+        PoolableConnection* ConnectionPool::take() {
+            Shard &local = localShard();
+            size_t start = &local - &shards_[0];
+            for (size_t i = 0; i < shards_.size(); ++i) {
+                Shard &shard = shards_[(start + i) % shards_.size()];
+                PoolableConnection *conn;
+                while ((conn = pop(shard)) != NULL) {
+                    if (own(conn))
+                        return conn;
+                }
+            }
+            return NULL;
+        }
+
+        /*
+         * a popped connection is ours unless maintain() is busy with it, it
+         * is left to maintain() then, which puts it back once done.
+         */
+        bool ConnectionPool::own(PoolableConnection *c) {
+            std::atomic<int> &state = state_[c->slot_];
+            int s = state.load(std::memory_order_acquire);
+            for (;;) {
+                if (s == IDLE) {
+                    if (state.compare_exchange_weak(s, BUSY, std::memory_order_acquire, std::memory_order_acquire))
+                        return true;
+                } else if (state.compare_exchange_weak(s, ORPHANED, std::memory_order_acq_rel, std::memory_order_acquire)) {
+                    return false;
+                }
+            }
+        }
+
+        //an idle connection for maintain(), left on its stack
+        bool ConnectionPool::claim(size_t slot) {
+            int s = IDLE;
+            return state_[slot].compare_exchange_strong(s, SERVICED, std::memory_order_acquire, std::memory_order_relaxed);
+        }
+
+        void ConnectionPool::unclaim(PoolableConnection *c) {
+            int s = SERVICED;
+            if (state_[c->slot_].compare_exchange_strong(s, IDLE, std::memory_order_release, std::memory_order_relaxed))
+                return;
+            //a checkout popped it meanwhile and went on, it is on no stack now
+            state_[c->slot_].store(BUSY, std::memory_order_relaxed);
+            putBack(c);
         }
 
         PoolableConnection* ConnectionPool::getConnection() {
-            pthread_mutex_lock(&cache_lock_);
-            while(cache_.size()<=0)
-                pthread_cond_wait(&cache_not_empty_cond_, &cache_lock_);
-            PoolableConnection *conn = cache_.back();
-            conn->pool_ref_ = ConnectionPoolRef(this);
-            cache_.pop_back();
-            pthread_mutex_unlock(&cache_lock_);
+            return getConnection(config_.checkout_timeout_ms);
+        }
+
+        PoolableConnection* ConnectionPool::getConnection(unsigned int timeout_ms) {
+            checkouts_.fetch_add(1, std::memory_order_relaxed);
+            PoolableConnection *conn = take();
+            if (conn == NULL)
+                conn = wait(timeout_ms);
+            if (conn != NULL)
+                conn->pool_ref_ = ConnectionPoolRef(this);
+            return conn;
+        }
+
+        /*
+         * queue behind earlier waiters until a release hands us a connection.
+         * Releases go to the queue before the stacks, so a thread arriving
+         * later cannot take it first.
+         */
+        PoolableConnection* ConnectionPool::wait(unsigned int timeout_ms) {
+            struct timespec begin, deadline;
+            clock_gettime(CLOCK_MONOTONIC, &begin);
+            deadline.tv_sec = begin.tv_sec + timeout_ms / 1000;
+            deadline.tv_nsec = begin.tv_nsec + (long)(timeout_ms % 1000) * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec += 1;
+                deadline.tv_nsec -= 1000000000;
+            }
+
+            pthread_mutex_lock(&wait_lock_);
+            if (config_.max_waiters > 0 && waiters_.load(std::memory_order_relaxed) >= (int)config_.max_waiters) {
+                pthread_mutex_unlock(&wait_lock_);
+                rejected_.fetch_add(1, std::memory_order_relaxed);
+                return NULL;
+            }
+            //registered before looking again, a release after that look hands over to us
+            waiters_.fetch_add(1, std::memory_order_seq_cst);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            PoolableConnection *conn = take();
+            if (conn == NULL) {
+                waits_.fetch_add(1, std::memory_order_relaxed);
+                Waiter w;
+                w.conn = NULL;
+                pthread_cond_init(&w.cond, &wait_attr_);
+                std::list<Waiter*>::iterator pos = queue_.insert(queue_.end(), &w);
+                if ((int)queue_.size() > max_waiting_)
+                    max_waiting_ = queue_.size();
+
+                while (w.conn == NULL) {
+                    int rc = (timeout_ms > 0) ? pthread_cond_timedwait(&w.cond, &wait_lock_, &deadline)
+                                              : pthread_cond_wait(&w.cond, &wait_lock_);
+                    if (rc == ETIMEDOUT && w.conn == NULL) {
+                        queue_.erase(pos);
+                        break;
+                    }
+                }
+                //a release handing over has taken us off the queue already
+                conn = w.conn;
+                pthread_cond_destroy(&w.cond);
+            }
+            waiters_.fetch_sub(1, std::memory_order_relaxed);
+            pthread_mutex_unlock(&wait_lock_);
+
+            if (conn == NULL) {
+                timeouts_.fetch_add(1, std::memory_order_relaxed);
+                return NULL;
+            }
+            struct timespec end;
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            uint64_t us = (end.tv_sec - begin.tv_sec) * 1000000ULL + (end.tv_nsec - begin.tv_nsec) / 1000;
+            int bucket = 63 - __builtin_clzll(us | 1);
+            if (bucket >= PoolStats::WAIT_BUCKETS)
+                bucket = PoolStats::WAIT_BUCKETS - 1;
+            wait_us_[bucket].fetch_add(1, std::memory_order_relaxed);
+            return conn;
+        }
+
+        PoolableConnection* ConnectionPool::tryGetConnection() {
+            PoolableConnection *conn = take();
+            if (conn != NULL)
+                conn->pool_ref_ = ConnectionPoolRef(this);
             return conn;
         }
 
         void ConnectionPool::releaseConnection(PoolableConnection *c) {
+            //keeps the pool alive until we are done with it
             ConnectionPoolRef ref = c->pool_ref_;
-            pthread_mutex_lock(&cache_lock_);
             c->pool_ref_ = ConnectionPoolRef(NULL);
-            cache_.push_back(c);
-            pthread_cond_signal(&cache_not_empty_cond_);
-            pthread_mutex_unlock(&cache_lock_);
+            c->idle_since_ = c->checked_at_ = nowMs();
+            putBack(c);
+        }
+
+        //to the oldest waiter if there is one, else onto the local stack
+        void ConnectionPool::putBack(PoolableConnection *c) {
+            if (waiters_.load(std::memory_order_seq_cst) > 0) {
+                pthread_mutex_lock(&wait_lock_);
+                if (!queue_.empty()) {
+                    Waiter *w = queue_.front();
+                    queue_.pop_front();
+                    w->conn = c;
+                    pthread_cond_signal(&w->cond);
+                    pthread_mutex_unlock(&wait_lock_);
+                    return;
+                }
+                pthread_mutex_unlock(&wait_lock_);
+            }
+            state_[c->slot_].store(IDLE, std::memory_order_release);
+            push(localShard(), c);
+
+            //a waiter that registered after our first look may have missed the push
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (waiters_.load(std::memory_order_seq_cst) > 0) {
+                pthread_mutex_lock(&wait_lock_);
+                while (!queue_.empty()) {
+                    PoolableConnection *idle = take();
+                    if (idle == NULL)
+                        break;
+                    Waiter *w = queue_.front();
+                    queue_.pop_front();
+                    w->conn = idle;
+                    pthread_cond_signal(&w->cond);
+                }
+                pthread_mutex_unlock(&wait_lock_);
+            }
+        }
+
+        PoolStats ConnectionPool::stats() {
+            PoolStats stats;
+            stats.checkouts = checkouts_.load(std::memory_order_relaxed);
+            stats.waits = waits_.load(std::memory_order_relaxed);
+            stats.timeouts = timeouts_.load(std::memory_order_relaxed);
+            stats.rejected = rejected_.load(std::memory_order_relaxed);
+            stats.evictions = evictions_.load(std::memory_order_relaxed);
+            stats.pings = pings_.load(std::memory_order_relaxed);
+            stats.reconnects = reconnects_.load(std::memory_order_relaxed);
+            stats.resets = resets_.load(std::memory_order_relaxed);
+            for (int i = 0; i < PoolStats::WAIT_BUCKETS; ++i)
+                stats.wait_us[i] = wait_us_[i].load(std::memory_order_relaxed);
+
+            pthread_mutex_lock(&wait_lock_);
+            stats.waiting = queue_.size();
+            stats.max_waiting = max_waiting_;
+            pthread_mutex_unlock(&wait_lock_);
+            return stats;
+        }
+
+        struct WarmUp {
+            std::vector<PoolableConnection*> *conns;
+            std::atomic<unsigned int> next;
+            unsigned int count;
+        };
+
+        void *ConnectionPool::connectAll(void *arg) {
+            WarmUp *job = (WarmUp *) arg;
+#ifdef LINUX
+            mysql_thread_init();
+#endif
+            for (unsigned int i = job->next++; i < job->count; i = job->next++) {
+                PoolableConnection *conn = (*job->conns)[i];
+                try {
+                    conn->connect();
+                    conn->session_at_ = nowMs();
+                } catch (Exception &e) {
+                    //left for the first checkout to retry
+                    conn->disconnect();
+                }
+            }
+#ifdef LINUX
+            mysql_thread_end();
+#endif
+            return NULL;
+        }
+
+        /*
+         * the connections are reached through conns_ directly, nobody else
+         * may use the pool yet. The lowest slots are opened, they are on top
+         * of the stacks.
+         */
+        void ConnectionPool::warmUp(unsigned int count) {
+            WarmUp job;
+            job.conns = &conns_;
+            job.next = 0;
+            job.count = count < conns_.size() ? count : conns_.size();
+            if (job.count == 0)
+                return;
+
+            unsigned int threads = config_.warmup_threads;
+            if (threads > job.count)
+                threads = job.count;
+            std::vector<pthread_t> workers;
+            for (unsigned int i = 1; i < threads; ++i) {
+                pthread_t tid;
+                if (pthread_create(&tid, NULL, connectAll, &job) == 0)
+                    workers.push_back(tid);
+            }
+            connectAll(&job);
+            for (size_t i = 0; i < workers.size(); ++i)
+                pthread_join(workers[i], NULL);
+        }
+
+        //a connect like any other: only while the breaker is closed and with a token, reported to it
+        static bool reopen(PoolableConnection *conn, CircuitBreaker *breaker) {
+            conn->disconnect();
+            if (breaker != NULL && (breaker->state() != CircuitBreaker::CLOSED || !breaker->takeToken()))
+                return false;
+            try {
+                conn->connect();
+                conn->session_at_ = nowMs();
+            } catch (Exception &e) {
+                conn->disconnect();
+                if (breaker != NULL)
+                    breaker->failed();
+                return false;
+            }
+            if (breaker != NULL)
+                breaker->succeeded();
+            return true;
+        }
+
+        /*
+         * goes over the idle connections one at a time, by slot. Each is
+         * claimed where it lies on its stack and released right after its
+         * round trip, the others stay available meanwhile; a checkout that
+         * pops the claimed one skips it, and it is put back once done. The
+         * round trips stop once breaker opens.
+         */
+        void ConnectionPool::maintain(CircuitBreaker *breaker) {
+            //the ones checked out count as open
+            size_t open = 0;
+            for (size_t i = 0; i < conns_.size(); ++i) {
+                if (!claim(i)) {
+                    ++open;
+                    continue;
+                }
+                if (conns_[i]->connected())
+                    ++open;
+                unclaim(conns_[i]);
+            }
+
+            for (size_t i = 0; i < conns_.size(); ++i) {
+                if (breaker != NULL && breaker->refusing())
+                    break;
+                if (!claim(i))
+                    continue;
+                PoolableConnection *conn = conns_[i];
+                uint64_t now = nowMs();
+
+                if (!conn->connected()) {
+                    //may be opened elsewhere, its age is taken when next seen open
+                    conn->session_at_ = 0;
+                    if (open < config_.min_conns) {
+                        ++open;
+                        if (reopen(conn, breaker))
+                            reconnects_.fetch_add(1, std::memory_order_relaxed);
+                        conn->checked_at_ = nowMs();
+                    }
+                    unclaim(conn);
+                    continue;
+                }
+                if (conn->session_at_ == 0)
+                    conn->session_at_ = now;
+
+                if (config_.idle_timeout > 0 && now - conn->idle_since_ > config_.idle_timeout * 1000ULL
+                    && open > config_.min_conns) {
+                    conn->disconnect();
+                    --open;
+                    evictions_.fetch_add(1, std::memory_order_relaxed);
+                } else if (config_.max_age > 0 && now - conn->session_at_ >= config_.max_age * 1000ULL) {
+                    resets_.fetch_add(1, std::memory_order_relaxed);
+                    if (conn->reset()) {
+                        conn->session_at_ = nowMs();
+                    } else {
+                        reconnects_.fetch_add(1, std::memory_order_relaxed);
+                        reopen(conn, breaker);
+                    }
+                    conn->checked_at_ = nowMs();
+                } else if (config_.ping_interval > 0 && now - conn->checked_at_ >= config_.ping_interval * 1000ULL) {
+                    pings_.fetch_add(1, std::memory_order_relaxed);
+                    if (!conn->ping()) {
+                        reconnects_.fetch_add(1, std::memory_order_relaxed);
+                        reopen(conn, breaker);
+                    }
+                    conn->checked_at_ = nowMs();
+                }
+                unclaim(conn);
+            }
+        }
+
+        void ConnectionPool::drain() {
+            std::vector<PoolableConnection*> idle;
+            PoolableConnection *conn;
+            while ((conn = take()) != NULL)
+                idle.push_back(conn);
+            //still handed to waiters queued before the swap
+            for (size_t i = 0; i < idle.size(); ++i) {
+                idle[i]->disconnect();
+                putBack(idle[i]);
+            }
         }
 
         ConnectionPoolRef::ConnectionPoolRef(ConnectionPool * p) {
@@ -124,45 +530,608 @@ namespace server {
             }
         }
 
+        /* CircuitBreaker */
+        //gate_: state in the low 16 bits, probes in flight in the next 16, the epoch above
+        static const uint64_t ONE_PROBE = 1ULL << 16;
+
+        static inline int stateOf(uint64_t gate) { return (int)(gate & 0xffff); }
+
+        static inline unsigned int probesOf(uint64_t gate) { return (unsigned int)((gate >> 16) & 0xffff); }
+
+        static inline uint32_t epochOf(uint64_t gate) { return (uint32_t)(gate >> 32); }
+
+        static inline uint64_t gateOf(uint32_t epoch, unsigned int probes, int state) {
+            return (uint64_t) epoch << 32 | (uint64_t) probes << 16 | (uint64_t) state;
+        }
+
+        CircuitBreaker::CircuitBreaker(): gate_(CLOSED), failures_(0), open_until_(0),
+                                          threshold_(0), cooldown_ms_(0), max_probes_(1),
+                                          trips_(0), refused_(0),
+                                          rate_(0), burst_(0), tokens_(0), filled_at_(0) {
+            pthread_mutex_init(&bucket_lock_, NULL);
+        }
+
+        CircuitBreaker::~CircuitBreaker() {
+            pthread_mutex_destroy(&bucket_lock_);
+        }
+
+        void CircuitBreaker::configure(const MySQLConfig &config) {
+            threshold_.store(config.breaker_failures, std::memory_order_relaxed);
+            cooldown_ms_.store(config.breaker_cooldown_ms, std::memory_order_relaxed);
+            max_probes_.store(std::min(std::max(config.breaker_probes, 1u), 0xffffu), std::memory_order_relaxed);
+            failures_.store(0, std::memory_order_relaxed);
+            //probes still out belong to the old settings, a new epoch ignores them
+            uint64_t seen = gate_.load(std::memory_order_relaxed);
+            while (!gate_.compare_exchange_weak(seen, gateOf(epochOf(seen) + 1, 0, CLOSED),
+                                                std::memory_order_acq_rel, std::memory_order_relaxed)) {}
+
+            pthread_mutex_lock(&bucket_lock_);
+            rate_ = config.reconnect_rate / 1000.0;
+            burst_ = config.reconnect_burst > 0 ? config.reconnect_burst : config.reconnect_rate;
+            tokens_ = burst_;
+            filled_at_ = nowMs();
+            pthread_mutex_unlock(&bucket_lock_);
+        }
+
+        CircuitBreaker::Verdict CircuitBreaker::admit(uint32_t *ticket) {
+            uint64_t seen = gate_.load(std::memory_order_acquire);
+            for (;;) {
+                uint64_t next;
+                if (stateOf(seen) == CLOSED) {
+                    return PASS;
+                } else if (stateOf(seen) == OPEN) {
+                    if (nowMs() < open_until_.load(std::memory_order_relaxed)) {
+                        refused_.fetch_add(1, std::memory_order_relaxed);
+                        return REFUSE;
+                    }
+                    //the first one past the cooldown lets the probes in, counted from itself
+                    next = gateOf(epochOf(seen), 1, HALF_OPEN);
+                } else {
+                    if (probesOf(seen) >= max_probes_.load(std::memory_order_relaxed)) {
+                        refused_.fetch_add(1, std::memory_order_relaxed);
+                        return REFUSE;
+                    }
+                    next = seen + ONE_PROBE;
+                }
+                if (gate_.compare_exchange_weak(seen, next, std::memory_order_acq_rel, std::memory_order_acquire)) {
+                    *ticket = epochOf(next);
+                    return PROBE;
+                }
+            }
+        }
+
+        void CircuitBreaker::probed(bool ok, uint32_t ticket) {
+            uint64_t seen = gate_.load(std::memory_order_acquire);
+            //a probe let in before the breaker opened again tells nothing about this round
+            while (stateOf(seen) == HALF_OPEN && epochOf(seen) == ticket) {
+                if (!ok) {
+                    if (trip(seen))
+                        return;
+                } else if (gate_.compare_exchange_weak(seen, gateOf(ticket, 0, CLOSED),
+                                                       std::memory_order_acq_rel, std::memory_order_acquire)) {
+                    failures_.store(0, std::memory_order_relaxed);
+                    return;
+                }
+            }
+            //another probe of its round closed it first, the failure counts like any other
+            if (!ok && stateOf(seen) == CLOSED && epochOf(seen) == ticket)
+                failed();
+        }
+
+        void CircuitBreaker::abandon(uint32_t ticket) {
+            uint64_t seen = gate_.load(std::memory_order_acquire);
+            while (stateOf(seen) == HALF_OPEN && epochOf(seen) == ticket && probesOf(seen) > 0) {
+                if (gate_.compare_exchange_weak(seen, seen - ONE_PROBE, std::memory_order_acq_rel, std::memory_order_acquire))
+                    return;
+            }
+        }
+
+        void CircuitBreaker::succeeded() {
+            //read first, every query ends here and the line is shared
+            if (failures_.load(std::memory_order_relaxed) != 0)
+                failures_.store(0, std::memory_order_relaxed);
+        }
+
+        void CircuitBreaker::failed() {
+            unsigned int threshold = threshold_.load(std::memory_order_relaxed);
+            if (threshold == 0)
+                return;
+            if (failures_.fetch_add(1, std::memory_order_relaxed) + 1 < threshold)
+                return;
+            //errors of requests begun before it opened do not count again
+            uint64_t seen = gate_.load(std::memory_order_acquire);
+            while (stateOf(seen) == CLOSED && !trip(seen)) {}
+        }
+
+        //open from seen under a new epoch, false with seen reloaded if the gate moved first
+        bool CircuitBreaker::trip(uint64_t &seen) {
+            open_until_.store(nowMs() + cooldown_ms_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            if (!gate_.compare_exchange_strong(seen, gateOf(epochOf(seen) + 1, 0, OPEN),
+                                               std::memory_order_acq_rel, std::memory_order_acquire))
+                return false;
+            trips_.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+
+        bool CircuitBreaker::refusing() const {
+            return stateOf(gate_.load(std::memory_order_acquire)) == OPEN
+                   && nowMs() < open_until_.load(std::memory_order_relaxed);
+        }
+
+        bool CircuitBreaker::takeToken() {
+            pthread_mutex_lock(&bucket_lock_);
+            bool taken = true;
+            if (rate_ > 0) {
+                uint64_t now = nowMs();
+                tokens_ = std::min(burst_, tokens_ + (now - filled_at_) * rate_);
+                filled_at_ = now;
+                if (tokens_ >= 1)
+                    tokens_ -= 1;
+                else
+                    taken = false;
+            }
+            pthread_mutex_unlock(&bucket_lock_);
+            return taken;
+        }
+
+        /* Source */
+        static const uint64_t POOL_MASK = (1ULL << 48) - 1;
+        static const uint64_t READER = 1ULL << 48;
+
+        Source::Source(const std::string &name): state_(0), name_(name), replicas_(NULL), replica_(false),
+                                                 max_lag_(0), lagging_(false), lag_(LAG_UNCHECKED), outstanding_(0),
+                                                 latency_us_(0), maintaining_(false) {}
+
+        Source::~Source() {
+            swap(ConnectionPoolRef(NULL));
+        }
+
+        ConnectionPoolRef Source::pool() {
+            uint64_t seen = state_.fetch_add(READER, std::memory_order_acquire);
+            ConnectionPool *p = (ConnectionPool *)(uintptr_t)(seen & POOL_MASK);
+            ConnectionPoolRef ref(p);
+
+            //give the borrowed count back, to the pool if a swap moved it there
+            uint64_t cur = state_.load(std::memory_order_relaxed);
+            for (;;) {
+                if ((cur & POOL_MASK) != (seen & POOL_MASK)) {
+                    if (p)
+                        p->decRef();
+                    break;
+                }
+                if (state_.compare_exchange_weak(cur, cur - READER, std::memory_order_release, std::memory_order_relaxed))
+                    break;
+            }
+            return ref;
+        }
+
+        ConnectionPoolRef Source::swap(const ConnectionPoolRef &pool) {
+            ConnectionPool *p = pool.get();
+            assert(((uintptr_t)p & ~POOL_MASK) == 0);
+            if (p)
+                p->addRef();    //held by state_
+
+            uint64_t old = state_.exchange((uintptr_t)p, std::memory_order_acq_rel);
+            ConnectionPool *prev = (ConnectionPool *)(uintptr_t)(old & POOL_MASK);
+            if (prev == NULL)
+                return ConnectionPoolRef(NULL);
+
+            //one ref for every reader still to give its count back, then drop ours
+            prev->addRef((int)(old >> 48));
+            ConnectionPoolRef ref(prev);
+            prev->decRef();
+            return ref;
+        }
+
+        static uint64_t nowUs() {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+        }
+
+        Source *Source::reader() {
+            const std::vector<Source*> *replicas = replicas_.load(std::memory_order_acquire);
+            if (replicas == NULL)
+                return this;
+
+            Source *best = this;
+            uint64_t best_cost = 0;
+            for (size_t i = 0; i < replicas->size(); ++i) {
+                Source *r = (*replicas)[i];
+                if (r->lagging_.load(std::memory_order_relaxed) || r->breaker_.refusing())
+                    continue;
+                //an unmeasured replica costs nothing, so it gets tried
+                uint64_t cost = (r->outstanding_.load(std::memory_order_relaxed) + 1)
+                                * r->latency_us_.load(std::memory_order_relaxed);
+                if (best == this || cost < best_cost) {
+                    best = r;
+                    best_cost = cost;
+                }
+            }
+            return best;
+        }
+
+        uint64_t Source::started() {
+            outstanding_.fetch_add(1, std::memory_order_relaxed);
+            return nowUs();
+        }
+
+        void Source::finished(uint64_t started) {
+            outstanding_.fetch_sub(1, std::memory_order_relaxed);
+            //weight 1/8, concurrent updates may lose a sample
+            uint64_t sample = nowUs() - started;
+            uint64_t avg = latency_us_.load(std::memory_order_relaxed);
+            latency_us_.store(avg == 0 ? sample : avg - avg / 8 + sample / 8, std::memory_order_relaxed);
+        }
+
+        /*
+         * seconds a replica is behind its source. LAG_STOPPED if replication
+         * is not running, LAG_UNREACHABLE if the connection failed and
+         * LAG_UNKNOWN if it cannot tell: no privilege, not a replica at all
+         * or a status it does not understand.
+         */
+        static long long secondsBehind(Connection *conn) {
+            MYSQL *mysql = conn->handle();
+            if (mysql_query(mysql, "SHOW REPLICA STATUS") != 0 && mysql_query(mysql, "SHOW SLAVE STATUS") != 0) {
+                unsigned int err = mysql_errno(mysql);
+                return (err >= 2000 && err <= 2018) ? Source::LAG_UNREACHABLE : Source::LAG_UNKNOWN;
+            }
+            MYSQL_RES *result = mysql_store_result(mysql);
+            if (result == NULL)
+                return Source::LAG_UNKNOWN;
+
+            long long lag = Source::LAG_UNKNOWN;
+            MYSQL_ROW row = mysql_fetch_row(result);
+            MYSQL_FIELD *fields = mysql_fetch_fields(result);
+            unsigned int columns = mysql_num_fields(result);
+            for (unsigned int i = 0; row != NULL && i < columns; ++i) {
+                if (strcmp(fields[i].name, "Seconds_Behind_Source") == 0
+                    || strcmp(fields[i].name, "Seconds_Behind_Master") == 0) {
+                    char *end = NULL;
+                    if (row[i] == NULL)
+                        lag = Source::LAG_STOPPED;
+                    else if ((lag = strtoll(row[i], &end, 10)) < 0 || end == row[i])
+                        lag = Source::LAG_UNKNOWN;
+                    break;
+                }
+            }
+            mysql_free_result(result);
+            return lag;
+        }
+
+        static const char *lagText(long long lag) {
+            switch (lag) {
+                case Source::LAG_UNKNOWN:
+                    return "replication status unknown, no privilege or not a replica";
+                case Source::LAG_STOPPED:
+                    return "replication stopped";
+                case Source::LAG_UNREACHABLE:
+                    return "not reachable";
+                default:
+                    return "lagging";
+            }
+        }
+
+        /*
+         * on an idle connection only, a busy replica keeps its last verdict.
+         * A replica that cannot tell its lag keeps serving, it answers after
+         * all; one stopped, not reachable or too far behind is left out. A
+         * change of verdict is reported.
+         */
+        void MySQLFactory::checkLag(Source *replica, unsigned int max_lag) {
+            ConnectionPoolRef pool = replica->pool();
+            PoolableConnection *conn = pool.get() ? pool->tryGetConnection() : NULL;
+            if (conn == NULL)
+                return;
+
+            if (!conn->connected()) {
+                //a connect like any other, it keeps the last verdict when the breaker allows none
+                CircuitBreaker &breaker = replica->breaker_;
+                if (breaker.state() != CircuitBreaker::CLOSED || !breaker.takeToken()) {
+                    conn->close();
+                    return;
+                }
+                try {
+                    conn->connect();
+                    conn->session_at_ = nowMs();
+                    breaker.succeeded();
+                } catch (Exception &e) {
+                    conn->disconnect();
+                    breaker.failed();
+                }
+            }
+            long long lag = conn->connected() ? secondsBehind(conn) : (long long) Source::LAG_UNREACHABLE;
+            if (lag == Source::LAG_UNREACHABLE && conn->connected())
+                conn->disconnect();
+            conn->close();
+
+            bool lagging = (lag != Source::LAG_UNKNOWN) && (lag < 0 || lag > (long long) max_lag);
+            long long last = replica->lag_.exchange(lag, std::memory_order_relaxed);
+            bool was = replica->lagging_.exchange(lagging, std::memory_order_relaxed);
+            if (lagging != was || (lag == Source::LAG_UNKNOWN && last != Source::LAG_UNKNOWN)) {
+                if (lagging || lag == Source::LAG_UNKNOWN)
+                    fprintf(stderr, "replica %s: %s, lag %lld, max %u%s\n", replica->name().c_str(), lagText(lag),
+                            lag, max_lag, lagging ? ", reads go elsewhere" : "");
+                else
+                    fprintf(stderr, "replica %s: caught up, lag %lld\n", replica->name().c_str(), lag);
+            }
+        }
+
         /* MySQLFactory */
-        MySQLFactory::MySQLFactory(){
+        MySQLFactory::MySQLFactory(): sources_(new SRC_MAP), running_(false), stopping_(false), passes_(0) {
             pthread_mutex_init(&src_map_lock_, NULL); 
+            pthread_cond_init(&stop_cond_, NULL);
+            pthread_cond_init(&pass_cond_, NULL);
         }
 
-        MySQLFactory::~MySQLFactory() {}
+        MySQLFactory::~MySQLFactory() {
+            pthread_mutex_lock(&src_map_lock_);
+            stopping_ = true;
+            bool running = running_;
+            pthread_cond_signal(&stop_cond_);
+            pthread_mutex_unlock(&src_map_lock_);
+            if (running)
+                pthread_join(thread_, NULL);
+            pthread_cond_destroy(&stop_cond_);
+
+            //passes still in a round trip hold sources and pools
+            pthread_mutex_lock(&src_map_lock_);
+            while (passes_ > 0)
+                pthread_cond_wait(&pass_cond_, &src_map_lock_);
+            pthread_mutex_unlock(&src_map_lock_);
+            pthread_cond_destroy(&pass_cond_);
+
+            const SRC_MAP *map = sources_.load(std::memory_order_relaxed);
+            for (SRC_MAP::const_iterator it = map->begin(); it != map->end(); ++it)
+                delete it->second;
+            delete map;
+            for (size_t i = 0; i < old_maps_.size(); ++i)
+                delete old_maps_[i];
+            for (size_t i = 0; i < old_groups_.size(); ++i)
+                delete old_groups_[i];
+            for (size_t i = 0; i < old_sources_.size(); ++i)
+                delete old_sources_[i];
+            retired_.clear();
+        }
+
+        struct MaintenancePass {
+            MySQLFactory *factory;
+            Source *source;
+        };
+
+        //one source's upkeep, its round trips wait on nobody else's
+        void *MySQLFactory::maintainSource(void *arg) {
+            MaintenancePass *pass = (MaintenancePass *) arg;
+            MySQLFactory *factory = pass->factory;
+            Source *source = pass->source;
+            delete pass;
+#ifdef LINUX
+            mysql_thread_init();
+#endif
+            //nothing is tried on a source while its breaker refuses
+            if (!source->breaker_.refusing()) {
+                ConnectionPoolRef pool = source->pool();
+                if (pool.get())
+                    pool->maintain(&source->breaker_);
+                unsigned int max_lag = source->max_lag_.load(std::memory_order_relaxed);
+                if (source->replica() && max_lag > 0)
+                    checkLag(source, max_lag);
+            }
+            source->maintaining_.store(false, std::memory_order_release);
+
+            pthread_mutex_lock(&factory->src_map_lock_);
+            if (--factory->passes_ == 0)
+                pthread_cond_broadcast(&factory->pass_cond_);
+            pthread_mutex_unlock(&factory->src_map_lock_);
+#ifdef LINUX
+            mysql_thread_end();
+#endif
+            return NULL;
+        }
+
+        void *MySQLFactory::maintenance(void *arg) {
+            MySQLFactory *factory = (MySQLFactory *) arg;
+            pthread_attr_t detached;
+            pthread_attr_init(&detached);
+            pthread_attr_setdetachstate(&detached, PTHREAD_CREATE_DETACHED);
+#ifdef LINUX
+            mysql_thread_init();
+#endif
+            pthread_mutex_lock(&factory->src_map_lock_);
+            while (!factory->stopping_) {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += 1;
+                pthread_cond_timedwait(&factory->stop_cond_, &factory->src_map_lock_, &deadline);
+                if (factory->stopping_)
+                    break;
+
+                //a source still in its last pass, one not answering say, is left to it
+                const SRC_MAP *map = factory->sources_.load(std::memory_order_acquire);
+                for (SRC_MAP::const_iterator it = map->begin(); it != map->end(); ++it) {
+                    Source *source = it->second;
+                    if (source->maintaining_.exchange(true, std::memory_order_acq_rel))
+                        continue;
+                    MaintenancePass *pass = new MaintenancePass;
+                    pass->factory = factory;
+                    pass->source = source;
+                    pthread_t tid;
+                    if (pthread_create(&tid, &detached, maintainSource, pass) == 0) {
+                        ++factory->passes_;
+                    } else {
+                        delete pass;
+                        source->maintaining_.store(false, std::memory_order_relaxed);
+                    }
+                }
+
+                //the round trips are made without the lock
+                std::vector<ConnectionPoolRef> draining;
+                draining.swap(factory->retired_);
+                pthread_mutex_unlock(&factory->src_map_lock_);
+
+                for (size_t i = 0; i < draining.size(); ++i)
+                    draining[i]->drain();
+
+                //kept until nothing but draining refers to them
+                pthread_mutex_lock(&factory->src_map_lock_);
+                for (size_t i = 0; i < draining.size(); ++i) {
+                    if (draining[i]->refCnt() > 1)
+                        factory->retired_.push_back(draining[i]);
+                }
+                pthread_mutex_unlock(&factory->src_map_lock_);
+                draining.clear();
+                pthread_mutex_lock(&factory->src_map_lock_);
+            }
+            pthread_mutex_unlock(&factory->src_map_lock_);
+            pthread_attr_destroy(&detached);
+#ifdef LINUX
+            mysql_thread_end();
+#endif
+            return NULL;
+        }
 
         void MySQLFactory::addSource(const std::string &name, const MySQLConfig &config) {
+            //connected before it is published, outside the lock
+            ConnectionPoolRef pr(new ConnectionPool(config));
+            pr->warmUp(config.min_conns);
+
             pthread_mutex_lock(&src_map_lock_);
             printf("!!!!add source %s %s\n", name.data(), config.host.data());
-            ConnectionPoolRef pr(new ConnectionPool(config));
-            SRC_MAP::const_iterator it = sources_.find(name);
-            if(it == sources_.end()) {
-                sources_.insert(std::make_pair(name, pr));
+            if (!running_ && !stopping_)
+                running_ = (pthread_create(&thread_, NULL, maintenance, this) == 0);
+
+            const SRC_MAP *map = sources_.load(std::memory_order_relaxed);
+            SRC_MAP::const_iterator it = map->find(name);
+            Source *src;
+            if(it == map->end()) {
+                SRC_MAP *next = new SRC_MAP(*map);
+                src = new Source(name);
+                next->insert(std::make_pair(name, src));
+                sources_.store(next, std::memory_order_release);
+                old_maps_.push_back(map);
             }else{
-                sources_.erase(name);
-                sources_.insert(std::make_pair(name, pr));
+                src = it->second;
             }
+
+            //checked out connections of the old pool come back to it, it closes after the last
+            ConnectionPoolRef old = src->swap(pr);
+            src->breaker_.configure(config);
+            if (old.get())
+                retired_.push_back(old);
             pthread_mutex_unlock(&src_map_lock_);
             //printf("!!!!!addSource %s \n", name.data());
         }
 
         Connection *MySQLFactory::getConnection(const std::string &name) {
+            return getConnection(name, NULL);
+        }
+
+        void MySQLFactory::addSourceGroup(const std::string &name, const MySQLConfig &primary,
+                                          const std::vector<MySQLConfig> &replicas, unsigned int max_lag) {
+            std::vector<Source*> *group = new std::vector<Source*>;
+            for (size_t i = 0; i < replicas.size(); ++i) {
+                char suffix[16];
+                snprintf(suffix, sizeof(suffix), "#%u", (unsigned int) i);
+                addSource(name + suffix, replicas[i]);
+                Source *replica = source(name + suffix);
+                replica->replica_.store(true, std::memory_order_relaxed);
+                replica->max_lag_.store(max_lag, std::memory_order_relaxed);
+                replica->lagging_.store(false, std::memory_order_relaxed);
+                replica->lag_.store(Source::LAG_UNCHECKED, std::memory_order_relaxed);
+                group->push_back(replica);
+            }
+            addSource(name, primary);
+
             pthread_mutex_lock(&src_map_lock_);
-            SRC_MAP::const_iterator it = sources_.find(name);
+            Source *src = source(name);
+            const std::vector<Source*> *old = src->replicas_.exchange(group->empty() ? NULL : group,
+                                                                      std::memory_order_acq_rel);
+            if (group->empty())
+                delete group;
+            //reader() may still be looking at it
+            if (old != NULL)
+                old_groups_.push_back(old);
+
+            //replicas the group no longer has leave the map, their pools are drained and closed
+            const SRC_MAP *map = sources_.load(std::memory_order_relaxed);
+            SRC_MAP *next = NULL;
+            for (size_t i = replicas.size(); ; ++i) {
+                char suffix[16];
+                snprintf(suffix, sizeof(suffix), "#%u", (unsigned int) i);
+                SRC_MAP::const_iterator it = map->find(name + suffix);
+                if (it == map->end())
+                    break;
+                if (next == NULL)
+                    next = new SRC_MAP(*map);
+                Source *gone = it->second;
+                next->erase(gone->name());
+                gone->lagging_.store(true, std::memory_order_relaxed);
+                ConnectionPoolRef pool = gone->swap(ConnectionPoolRef(NULL));
+                if (pool.get())
+                    retired_.push_back(pool);
+                //handles outlive their name, callers may still hold this one
+                old_sources_.push_back(gone);
+            }
+            if (next != NULL) {
+                sources_.store(next, std::memory_order_release);
+                old_maps_.push_back(map);
+            }
             pthread_mutex_unlock(&src_map_lock_);
-            
-            if (it == sources_.end()) {
+        }
+
+        Source *MySQLFactory::source(const std::string &name) {
+            const SRC_MAP *map = sources_.load(std::memory_order_acquire);
+            SRC_MAP::const_iterator it = map->find(name);
+            return (it != map->end()) ? it->second : NULL;
+        }
+
+        Connection *MySQLFactory::getConnection(const std::string &name, int *error) {
+            return getConnection(source(name), error);
+        }
+
+        Connection *MySQLFactory::getConnection(Source *source, int *error) {
+            ConnectionPoolRef src = source ? source->pool() : ConnectionPoolRef(NULL);
+            if (src.get() == NULL) {
+                if (error)
+                    *error = -1;
                 return NULL;
             }
-            
-            ConnectionPoolRef src = it->second;
+
+            CircuitBreaker &breaker = source->breaker_;
+            uint32_t ticket = 0;
+            CircuitBreaker::Verdict verdict = breaker.admit(&ticket);
+            if (verdict == CircuitBreaker::REFUSE) {
+                if (error)
+                    *error = SOURCE_UNAVAILABLE;
+                return NULL;
+            }
+
             PoolableConnection *conn = src->getConnection();
+            if (conn == NULL) {
+                if (verdict == CircuitBreaker::PROBE)
+                    breaker.abandon(ticket);
+                if (error)
+                    *error = POOL_EXHAUSTED;
+                return NULL;
+            }
 
+            //only a connect or ping tells about the source, queries are reported by the caller
+            bool tried = false, ok = true;
             if (!conn->connected()) {
                 //YY_LOG_ERROR( "mysql db:%s not connect, try reconnect", name.c_str());
+                if (!breaker.takeToken()) {
+                    conn->close();
+                    if (verdict == CircuitBreaker::PROBE)
+                        breaker.abandon(ticket);
+                    if (error)
+                        *error = SOURCE_UNAVAILABLE;
+                    return NULL;
+                }
 
+                tried = true;
                 try {
                     conn->connect();
+                    conn->session_at_ = nowMs();
                 } catch (Exception &e) {
                     /*YY_LOG_ERROR( "connect mysql://%s:***@%s:%d/%s failed: %s",
                         src->config.user.c_str(),
@@ -171,12 +1140,50 @@ namespace server {
                         src->config.database.c_str(),
                         e.what());*/
                     conn->disconnect();
+                    ok = false;
                 }
 
                 //conn->setCharSet("utf8");
+            } else if (verdict == CircuitBreaker::PROBE) {
+                //a pooled connection may have died with the source, the probe has to reach it
+                tried = true;
+                ok = conn->ping();
+                if (!ok)
+                    conn->disconnect();
             }
+
+            if (verdict == CircuitBreaker::PROBE)
+                breaker.probed(ok, ticket);
+            else if (tried && ok)
+                breaker.succeeded();
+            else if (tried)
+                breaker.failed();
+            if (error)
+                *error = 0;
             return conn;
         }
+
+        bool MySQLFactory::poolStats(const std::string &name, PoolStats *stats) {
+            Source *source = this->source(name);
+            ConnectionPoolRef src = source ? source->pool() : ConnectionPoolRef(NULL);
+            if (src.get() == NULL)
+                return false;
+            *stats = src->stats();
+            return true;
+        }
+
+        Connection *MySQLFactory::tryGetConnection(const std::string &name, bool *found) {
+            Source *source = this->source(name);
+            ConnectionPoolRef src = source ? source->pool() : ConnectionPoolRef(NULL);
+
+            if (found)
+                *found = (src.get() != NULL);
+            if (src.get() == NULL) {
+                return NULL;
+            }
+
+            return src->tryGetConnection();
+        }
         
     }    //mysqldb
 }    //server
@@ -6,13 +6,27 @@
 #include <pthread.h>
 #include <map>
 #include <vector>
+#include <list>
+#include <atomic>
 
 namespace server {
     namespace mysqldb {
         class ConnectionPool;
+        class CircuitBreaker;
+
+        //error code of a checkout that got no connection before its deadline
+        enum { POOL_EXHAUSTED = -2 };
+        //error code of a checkout refused at once, its source is not answering
+        enum { SOURCE_UNAVAILABLE = -3 };
 
         struct MySQLConfig {
-            MySQLConfig():autocommit(1), read_timeout(30), connect_timeout(3){}
+            MySQLConfig():autocommit(1), read_timeout(30), connect_timeout(3),
+                          prepared(false), stmt_cache_size(64), multi_statements(false),
+                          checkout_timeout_ms(0), max_waiters(0),
+                          min_conns(0), warmup_threads(4), idle_timeout(0),
+                          ping_interval(0), max_age(0),
+                          breaker_failures(0), breaker_cooldown_ms(5000), breaker_probes(1),
+                          reconnect_rate(0), reconnect_burst(0){}
             std::string host;
             unsigned short port;
             std::string user;
@@ -22,32 +36,138 @@ namespace server {
             unsigned int read_timeout;
             unsigned int connect_timeout;
             bool        autocommit;
-            unsigned int maxconns;
+            unsigned int maxconns;          //connections open at most, opened on demand above min_conns
+            bool        prepared;           //execute through server side prepared statements
+            unsigned int stmt_cache_size;   //prepared statements kept per connection
+            bool        multi_statements;   //let pipelines share one round trip
+            unsigned int checkout_timeout_ms;   //wait for an idle connection at most this long, 0: forever
+            unsigned int max_waiters;           //fail checkouts at once while this many wait, 0: no limit
+            unsigned int min_conns;         //opened by addSource and kept open
+            unsigned int warmup_threads;    //connecting min_conns in parallel
+            unsigned int idle_timeout;      //close connections idle this many seconds beyond min_conns, 0: never
+            unsigned int ping_interval;     //ping connections idle this many seconds, 0: never
+            unsigned int max_age;           //reset sessions older than this many seconds, 0: never
+            unsigned int breaker_failures;      //connect or fatal errors in a row opening the breaker, 0: never
+            unsigned int breaker_cooldown_ms;   //checkouts fail at once this long after it opened
+            unsigned int breaker_probes;        //checkouts let through at a time to try the source again
+            unsigned int reconnect_rate;        //connects a second at most, 0: no limit
+            unsigned int reconnect_burst;       //connects at once after a quiet time, 0: reconnect_rate
+        };
+
+        struct PoolStats {
+            enum { WAIT_BUCKETS = 24 };
+
+            uint64_t checkouts;
+            uint64_t waits;         //checkouts that found nothing idle and queued
+            uint64_t timeouts;      //queued checkouts that hit their deadline
+            uint64_t rejected;      //failed at once, max_waiters were queued
+            int waiting;            //threads queued right now
+            int max_waiting;
+            uint64_t wait_us[WAIT_BUCKETS];     //queued waits, bucket i: [2^i, 2^(i+1)) microseconds
+            uint64_t evictions;     //closed after idle_timeout
+            uint64_t pings;
+            uint64_t reconnects;    //found broken by a ping or a failed reset, or below min_conns
+            uint64_t resets;        //sessions past max_age
         };
 
         class PoolableConnection;
         
+        /*
+         * Idle connections of one source. They are kept on per-CPU shards,
+         * each a lock-free stack; a connection goes back to the shard of the
+         * CPU releasing it and is taken from the caller's shard first, from
+         * the others only when that one is empty. Threads only take the
+         * lock when nothing is idle and they have to wait.
+         */
         class ConnectionPool {
         public:
             ConnectionPool(const MySQLConfig& config);
             ~ConnectionPool();
              
+            //waits checkout_timeout_ms of the config
             PoolableConnection *getConnection();
+            //NULL once timeout_ms (0: no limit) passed, waiters are served in order
+            PoolableConnection *getConnection(unsigned int timeout_ms);
+            PoolableConnection *tryGetConnection();   //NULL instead of waiting
             void releaseConnection(PoolableConnection * c);
+
+            PoolStats stats();
+
+            //open up to count connections with warmup_threads threads, before the pool is shared
+            void warmUp(unsigned int count);
+
+            /*
+             * one round of upkeep on idle connections, run by the factory
+             * for each source on a thread of its own: close those idle past idle_timeout beyond
+             * min_conns, ping those idle past ping_interval, reset sessions
+             * older than max_age and reopen broken ones up to min_conns.
+             * Only the connection in a round trip is out of reach meanwhile.
+             * Reconnects go through breaker, NULL for none.
+             */
+            void maintain(CircuitBreaker *breaker = NULL);
+
+            //close the idle connections of a pool taken out of service
+            void drain();
          
-            void addRef();
+            void addRef(int count = 1);
             int decRef();
             int refCnt();
 
         private:
-            typedef std::vector<PoolableConnection*>   CACHE_TYPE;
-            CACHE_TYPE cache_;   //pooling connections
-            pthread_mutex_t cache_lock_;
-            pthread_cond_t cache_not_empty_cond_;
+            //head of a stack: tag << 32 | (slot + 1), 0 for empty
+            struct alignas(64) Shard {
+                std::atomic<uint64_t> head;
+            };
+
+            PoolableConnection *pop(Shard &shard);
+            void push(Shard &shard, PoolableConnection *c);
+            PoolableConnection *take();
+            bool own(PoolableConnection *c);
+            bool claim(size_t slot);
+            void unclaim(PoolableConnection *c);
+            PoolableConnection *wait(unsigned int timeout_ms);
+            void putBack(PoolableConnection *c);
+            Shard &localShard();
+
+            static void *connectAll(void *arg);
+
+            //a queued checkout, woken alone once a release hands it conn
+            struct Waiter {
+                pthread_cond_t cond;
+                PoolableConnection *conn;
+            };
+
+            std::vector<PoolableConnection*> conns_;    //every connection, by slot
+            std::vector<std::atomic<uint32_t> > next_;  //slot + 1 below each one on its stack
+
+            enum {
+                IDLE        = 0,    //on a stack
+                BUSY        = 1,    //checked out or handed to a waiter
+                SERVICED    = 2,    //on a stack, maintain() has it
+                ORPHANED    = 3,    //maintain() has it, popped off its stack meanwhile
+            };
+            std::vector<std::atomic<int> > state_;     //of each slot
+            std::vector<Shard> shards_;
             MySQLConfig config_;
 
-            int ref_count_;
-            pthread_mutex_t ref_count_lock_;
+            std::atomic<int> waiters_;              //queued or about to queue
+            pthread_mutex_t wait_lock_;
+            pthread_condattr_t wait_attr_;
+            std::list<Waiter*> queue_;              //oldest first, under wait_lock_
+
+            std::atomic<uint64_t> checkouts_;
+            std::atomic<uint64_t> waits_;
+            std::atomic<uint64_t> timeouts_;
+            std::atomic<uint64_t> rejected_;
+            int max_waiting_;
+            std::atomic<uint64_t> wait_us_[PoolStats::WAIT_BUCKETS];
+
+            std::atomic<uint64_t> evictions_;
+            std::atomic<uint64_t> pings_;
+            std::atomic<uint64_t> reconnects_;
+            std::atomic<uint64_t> resets_;
+
+            std::atomic<int> ref_count_;
         };
 
 
@@ -57,6 +177,7 @@ namespace server {
             ConnectionPoolRef(const ConnectionPoolRef&);
             ConnectionPoolRef& operator =(const ConnectionPoolRef&);
             ConnectionPool* operator->();
+            inline ConnectionPool *get() const { return pool_; }
             ~ConnectionPoolRef();
 
         private:
@@ -65,13 +186,186 @@ namespace server {
 
         class PoolableConnection : public Connection {
         public:
-            PoolableConnection(const MySQLConfig& config);
+            PoolableConnection(const MySQLConfig& config, unsigned int slot = 0);
             void close(); 
 
             ConnectionPoolRef pool_ref_;
+            unsigned int slot_;     //index in its pool
+            uint64_t idle_since_;   //ms, when last released
+            uint64_t checked_at_;   //ms, released or pinged last
+            uint64_t session_at_;   //ms, connected or reset last, 0: not known
         };
 
 
+        /*
+         * Guards a source that stopped answering. breaker_failures connect or
+         * fatal errors in a row open it: checkouts then fail at once with
+         * SOURCE_UNAVAILABLE instead of each waiting out connect_timeout.
+         * After breaker_cooldown_ms up to breaker_probes checkouts go through
+         * to try the source; one that reaches it closes the breaker, one that
+         * does not opens it for another cooldown. Independently of that,
+         * connects are limited to reconnect_rate a second by a token bucket,
+         * so a source coming back is not met by every thread at once.
+         */
+        class CircuitBreaker {
+        public:
+            enum State {
+                CLOSED      = 0,
+                OPEN        = 1,
+                HALF_OPEN   = 2,
+            };
+
+            enum Verdict {
+                PASS        = 0,
+                PROBE       = 1,    //let through to try the source, report it to probed()
+                REFUSE      = 2,
+            };
+
+            CircuitBreaker();
+            ~CircuitBreaker();
+
+            //take the settings of config, closed and with a full bucket
+            void configure(const MySQLConfig &config);
+
+            //a PROBE gets a ticket to hand to probed() or abandon()
+            Verdict admit(uint32_t *ticket);
+
+            //a PROBE is over, ok if the source answered. Ignored if the breaker opened again since
+            void probed(bool ok, uint32_t ticket);
+
+            //a PROBE ended before it tried the source
+            void abandon(uint32_t ticket);
+
+            void succeeded();
+            void failed();
+
+            //true if a connect may be made now, taking a token for it
+            bool takeToken();
+
+            inline State state() const { return (State) (gate_.load(std::memory_order_acquire) & 0xffff); }
+
+            //open and still cooling down
+            bool refusing() const;
+
+            inline uint64_t trips() const { return trips_.load(std::memory_order_relaxed); }
+
+            inline uint64_t refused() const { return refused_.load(std::memory_order_relaxed); }
+
+        private:
+            CircuitBreaker(const CircuitBreaker &);
+            CircuitBreaker &operator =(const CircuitBreaker &);
+
+            bool trip(uint64_t &seen);
+
+            /*
+             * state in the low 16 bits, probes in flight in the next 16 and
+             * above them the epoch, bumped by every trip. One word, so the
+             * probes of a round start counting from zero with it.
+             */
+            std::atomic<uint64_t> gate_;
+            std::atomic<unsigned int> failures_;    //in a row
+            std::atomic<uint64_t> open_until_;      //ms
+            std::atomic<unsigned int> threshold_;
+            std::atomic<unsigned int> cooldown_ms_;
+            std::atomic<unsigned int> max_probes_;
+            std::atomic<uint64_t> trips_;
+            std::atomic<uint64_t> refused_;
+
+            pthread_mutex_t bucket_lock_;
+            double rate_;           //tokens a ms, 0: no limit
+            double burst_;
+            double tokens_;
+            uint64_t filled_at_;    //ms
+        };
+
+        /*
+         * A source by name. addSource swaps the pool behind it, the handle
+         * itself lives as long as the factory, so callers resolve it once.
+         *
+         * The primary of a group added by addSourceGroup also knows its
+         * replicas, themselves sources named primary#0, primary#1 and so on.
+         */
+        class Source {
+        public:
+            //lag() of a replica that could not tell its seconds behind
+            enum {
+                LAG_UNKNOWN     = -1,   //no privilege, not a replica, status not understood
+                LAG_STOPPED     = -2,   //replication not running
+                LAG_UNREACHABLE = -3,
+                LAG_UNCHECKED   = -4,
+            };
+
+            explicit Source(const std::string &name);
+            ~Source();
+
+            inline const std::string &name() const { return name_; }
+
+            //the current pool, a NULL ref before the first addSource
+            ConnectionPoolRef pool();
+
+            inline bool replicated() const { return replicas_.load(std::memory_order_relaxed) != NULL; }
+
+            inline bool replica() const { return replica_.load(std::memory_order_relaxed); }
+
+            //seconds a replica may lag behind its primary, 0: not checked
+            inline unsigned int maxLag() const { return max_lag_.load(std::memory_order_relaxed); }
+
+            //seconds behind as last checked, or one of the LAG_ codes
+            inline long long lag() const { return lag_.load(std::memory_order_relaxed); }
+
+            /*
+             * where a read goes: of the replicas not lagging or refused by
+             * their breaker, the one with the least (outstanding reads + 1) *
+             * average latency, this source if there is none.
+             */
+            Source *reader();
+
+            //a read on this replica starts, returns what finished() wants back
+            uint64_t started();
+
+            void finished(uint64_t started);
+
+            inline CircuitBreaker &breaker() { return breaker_; }
+
+        private:
+            friend class MySQLFactory;
+
+            Source(const Source &);
+            Source &operator =(const Source &);
+
+            //publish pool, returning the one it replaced
+            ConnectionPoolRef swap(const ConnectionPoolRef &pool);
+
+            /*
+             * the pool in the low 48 bits, readers between loading it and
+             * taking a ref of their own counted in the high 16. A swap moves
+             * that count onto the old pool, so it cannot go away under them.
+             */
+            std::atomic<uint64_t> state_;
+            std::string name_;
+
+            std::atomic<const std::vector<Source*>*> replicas_;     //NULL: no group
+            std::atomic<bool> replica_;
+            std::atomic<unsigned int> max_lag_;     //seconds, 0: not checked
+            std::atomic<bool> lagging_;             //or not reachable, skipped by reader()
+            std::atomic<long long> lag_;
+            std::atomic<int> outstanding_;
+            std::atomic<uint64_t> latency_us_;      //moving average
+            std::atomic<bool> maintaining_;         //a maintenance pass is running
+            CircuitBreaker breaker_;
+        };
+
+        /*
+         * Sources by name. Lookups read an immutable map without a lock; a
+         * new name publishes a copy, a new pool for a known name only swaps
+         * it in its Source. Pools swapped out are drained in the background
+         * and closed once their last connection came back.
+         *
+         * The first addSource starts a thread doing the upkeep of idle
+         * connections every second, so dead ones are found there instead of
+         * by a query. Each source gets a pass on a thread of its own, at
+         * most one at a time, so one not answering only holds up itself.
+         */
         class MySQLFactory {
         public:
             MySQLFactory();
@@ -80,12 +374,56 @@ namespace server {
 
             void addSource(const std::string &name, const MySQLConfig &config);
 
+            /*
+             * name for writes and transactions on primary, SELECTs of a
+             * MySQLTemplate go to the replicas. Replicas more than max_lag
+             * seconds behind, stopped or not answering, are left out until
+             * they caught up; 0 does not check. One that cannot tell its lag
+             * keeps serving, reported on stderr. Called again, it swaps them
+             * all, replicas beyond the new count are removed.
+             */
+            void addSourceGroup(const std::string &name, const MySQLConfig &primary,
+                                const std::vector<MySQLConfig> &replicas, unsigned int max_lag);
+
+            //handle of name, NULL until it was added
+            Source *source(const std::string &name);
+
             Connection *getConnection(const std::string &name);  //allocate a connection from pool
 
+            //NULL with *error POOL_EXHAUSTED if the pool had none in time, SOURCE_UNAVAILABLE
+            //if its breaker refused, -1 for an unknown name
+            Connection *getConnection(const std::string &name, int *error);
+
+            Connection *getConnection(Source *source, int *error);
+
+            bool poolStats(const std::string &name, PoolStats *stats);
+
+            //an idle connection of the pool, possibly not connected yet. NULL
+            //if none is idle right now, found tells an unknown name apart
+            Connection *tryGetConnection(const std::string &name, bool *found);
+
         private:
-            typedef std::map<std::string, ConnectionPoolRef> SRC_MAP;
-            SRC_MAP sources_;
-            pthread_mutex_t src_map_lock_;
+            typedef std::map<std::string, Source*> SRC_MAP;
+
+            static void *maintenance(void *arg);
+
+            static void *maintainSource(void *arg);
+
+            static void checkLag(Source *replica, unsigned int max_lag);
+
+            std::atomic<const SRC_MAP*> sources_;
+            std::vector<const SRC_MAP*> old_maps_;      //lookups may still read them
+            std::vector<const std::vector<Source*>*> old_groups_;
+            std::vector<Source*> old_sources_;          //replicas dropped from their group
+            std::vector<ConnectionPoolRef> retired_;    //swapped out, draining
+            pthread_mutex_t src_map_lock_;              //serializes writers, guards the rest
+
+            pthread_t thread_;
+            bool running_;          //thread_ started, under src_map_lock_
+            bool stopping_;
+            pthread_cond_t stop_cond_;
+            int passes_;            //maintainSource threads running, under src_map_lock_
+            pthread_cond_t pass_cond_;
         };
         typedef singleton_default<MySQLFactory> MYSQL_FACTORY ;
 
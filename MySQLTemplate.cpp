@@ -1,10 +1,17 @@
 #include "MySQLTemplate.h"
+#include "CompiledSQL.h"
 
 namespace server {
 namespace mysqldb {
 
 
-static int executeSQL(Callback *callback, bool preview, Connection *conn, const char *sql, const std::vector<Parameter> *param) {
+/*
+ * run one statement on conn. retryable is cleared once rows of a streamed
+ * result have reached the callback, running it again would repeat them.
+ * With a cell the first cell of the result goes there instead.
+ */
+static int executeSQL(Callback *callback, SQLTemplate *owner, Connection *conn, const char *sql, const ParamList *param,
+                      bool *retryable, ScalarCell *cell = NULL) {
 	if (conn == NULL) {
 		if (callback) {
 			callback->onException(Exception(-1, "get connection failed"));
@@ -16,27 +23,51 @@ static int executeSQL(Callback *callback, bool preview, Connection *conn, const
 	//uint64_t _checkCycle = 1000 * measure_metrics::getCpuFreq();
 
 	Statement stmt = conn->createStatement();
-	stmt.prepare(sql);
+	bool preview = owner->preview();
+	ExecMode mode = owner->execMode();
+	bool prepared = (mode == EXEC_PREPARED) || (mode == EXEC_DEFAULT && conn->preferPrepared());
+	ResultSet result;
 
-	if (param != NULL) {
-		stmt.bindParams(*param);
-	}
-	if (preview) {
-		if (callback) {
-			callback->onPreview(stmt.preview());
+	try {
+		CompiledSQLPtr tpl;
+		if (param != NULL || prepared) {
+			tpl = COMPILED_SQL_CACHE::instance().compile(sql);
+		}
+		if (prepared && !preview) {
+			//the text form is only rendered when someone looks at it
+		} else if (param != NULL) {
+			stmt.bindParams(*tpl, *param);
+		} else {
+			stmt.prepare(sql);
+		}
+		if (preview) {
+			if (callback) {
+				callback->onPreview(stmt.preview());
+			}
 		}
-	}
 
-	try {
-		ResultSet result = stmt.execute();
-		if (callback) {
+		if (prepared) {
+			result = conn->executePrepared(*tpl, param);
+		} else if (mode == EXEC_STREAM) {
+			result = stmt.executeStream(owner->streamOptions());
+		} else {
+			result = stmt.execute();
+		}
+		if (cell) {
+			if (result.next())
+				cell->read(result);
+		} else if (callback) {
 			callback->onResult(result);
 		}
 	} catch (Exception &e) {
+		if (retryable)
+			*retryable = !result.streamed();
+		result.close(conn);
 		if (callback)
 			callback->onException(e);
 		return e.code();
 	}
+	result.close(conn);
 
 	//uint64_t _lastCycle2 = measure_metrics::get_cpu_cycle();
 	//uint64_t _useTime = (_lastCycle2-_lastCycle1) / _checkCycle;
@@ -48,22 +79,193 @@ static int executeSQL(Callback *callback, bool preview, Connection *conn, const
 	return 0;
 }
 
-/* MySQLTemplate */
-MySQLTransaction MySQLTemplate::beginTransaction() {
-	MySQLTransaction tx(server::mysqldb::MYSQL_FACTORY::instance().getConnection(dbname_));
-	tx.setPreview(preview());
-	tx.begin();
-	return tx;
+/*
+ * render values into as few multi-row statements as max_allowed_packet
+ * allows. Nothing is retried once a chunk has been applied.
+ */
+static int executeBatchSQL(Callback *callback, SQLTemplate *owner, Connection *conn, const char *sql,
+                           const std::vector<Parameter> &values, size_t columns, bool *retryable) {
+	if (conn == NULL) {
+		if (callback) {
+			callback->onException(Exception(-1, "get connection failed"));
+		}
+		return 2006;
+	}
+
+	size_t rows = (columns > 0) ? values.size() / columns : 0;
+	size_t done = 0;
+	Statement stmt = conn->createStatement();
+
+	try {
+		CompiledSQLPtr tpl = COMPILED_SQL_CACHE::instance().compile(sql);
+		//leave room for the packet header and command byte
+		size_t limit = conn->maxAllowedPacket() - 64;
+
+		while (done < rows) {
+			size_t n = stmt.bindBatch(*tpl, &values[done * columns], rows - done, columns, limit);
+			if (owner->preview() && callback) {
+				callback->onPreview(stmt.preview());
+			}
+
+			ResultSet result = stmt.execute();
+			if (retryable)
+				*retryable = false;
+			if (callback) {
+				callback->onChunk(done, n, result);
+			}
+			done += n;
+		}
+	} catch (Exception &e) {
+		if (callback)
+			callback->onException(e);
+		return e.code();
+	}
+
+	return 0;
+}
+
+static void failPipeline(Pipeline &pipeline, size_t index, const Exception &e) {
+	pipeline.setFailed((int)index);
+	Callback *callback = pipeline.at(index).callback;
+	if (callback) {
+		callback->onException(Exception(e.code(), "statement %d: %s", (int)index, e.what()));
+	}
+	for (size_t i = index + 1; i < pipeline.size(); ++i) {
+		if (pipeline.at(i).callback) {
+			pipeline.at(i).callback->onException(Exception(-1, "statement %d not executed, statement %d failed", (int)i, (int)index));
+		}
+	}
+}
+
+/*
+ * send every statement of pipeline as one multi statement text when the
+ * connection allows it, otherwise one after another on conn.
+ */
+static int executePipeline(Pipeline &pipeline, SQLTemplate *owner, Connection *conn, bool *retryable) {
+	pipeline.setFailed(-1);
+	if (pipeline.size() == 0)
+		return 0;
+	if (conn == NULL) {
+		failPipeline(pipeline, 0, Exception(-1, "get connection failed"));
+		return 2006;
+	}
+
+	bool multi = conn->multiStatements();
+	bool sent = false;
+	Statement stmt = conn->createStatement();
+	std::string text;
+	size_t index = 0;
+
+	try {
+		for (index = 0; index < pipeline.size(); ++index) {
+			const Pipeline::Entry &entry = pipeline.at(index);
+			if (!entry.params.empty()) {
+				stmt.bindParams(*COMPILED_SQL_CACHE::instance().compile(entry.sql), entry.params);
+			} else {
+				stmt.prepare(entry.sql);
+			}
+			if (owner->preview() && entry.callback) {
+				entry.callback->onPreview(stmt.preview());
+			}
+
+			if (multi) {
+				text.append(stmt.preview());
+				text.append(";\n");
+				continue;
+			}
+			ResultSet result = stmt.execute();
+			if (retryable)
+				*retryable = false;
+			if (entry.callback) {
+				entry.callback->onResult(result);
+			}
+		}
+		if (!multi)
+			return 0;
+
+		//one round trip, then one result per statement in order
+		index = 0;
+		sent = true;
+		stmt.prepare(text);
+		ResultSet result = stmt.execute();
+		for (;;) {
+			if (retryable)
+				*retryable = false;
+			if (pipeline.at(index).callback) {
+				pipeline.at(index).callback->onResult(result);
+			}
+			if (++index == pipeline.size() || !stmt.moreResults())
+				break;
+			result = stmt.nextResult();
+		}
+	} catch (Exception &e) {
+		if (multi && sent) {
+			stmt.discardResults();
+		} else if (multi) {
+			//rendering failed, nothing before index was sent either
+			for (size_t i = 0; i < index; ++i) {
+				if (pipeline.at(i).callback) {
+					pipeline.at(i).callback->onException(Exception(-1, "statement %d not executed, statement %d failed", (int)i, (int)index));
+				}
+			}
+		}
+		failPipeline(pipeline, index < pipeline.size() ? index : pipeline.size() - 1, e);
+		return e.code();
+	}
+
+	return 0;
 }
 
-int MySQLTemplate::execSQL(Callback *callback, const char *sql, const std::vector<Parameter> *param) {
+/* a read on a replica, outstanding while it lives and timed for Source::reader() */
+struct ReplicaLoad {
+	explicit ReplicaLoad(Source *source): source_((source && source->replica()) ? source : NULL), started_(0) {
+		if (source_)
+			started_ = source_->started();
+	}
+
+	~ReplicaLoad() {
+		if (source_)
+			source_->finished(started_);
+	}
+
+	Source *source_;
+	uint64_t started_;
+};
+
+/*
+ * run execute on a pooled connection of source, reconnecting once on a
+ * fatal client error unless execute reports its work is not retryable.
+ * When the pool has no connection before the checkout deadline nothing
+ * runs, reject gets the error instead.
+ */
+template<typename Execute, typename Reject>
+static int runOnSource(Source *source, Execute execute, Reject reject) {
+	ReplicaLoad load(source);
 	static int max_reconnect = 2;
     int last_err;
 	for (int i = 0; i < max_reconnect; ++i) {
-		Connection* conn = server::mysqldb::MYSQL_FACTORY::instance().getConnection(dbname_);
+		int error = 0;
+		Connection* conn = server::mysqldb::MYSQL_FACTORY::instance().getConnection(source, &error);
+		if (conn == NULL && error == POOL_EXHAUSTED) {
+			reject(Exception(POOL_EXHAUSTED, "no connection of %s free in time", source->name().c_str()));
+			return POOL_EXHAUSTED;
+		}
+		if (conn == NULL && error == SOURCE_UNAVAILABLE) {
+			reject(Exception(SOURCE_UNAVAILABLE, "%s is not answering, not tried", source->name().c_str()));
+			return SOURCE_UNAVAILABLE;
+		}
 
-		int err = executeSQL(callback, preview(), conn, sql, param);
+		//a failed connect was counted by getConnection already
+		bool live = conn && conn->connected();
+		bool retryable = true;
+		int err = execute(conn, &retryable);
         last_err = err;
+		if (err >= 2000 && err <= 2018) {
+			if (live)
+				source->breaker().failed();
+		} else {
+			source->breaker().succeeded();
+		}
 		if (err == 0) {
 			if ( !conn->autocommit() )
 				conn->commit() ;
@@ -75,6 +277,8 @@ int MySQLTemplate::execSQL(Callback *callback, const char *sql, const std::vecto
 				conn->disconnect();
                 conn->close(); 
             }
+			if (!retryable)
+				break;
 		} else {
 			if ( !conn->autocommit() )
 				conn->rollback() ;
@@ -86,6 +290,273 @@ int MySQLTemplate::execSQL(Callback *callback, const char *sql, const std::vecto
 	return last_err;
 }
 
+/* keeps what a shared read returned, passing everything else on */
+struct SnapshotCallback : public Callback {
+	explicit SnapshotCallback(Callback *target): target_(target), error_(0) {}
+
+	virtual void onPreview(const std::string &sql) {
+		if (target_)
+			target_->onPreview(sql);
+	}
+
+	virtual void onResult(ResultSet &result) {
+		snapshot_.reset(new ResultSnapshot(result));
+	}
+
+	virtual void onException(const Exception &ex) {
+		error_ = ex.code();
+		errorMsg_ = ex.what();
+		if (target_)
+			target_->onException(ex);
+	}
+
+	Callback *target_;
+	ResultSnapshotPtr snapshot_;
+	int error_;
+	std::string errorMsg_;
+};
+
+//tables a cached read depends on, and those a write invalidates
+static const std::vector<std::string> &readTags(const CompiledSQL &tpl, const CachePolicy &policy) {
+	return policy.tags.empty() ? tpl.tables() : policy.tags;
+}
+
+static const std::vector<std::string> &writeTags(const CompiledSQL &tpl, const CachePolicy &policy) {
+	return tpl.tables().empty() ? policy.tags : tpl.tables();
+}
+
+static int deliver(const ResultSnapshotPtr &snapshot, Callback *callback, ScalarCell *cell) {
+	ResultSet result(snapshot);
+	try {
+		if (cell) {
+			if (result.next())
+				cell->read(result);
+		} else if (callback) {
+			callback->onResult(result);
+		}
+	} catch (Exception &e) {
+		if (callback)
+			callback->onException(e);
+		return e.code();
+	}
+	return 0;
+}
+
+/*
+ * run a read of tpl on source, a replica of primary or primary itself, into
+ * capture, keeping the result in cache if there is one. A cache is filled
+ * from a replica only once its tags were last invalidated longer ago than
+ * the replica may lag, max_lag plus the second between checks; without
+ * max_lag never after an invalidation at all.
+ */
+static int fetch(QueryCache *cache, const CachePolicy &policy, SQLTemplate *owner, Source *primary, Source *source,
+                 const std::string &key, const CompiledSQL &tpl, SnapshotCallback *capture,
+                 const char *sql, const ParamList *param) {
+	//before the statement, so a write finishing meanwhile voids the result
+	QueryCache::TagVersions versions;
+	if (cache) {
+		uint64_t quiet_ms;
+		versions = cache->watch(readTags(tpl, policy), &quiet_ms);
+		if (source != primary && source != NULL) {
+			unsigned int max_lag = source->maxLag();
+			if (quiet_ms != UINT64_MAX && (max_lag == 0 || quiet_ms <= (max_lag + 1) * 1000ULL))
+				source = primary;
+		}
+	}
+
+	int err = runOnSource(source, [&](Connection *conn, bool *retryable) {
+		return executeSQL(capture, owner, conn, sql, param, retryable);
+	}, [&](const Exception &e) {
+		capture->onException(e);
+	});
+	if (err == 0 && cache && capture->snapshot_.get() != NULL)
+		cache->put(key, capture->snapshot_, policy, versions);
+	return err;
+}
+
+/*
+ * run a read and hand its result on. With single_flight callers of the
+ * same key at the same time share one statement, those that only waited
+ * get the error of the one that ran it.
+ */
+static int fetchShared(QueryCache *cache, const CachePolicy &policy, SQLTemplate *owner, Source *primary, Source *source,
+                       const std::string &key, const CompiledSQL &tpl, Callback *callback, ScalarCell *cell,
+                       const char *sql, const ParamList *param, bool single_flight) {
+	SnapshotCallback capture(callback);
+	if (!single_flight) {
+		int err = fetch(cache, policy, owner, primary, source, key, tpl, &capture, sql, param);
+		if (err != 0 || capture.snapshot_.get() == NULL)
+			return err;
+		return deliver(capture.snapshot_, callback, cell);
+	}
+
+	SingleFlight::Outcome outcome;
+	SINGLE_FLIGHT::instance().execute(key, [&](SingleFlight::Outcome *out) {
+		out->code = fetch(cache, policy, owner, primary, source, key, tpl, &capture, sql, param);
+		out->error = capture.error_;
+		out->message = capture.errorMsg_;
+		out->result = capture.snapshot_;
+	}, &outcome);
+
+	if (outcome.code != 0) {
+		if (outcome.shared && callback)
+			callback->onException(Exception(outcome.error, "%s", outcome.message.c_str()));
+		return outcome.code;
+	}
+	if (outcome.result.get() == NULL)
+		return 0;
+	return deliver(outcome.result, callback, cell);
+}
+
+/* MySQLTemplate */
+Source *MySQLTemplate::source() {
+	Source *src = source_.load(std::memory_order_acquire);
+	if (src == NULL) {
+		//handles live as long as the factory, any thread may cache one
+		src = MYSQL_FACTORY::instance().source(dbname_);
+		source_.store(src, std::memory_order_release);
+	}
+	return src;
+}
+
+Source *MySQLTemplate::sourceFor(const CompiledSQL &tpl) {
+	Source *src = source();
+	if (src == NULL || tpl.kind() != CompiledSQL::KIND_SELECT)
+		return src;
+	return src->reader();
+}
+
+/* the source of sql, compiled only when there are replicas to choose from */
+static Source *routed(MySQLTemplate *owner, const char *sql) {
+	Source *src = owner->source();
+	if (src == NULL || !src->replicated())
+		return src;
+	return owner->sourceFor(*COMPILED_SQL_CACHE::instance().compile(sql));
+}
+
+MySQLTransaction MySQLTemplate::beginTransaction() {
+	MySQLTransaction tx(server::mysqldb::MYSQL_FACTORY::instance().getConnection(source(), NULL));
+	tx.setQueryCache(cache_, policy_);
+	tx.setPreview(preview());
+	tx.setExecMode(execMode());
+	tx.setStreamOptions(streamOptions());
+	tx.begin();
+	return tx;
+}
+
+int MySQLTemplate::execSQL(Callback *callback, const char *sql, const ParamList *param) {
+	if (cache_ != NULL || single_flight_)
+		return execCached(callback, NULL, sql, param);
+	return runOnSource(routed(this, sql), [&](Connection *conn, bool *retryable) {
+		return executeSQL(callback, this, conn, sql, param, retryable);
+	}, [&](const Exception &e) {
+		if (callback)
+			callback->onException(e);
+	});
+}
+
+int MySQLTemplate::execBatchSQL(Callback *callback, const char *sql, const std::vector<Parameter> &values, size_t columns) {
+	if (values.empty())
+		return 0;
+	int err = runOnSource(source(), [&](Connection *conn, bool *retryable) {
+		return executeBatchSQL(callback, this, conn, sql, values, columns, retryable);
+	}, [&](const Exception &e) {
+		if (callback)
+			callback->onException(e);
+	});
+	invalidate(sql);
+	return err;
+}
+
+int MySQLTemplate::execScalar(ScalarCell &cell, const char *sql, const ParamList *param) {
+	if (cache_ != NULL || single_flight_)
+		return execCached(NULL, &cell, sql, param);
+	return runOnSource(routed(this, sql), [&](Connection *conn, bool *retryable) {
+		return executeSQL(NULL, this, conn, sql, param, retryable, &cell);
+	}, [](const Exception &) {
+	});
+}
+
+int MySQLTemplate::execPipeline(Pipeline &pipeline) {
+	int err = runOnSource(source(), [&](Connection *conn, bool *retryable) {
+		return executePipeline(pipeline, this, conn, retryable);
+	}, [&](const Exception &e) {
+		failPipeline(pipeline, 0, e);
+	});
+	for (size_t i = 0; i < pipeline.size(); ++i) {
+		invalidate(pipeline.at(i).sql);
+	}
+	return err;
+}
+
+/*
+ * execSQL or execScalar with a QueryCache or single flight. SELECTs are
+ * answered from the cache while they can be, a result past its ttl is served
+ * while one refresh runs in the background. Writes invalidate the tables
+ * they touch, failed ones too since part of them may have been applied.
+ */
+int MySQLTemplate::execCached(Callback *callback, ScalarCell *cell, const char *sql, const ParamList *param) {
+	CompiledSQLPtr tpl = COMPILED_SQL_CACHE::instance().compile(sql);
+	QueryCache *cache = (policy_.ttl_ms > 0) ? cache_ : NULL;
+	if (tpl->kind() != CompiledSQL::KIND_SELECT || execMode() == EXEC_STREAM || (cache == NULL && !single_flight_)) {
+		int err = runOnSource(sourceFor(*tpl), [&](Connection *conn, bool *retryable) {
+			return executeSQL(callback, this, conn, sql, param, retryable, cell);
+		}, [&](const Exception &e) {
+			if (callback)
+				callback->onException(e);
+		});
+		if (cache_ != NULL && tpl->kind() == CompiledSQL::KIND_WRITE)
+			cache_->invalidate(writeTags(*tpl, policy_));
+		return err;
+	}
+
+	std::string key = QueryCache::key(dbname_, sql, param);
+	if (cache == NULL)
+		return fetchShared(NULL, policy_, this, source(), sourceFor(*tpl), key, *tpl, callback, cell, sql, param, true);
+
+	bool refresh = false;
+	ResultSnapshotPtr result = cache->get(key, &refresh);
+	if (result.get() == NULL)
+		return fetchShared(cache, policy_, this, source(), sourceFor(*tpl), key, *tpl, callback, cell, sql, param, single_flight_);
+
+	if (refresh)
+		refreshLater(key, sql, param);
+	return deliver(result, callback, cell);
+}
+
+/* run the read again on the refresh thread of the cache, with copies of its arguments */
+void MySQLTemplate::refreshLater(const std::string &key, const char *sql, const ParamList *param) {
+	boost::shared_ptr<ParamCopy> args;
+	if (param != NULL)
+		args.reset(new ParamCopy(*param));
+	QueryCache *cache = cache_;
+	CachePolicy policy = policy_;
+	std::string dbname = dbname_;
+	std::string text = sql;
+	ExecMode mode = execMode();
+
+	cache_->schedule([cache, policy, dbname, key, text, mode, args]() {
+		MySQLTemplate owner(dbname);
+		owner.setExecMode(mode);
+		ParamList list;
+		if (args.get() != NULL)
+			list = ParamList(args->params());
+		CompiledSQLPtr tpl = COMPILED_SQL_CACHE::instance().compile(text.c_str());
+		int err = fetchShared(cache, policy, &owner, owner.source(), owner.sourceFor(*tpl), key, *tpl, NULL, NULL, text.c_str(),
+		                      args.get() != NULL ? &list : NULL, false);
+		if (err != 0)
+			cache->abandon(key);
+	});
+}
+
+void MySQLTemplate::invalidate(const char *sql) {
+	if (cache_ == NULL)
+		return;
+	CompiledSQLPtr tpl = COMPILED_SQL_CACHE::instance().compile(sql);
+	if (tpl->kind() == CompiledSQL::KIND_WRITE)
+		cache_->invalidate(writeTags(*tpl, policy_));
+}
+
 /* MySQLTransaction */
 bool MySQLTransaction::begin() {
 
@@ -107,8 +578,9 @@ bool MySQLTransaction::begin() {
 	return true;
 }
 
-int MySQLTransaction::execSQL(Callback *callback, const char *sql, const std::vector<Parameter> *args) {
-	int err = executeSQL(callback, preview(), conn_, sql, args);
+int MySQLTransaction::execSQL(Callback *callback, const char *sql, const ParamList *args) {
+	written(sql);
+	int err = executeSQL(callback, this, conn_, sql, args, NULL);
 	if (err == 0) {		
 		return true;
 	} else if (err <= 2018) {
@@ -119,13 +591,60 @@ int MySQLTransaction::execSQL(Callback *callback, const char *sql, const std::ve
 	return err;
 }
 
+int MySQLTransaction::execBatchSQL(Callback *callback, const char *sql, const std::vector<Parameter> &values, size_t columns) {
+	written(sql);
+	int err = executeBatchSQL(callback, this, conn_, sql, values, columns, NULL);
+	if (err == 0) {
+		return 0;
+	} else if (err <= 2018) {
+		//Fatal error, unrecoverable
+		conn_->disconnect();
+	}
+	conn_ = NULL;
+	return err;
+}
+
+int MySQLTransaction::execScalar(ScalarCell &cell, const char *sql, const ParamList *args) {
+	written(sql);
+	int err = executeSQL(NULL, this, conn_, sql, args, NULL, &cell);
+	if (err == 0) {
+		return 0;
+	} else if (err <= 2018) {
+		//Fatal error, unrecoverable
+		conn_->disconnect();
+	}
+	conn_ = NULL;
+	return err;
+}
+
+int MySQLTransaction::execPipeline(Pipeline &pipeline) {
+	for (size_t i = 0; i < pipeline.size(); ++i) {
+		written(pipeline.at(i).sql);
+	}
+	int err = executePipeline(pipeline, this, conn_, NULL);
+	if (err == 0) {
+		return 0;
+	} else if (err <= 2018) {
+		//Fatal error, unrecoverable
+		conn_->disconnect();
+	}
+	conn_ = NULL;
+	return err;
+}
 
 bool MySQLTransaction::commit() {
 	if (conn_ == NULL)
 		return false;
+	//a failed commit may still have been applied, invalidate either way
+	std::vector<std::string> written;
+	written.swap(written_);
 	try {
 		conn_->commit();
+		if (cache_ != NULL)
+			cache_->invalidate(written);
 	} catch (Exception &e) {
+		if (cache_ != NULL)
+			cache_->invalidate(written);
 		//YY_LOG_ERROR( "thread[%d] commit failed: %s", CLinuxSysTools::gettid(), e.what());
 		if (e.code() <= 2018)
 			conn_->disconnect();
@@ -139,10 +658,22 @@ bool MySQLTransaction::commit() {
 }
 
 void MySQLTransaction::rollback() {
+	written_.clear();
 	if (conn_ == NULL)
 		return;
 	conn_->rollback();
 }
 
+//remember the tables sql writes, invalidated on commit
+void MySQLTransaction::written(const char *sql) {
+	if (cache_ == NULL)
+		return;
+	CompiledSQLPtr tpl = COMPILED_SQL_CACHE::instance().compile(sql);
+	if (tpl->kind() != CompiledSQL::KIND_WRITE)
+		return;
+	const std::vector<std::string> &tags = writeTags(*tpl, policy_);
+	written_.insert(written_.end(), tags.begin(), tags.end());
+}
+
 }	//mysqldb
 }	//server
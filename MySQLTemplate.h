@@ -2,17 +2,39 @@
 #define __YY_MYSQLLIB_TEMPLATE_H__
 
 #include "MySQLFactory.h"
+#include "CompiledSQL.h"
+#include "RowMapper.h"
+#include "QueryCache.h"
+#include "SingleFlight.h"
 #include <vector>
+#include <tuple>
+#include <optional>
 
 namespace server {
 namespace mysqldb {
 
+/*
+ * How a statement is sent to the server. EXEC_DEFAULT follows the
+ * MySQLConfig of the source, EXEC_PREPARED binds parameters natively
+ * through a cached server side prepared statement, EXEC_STREAM hands rows
+ * to the callback as they arrive instead of buffering the whole result.
+ */
+enum ExecMode {
+	EXEC_DEFAULT	= 0,
+	EXEC_TEXT		= 1,
+	EXEC_PREPARED	= 2,
+	EXEC_STREAM		= 3,
+};
+
 struct Callback {
 	virtual void onPreview(const std::string &sql) {}
 
 	virtual void onResult(ResultSet &result) {}
 
 	virtual void onException(const Exception &ex) {}
+
+	//one statement of SQLTemplate::executeBatch, covering rows [offset, offset+rows)
+	virtual void onChunk(size_t offset, size_t rows, ResultSet &result) { onResult(result); }
 };	//Callback
 
 struct NOPCallback : public Callback
@@ -107,6 +129,33 @@ struct MultiResultSet : public Callback
 	std::string errorMsg_ ;
 };
 
+struct BatchChunk
+{
+	size_t offset ;			//first row of the chunk
+	size_t rows ;
+	uint32_t affected_rows ;
+	uint64_t first_id ;		//auto increment id of the first row
+};
+
+struct BatchResultSet : public Callback
+{
+	virtual void onChunk(size_t offset, size_t rows, ResultSet &result)
+	{
+		BatchChunk chunk = { offset, rows, result.getAffectedRows(), result.getLastId() };
+		chunks_.push_back(chunk);
+	}
+
+	virtual void onException(const Exception &ex)
+	{
+		error_ = ex.code();
+		errorMsg_ = ex.what();
+	}
+
+	std::vector<BatchChunk> chunks_ ;
+	int16_t error_ ;
+	std::string errorMsg_ ;
+};
+
 struct RealResultSet : public Callback
 {
 	virtual void onResult(ResultSet &result)
@@ -124,108 +173,262 @@ struct RealResultSet : public Callback
 	std::string errorMsg_ ;
 };
 
+/* every row mapped onto T, see RowMapper.h */
+template<typename T>
+struct RowList : public Callback
+{
+	virtual void onResult(ResultSet &result)
+	{
+		result_.clear();
+
+		RowReader<T> reader(result);
+		while (result.next())
+		{
+			result_.emplace_back();
+			reader.read(result, result_.back());
+		}
+	}
+
+	virtual void onException(const Exception &ex)
+	{
+		error_ = ex.code();
+		errorMsg_ = ex.what();
+	}
+
+	std::vector<T> result_ ;
+	int16_t error_ ;
+	std::string errorMsg_ ;
+};
+
+/* the first row mapped onto T, empty if there was none */
+template<typename T>
+struct SingleRow : public Callback
+{
+	virtual void onResult(ResultSet &result)
+	{
+		result_.reset();
+
+		RowReader<T> reader(result);
+		if (result.next())
+		{
+			reader.read(result, result_.emplace());
+		}
+	}
+
+	virtual void onException(const Exception &ex)
+	{
+		error_ = ex.code();
+		errorMsg_ = ex.what();
+	}
+
+	std::optional<T> result_ ;
+	int16_t error_ ;
+	std::string errorMsg_ ;
+};
+
+/*
+ * independent statements sent together, each with its own callback. With
+ * MySQLConfig::multi_statements they share one round trip, otherwise they
+ * run back to back on one pooled connection.
+ */
+class Pipeline {
+public:
+	struct Entry {
+		Callback *callback;
+		const char *sql;
+		std::vector<Parameter> params;
+	};
+
+	Pipeline(): failed_(-1) {}
+
+	template<typename... Args>
+	Pipeline &add(Callback *callback, const char *sql, const Args &... args) {
+		entries_.push_back(Entry());
+		Entry &entry = entries_.back();
+		entry.callback = callback;
+		entry.sql = sql;
+		entry.params.reserve(sizeof...(Args));
+		(entry.params.push_back(Parameter(args)), ...);
+		return *this;
+	}
+
+	inline size_t size() const { return entries_.size(); }
+
+	inline const Entry &at(size_t index) const { return entries_[index]; }
+
+	//index of the statement that failed in the last run, -1 if none did
+	inline int failed() const { return failed_; }
+
+	inline void setFailed(int index) { failed_ = index; }
+
+private:
+	std::vector<Entry> entries_;
+	int failed_;
+};	//Pipeline
+
 class SQLTemplate {
 public:
-	SQLTemplate(): preview_(false) {}
+	SQLTemplate(): preview_(false), mode_(EXEC_DEFAULT) {}
 
 	virtual ~SQLTemplate() {}
 
 	int execute(Callback *callback, const char *sql) {
-		return execSQL(callback, sql, NULL);
+		return execSQL(callback, sql, (const ParamList *) NULL);
 	}
 
-	template<typename Arg1>
-	int execute(Callback *callback, const char *sql, const Arg1 &a1) {
-		std::vector<Parameter> param;
-		param.push_back(Parameter(a1));
+	/*
+	 * sql with its ":N" placeholders bound to args, in order. The arguments
+	 * are referenced from an array on the stack, nothing is allocated.
+	 */
+	template<typename... Args>
+	int execute(Callback *callback, const char *sql, const Args &... args) {
+		const Parameter param[] = { Parameter(args)... };
+		ParamList list(param, sizeof...(Args));
 
-		return execSQL(callback, sql, &param);
+		return execSQL(callback, sql, &list);
 	}
 
-	template<typename Arg1, typename Arg2>
-	int execute(Callback *callback, const char *sql, const Arg1 &a1, const Arg2 &a2) {
-		std::vector<Parameter> param;
-		param.push_back(Parameter(a1));
-		param.push_back(Parameter(a2));
+	//execute() behind SQL_EXECUTE, Arity is placeholderArity() of the literal
+	template<int Arity, typename... Args>
+	int executeChecked(Callback *callback, const char *sql, const Args &... args) {
+		static_assert(Arity == (int) sizeof...(Args), "argument count does not match the placeholders of the statement");
+		return execute(callback, sql, args...);
+	}
 
-		return execSQL(callback, sql, &param);
+	/*
+	 * rows of sql mapped onto T (RowMapper.h): every row into a vector, the
+	 * first row into an optional, or the first cell into a scalar. A T
+	 * without columns() is a scalar read from the first column. out is only
+	 * assigned when 0 is returned, error details need a RowList/SingleRow.
+	 */
+	template<typename T, typename... Args>
+	int query(std::vector<T> &rows, const char *sql, const Args &... args) {
+		RowList<T> callback;
+		int err = execute(&callback, sql, args...);
+		if (err == 0)
+			rows.swap(callback.result_);
+		return err;
 	}
 
-	template<typename Arg1, typename Arg2, typename Arg3>
-	int execute(Callback *callback, const char *sql, const Arg1 &a1, const Arg2 &a2, const Arg3 &a3) {
-		std::vector<Parameter> param;
-		param.push_back(Parameter(a1));
-		param.push_back(Parameter(a2));
-		param.push_back(Parameter(a3));
+	template<typename T, typename... Args>
+	int query(std::optional<T> &row, const char *sql, const Args &... args) {
+		if constexpr (HasColumns<T>::value) {
+			SingleRow<T> callback;
+			int err = execute(&callback, sql, args...);
+			if (err == 0)
+				row = std::move(callback.result_);
+			return err;
+		} else {
+			std::optional<T> value;
+			int err = queryScalar(value, sql, args...);
+			if (err == 0)
+				row = std::move(value);
+			return err;
+		}
+	}
 
-		return execSQL(callback, sql, &param);
+	//select count(*) and the like, a missing row leaves value as it was
+	template<typename T, typename... Args>
+	std::enable_if_t<!HasColumns<T>::value, int> query(T &value, const char *sql, const Args &... args) {
+		return queryScalar(value, sql, args...);
 	}
 
-	template<typename Arg1, typename Arg2, typename Arg3, typename Arg4>
-	int execute(Callback *callback, const char *sql, const Arg1 &a1, const Arg2 &a2, const Arg3 &a3, const Arg4 &a4) {
-		std::vector<Parameter> param;
-		param.push_back(Parameter(a1));
-		param.push_back(Parameter(a2));
-		param.push_back(Parameter(a3));
-		param.push_back(Parameter(a4));
+	/*
+	 * multi-row INSERT/REPLACE. sql holds a single "VALUES (:1, :2, ...)" row
+	 * and rows is a container of std::tuple, one per row. The row is repeated
+	 * into as few statements as max_allowed_packet allows and each statement
+	 * is reported through Callback::onChunk.
+	 */
+	template<typename Container>
+	int executeBatch(Callback *callback, const char *sql, const Container &rows) {
+		std::vector<Parameter> values;
+		size_t columns = std::tuple_size<typename Container::value_type>::value;
+		values.reserve(rows.size() * columns);
+		for (typename Container::const_iterator it = rows.begin(); it != rows.end(); ++it) {
+			std::apply([&values](const auto &... v) { (values.push_back(Parameter(v)), ...); }, *it);
+		}
 
-		return execSQL(callback, sql, &param);
+		return execBatchSQL(callback, sql, values, columns);
 	}
 
-	template<typename Arg1, typename Arg2, typename Arg3, typename Arg4, typename Arg5>
-    int execute(Callback *callback, const char *sql, const Arg1 &a1, const Arg2 &a2, const Arg3 &a3, const Arg4 &a4, const Arg5 &a5) {
-		std::vector<Parameter> param;
-		param.push_back(Parameter(a1));
-		param.push_back(Parameter(a2));
-		param.push_back(Parameter(a3));
-		param.push_back(Parameter(a4));
-		param.push_back(Parameter(a5));
+	virtual int execSQL(Callback *callback, const char *sql, const ParamList *args) = 0;
 
-		return execSQL(callback, sql, &param);
+	int execSQL(Callback *callback, const char *sql, const std::vector<Parameter> *args) {
+		if (args == NULL)
+			return execSQL(callback, sql, (const ParamList *) NULL);
+		ParamList list(*args);
+		return execSQL(callback, sql, &list);
 	}
 
-	template<typename Arg1, typename Arg2, typename Arg3, typename Arg4, typename Arg5, typename Arg6>
-	int execute(Callback *callback, const char *sql, const Arg1 &a1, const Arg2 &a2, const Arg3 &a3, const Arg4 &a4, const Arg5 &a5, const Arg6 &a6) {
-		std::vector<Parameter> param;
-		param.push_back(Parameter(a1));
-		param.push_back(Parameter(a2));
-		param.push_back(Parameter(a3));
-		param.push_back(Parameter(a4));
-		param.push_back(Parameter(a5));
-		param.push_back(Parameter(a6));
-
-		return execSQL(callback, sql, &param);
-	}
+	virtual int execBatchSQL(Callback *callback, const char *sql, const std::vector<Parameter> &values, size_t columns) = 0;
 
-	template<typename Arg1, typename Arg2, typename Arg3, typename Arg4, typename Arg5, typename Arg6, typename Arg7>
-	int execute(Callback *callback, const char *sql, const Arg1 &a1, const Arg2 &a2, const Arg3 &a3, const Arg4 &a4, const Arg5 &a5, const Arg6 &a6, const Arg7 &a7) {
-		std::vector<Parameter> param;
-		param.push_back(Parameter(a1));
-		param.push_back(Parameter(a2));
-		param.push_back(Parameter(a3));
-		param.push_back(Parameter(a4));
-		param.push_back(Parameter(a5));
-		param.push_back(Parameter(a6));
-		param.push_back(Parameter(a7));
-
-		return execSQL(callback, sql, &param);
-	}
+	//first cell of the first row into cell, without a Callback
+	virtual int execScalar(ScalarCell &cell, const char *sql, const ParamList *args) = 0;
 
-	virtual int execSQL(Callback *callback, const char *sql, const std::vector<Parameter> *args) = 0;
+	/*
+	 * run every statement of pipeline, stopping at the first error. The
+	 * failing statement's callback gets the error, later ones are told they
+	 * did not run; pipeline.failed() holds the failing index.
+	 */
+	virtual int execPipeline(Pipeline &pipeline) = 0;
 
 	bool preview() { return preview_; }
 
 	void setPreview(bool yes) { preview_ = yes; }
 
+	ExecMode execMode() { return mode_; }
+
+	void setExecMode(ExecMode mode) { mode_ = mode; }
+
+	const StreamOptions &streamOptions() { return stream_; }
+
+	void setStreamOptions(const StreamOptions &options) { stream_ = options; }
+
 private:
+	template<typename T, typename... Args>
+	int queryScalar(T &value, const char *sql, const Args &... args) {
+		T read{};
+		ScalarCell cell(read);
+		int err;
+		if constexpr (sizeof...(Args) == 0) {
+			err = execScalar(cell, sql, NULL);
+		} else {
+			const Parameter param[] = { Parameter(args)... };
+			ParamList list(param, sizeof...(Args));
+			err = execScalar(cell, sql, &list);
+		}
+		if (err == 0 && cell.found())
+			value = std::move(read);
+		return err;
+	}
+
 	bool preview_;
+	ExecMode mode_;
+	StreamOptions stream_;
 };
 
 class MySQLTransaction;
 
 class MySQLTemplate: public SQLTemplate {
 public:
-	MySQLTemplate(const std::string &dbname): dbname_(dbname) {}
+	MySQLTemplate(const std::string &dbname): dbname_(dbname), source_(NULL), cache_(NULL), single_flight_(false) {}
+
+	//std::atomic is not copyable, the resolved handle is copied by hand
+	MySQLTemplate(const MySQLTemplate &other)
+	: SQLTemplate(other), dbname_(other.dbname_), source_(other.source_.load(std::memory_order_acquire)),
+	  cache_(other.cache_), policy_(other.policy_), single_flight_(other.single_flight_) {}
+
+	MySQLTemplate &operator =(const MySQLTemplate &other) {
+		if (this != &other) {
+			SQLTemplate::operator =(other);
+			dbname_ = other.dbname_;
+			source_.store(other.source_.load(std::memory_order_acquire), std::memory_order_release);
+			cache_ = other.cache_;
+			policy_ = other.policy_;
+			single_flight_ = other.single_flight_;
+		}
+		return *this;
+	}
 
 	virtual ~MySQLTemplate() {}
 
@@ -235,15 +438,63 @@ public:
      *
      * return: ok - 0, otherwise error
      */
-    int execSQL(Callback *callback, const char *sql, const std::vector<Parameter> *args);
+    using SQLTemplate::execSQL;
+
+    int execSQL(Callback *callback, const char *sql, const ParamList *args);
+
+	int execBatchSQL(Callback *callback, const char *sql, const std::vector<Parameter> &values, size_t columns);
+
+	int execScalar(ScalarCell &cell, const char *sql, const ParamList *args);
+
+	int execPipeline(Pipeline &pipeline);
+
+	/*
+	 * answer SELECTs from cache as policy allows, NULL turns it off. Writes
+	 * through this template and its transactions invalidate the tables they
+	 * touch. Results of cached reads are not previewed.
+	 */
+	void setQueryCache(QueryCache *cache, const CachePolicy &policy) {
+		cache_ = cache;
+		policy_ = policy;
+	}
+
+	inline QueryCache *queryCache() { return cache_; }
+
+	/*
+	 * share the result of a SELECT with every caller issuing the same
+	 * statement on this source while it runs, see SingleFlight.
+	 */
+	void setSingleFlight(bool yes) { single_flight_ = yes; }
+
+	bool singleFlight() { return single_flight_; }
+
+	//the source named dbname, looked up once it was added
+	Source *source();
+
+	/*
+	 * where tpl runs: SELECTs on a replica if dbname is a source group,
+	 * everything else on the primary. Reads that must see a write just
+	 * made, or lock rows, belong in a transaction.
+	 */
+	Source *sourceFor(const CompiledSQL &tpl);
 
 private:	
+	int execCached(Callback *callback, ScalarCell *cell, const char *sql, const ParamList *args);
+
+	void refreshLater(const std::string &key, const char *sql, const ParamList *args);
+
+	void invalidate(const char *sql);
+
 	std::string dbname_;
+	std::atomic<Source*> source_;
+	QueryCache *cache_;
+	CachePolicy policy_;
+	bool single_flight_;
 };	//MySQLTemplate
 
 class MySQLTransaction: public SQLTemplate {
 public:
-	explicit MySQLTransaction(Connection *conn): conn_(conn) {}
+	explicit MySQLTransaction(Connection *conn): conn_(conn), cache_(NULL) {}
 
 	virtual ~MySQLTransaction() {}
 
@@ -251,16 +502,42 @@ public:
 
 	bool begin();
 
-	int execSQL(Callback *callback, const char *sql, const std::vector<Parameter> *args);
+	using SQLTemplate::execSQL;
+
+	int execSQL(Callback *callback, const char *sql, const ParamList *args);
+
+	int execBatchSQL(Callback *callback, const char *sql, const std::vector<Parameter> &values, size_t columns);
+
+	int execScalar(ScalarCell &cell, const char *sql, const ParamList *args);
+
+	int execPipeline(Pipeline &pipeline);
+
+	//tables written in the transaction are invalidated in cache once it ends
+	void setQueryCache(QueryCache *cache, const CachePolicy &policy) {
+		cache_ = cache;
+		policy_ = policy;
+	}
 
 	bool commit();
 
 	void rollback();
 
 private:
+	void written(const char *sql);
+
 	Connection *conn_;
+	QueryCache *cache_;
+	CachePolicy policy_;
+	std::vector<std::string> written_;
 };	//MySQLTransaction
 
 }
 }
+/*
+ * tpl.execute(callback, sql, ...) for a string literal sql, failing to
+ * compile when the argument count does not match its placeholders.
+ */
+#define SQL_EXECUTE(tpl, callback, sql, ...) \
+	(tpl).executeChecked< ::server::mysqldb::placeholderArity(sql)>((callback), "" sql, ##__VA_ARGS__)
+
 #endif //__YY_MYSQLLIB_TEMPLATE_H__
@@ -0,0 +1,184 @@
+#include "ParallelExecutor.h"
+
+namespace server {
+namespace mysqldb {
+
+struct ParallelExecutor::Run {
+	MySQLTemplate *tpl;
+	QueryBatch *batch;
+	size_t next;		//first job not handed to a worker yet
+	size_t remaining;
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+};
+
+/* ParallelExecutor */
+ParallelExecutor::ParallelExecutor(unsigned int workers): next_worker_(0), pending_(0), stopping_(false) {
+	pthread_mutex_init(&idle_lock_, NULL);
+	pthread_cond_init(&idle_cond_, NULL);
+
+	if (workers == 0)
+		workers = 1;
+	for (unsigned int i = 0; i < workers; ++i) {
+		Worker *worker = new Worker;
+		worker->executor = this;
+		pthread_mutex_init(&worker->lock, NULL);
+		workers_.push_back(worker);
+	}
+	//start only once every deque exists, workers steal from all of them
+	for (unsigned int i = 0; i < workers; ++i) {
+		pthread_create(&workers_[i]->thread, NULL, loop, workers_[i]);
+	}
+}
+
+ParallelExecutor::~ParallelExecutor() {
+	pthread_mutex_lock(&idle_lock_);
+	stopping_ = true;
+	pthread_cond_broadcast(&idle_cond_);
+	pthread_mutex_unlock(&idle_lock_);
+
+	for (std::vector<Worker *>::iterator it = workers_.begin(); it != workers_.end(); ++it) {
+		pthread_join((*it)->thread, NULL);
+	}
+	for (std::vector<Worker *>::iterator it = workers_.begin(); it != workers_.end(); ++it) {
+		pthread_mutex_destroy(&(*it)->lock);
+		delete *it;
+	}
+	pthread_cond_destroy(&idle_cond_);
+	pthread_mutex_destroy(&idle_lock_);
+}
+
+int ParallelExecutor::run(MySQLTemplate &tpl, QueryBatch &batch, unsigned int concurrency) {
+	batch.reset();
+	if (batch.size() == 0)
+		return 0;
+	if (concurrency == 0)
+		concurrency = workers_.size();
+
+	Run run;
+	run.tpl = &tpl;
+	run.batch = &batch;
+	size_t first = (concurrency < batch.size()) ? concurrency : batch.size();
+	run.next = first;
+	run.remaining = batch.size();
+	pthread_mutex_init(&run.lock, NULL);
+	pthread_cond_init(&run.done, NULL);
+
+	//the rest is queued by the workers as jobs complete, keeping the cap
+	for (size_t i = 0; i < first; ++i) {
+		pthread_mutex_lock(&idle_lock_);
+		Worker *worker = workers_[next_worker_++ % workers_.size()];
+		pthread_mutex_unlock(&idle_lock_);
+
+		Task task = { &run, i };
+		push(worker, task);
+	}
+
+	pthread_mutex_lock(&run.lock);
+	while (run.remaining > 0)
+		pthread_cond_wait(&run.done, &run.lock);
+	pthread_mutex_unlock(&run.lock);
+	pthread_cond_destroy(&run.done);
+	pthread_mutex_destroy(&run.lock);
+
+	for (size_t i = 0; i < batch.size(); ++i) {
+		if (batch.result(i) != 0)
+			return batch.result(i);
+	}
+	return 0;
+}
+
+void *ParallelExecutor::loop(void *arg) {
+	Worker *worker = (Worker *) arg;
+	ParallelExecutor *executor = worker->executor;
+	Task task;
+
+	for (;;) {
+		if (executor->take(worker, &task)) {
+			executor->execute(worker, task);
+			continue;
+		}
+
+		pthread_mutex_lock(&executor->idle_lock_);
+		while (executor->pending_ <= 0 && !executor->stopping_)
+			pthread_cond_wait(&executor->idle_cond_, &executor->idle_lock_);
+		bool stop = executor->stopping_ && executor->pending_ <= 0;
+		pthread_mutex_unlock(&executor->idle_lock_);
+		if (stop)
+			break;
+	}
+	return NULL;
+}
+
+void ParallelExecutor::push(Worker *worker, const Task &task) {
+	pthread_mutex_lock(&worker->lock);
+	worker->tasks.push_back(task);
+	pthread_mutex_unlock(&worker->lock);
+
+	pthread_mutex_lock(&idle_lock_);
+	++pending_;
+	pthread_cond_signal(&idle_cond_);
+	pthread_mutex_unlock(&idle_lock_);
+}
+
+/*
+ * newest task of our own deque first, it was queued right after a job of
+ * the same batch finished here. Otherwise the oldest task of another worker.
+ */
+bool ParallelExecutor::take(Worker *worker, Task *task) {
+	bool found = false;
+
+	pthread_mutex_lock(&worker->lock);
+	if (!worker->tasks.empty()) {
+		*task = worker->tasks.back();
+		worker->tasks.pop_back();
+		found = true;
+	}
+	pthread_mutex_unlock(&worker->lock);
+
+	for (size_t i = 0; !found && i < workers_.size(); ++i) {
+		Worker *victim = workers_[i];
+		if (victim == worker)
+			continue;
+		pthread_mutex_lock(&victim->lock);
+		if (!victim->tasks.empty()) {
+			*task = victim->tasks.front();
+			victim->tasks.pop_front();
+			found = true;
+		}
+		pthread_mutex_unlock(&victim->lock);
+	}
+
+	if (found) {
+		pthread_mutex_lock(&idle_lock_);
+		--pending_;
+		pthread_mutex_unlock(&idle_lock_);
+	}
+	return found;
+}
+
+void ParallelExecutor::execute(Worker *worker, const Task &task) {
+	Run *run = task.run;
+	const QueryBatch::Job &job = run->batch->at(task.index);
+	SQLTemplate *tpl = job.tpl ? job.tpl : run->tpl;
+	int err = tpl->execSQL(job.callback, job.sql, job.params.empty() ? NULL : &job.params);
+	run->batch->setResult(task.index, err);
+
+	pthread_mutex_lock(&run->lock);
+	size_t next = run->next;
+	bool more = (next < run->batch->size());
+	if (more)
+		++run->next;
+	if (--run->remaining == 0)
+		pthread_cond_signal(&run->done);
+	pthread_mutex_unlock(&run->lock);
+
+	//run may be gone once unlocked, unless it still waits for the job we claimed
+	if (more) {
+		Task more = { run, next };
+		push(worker, more);
+	}
+}
+
+}	//mysqldb
+}	//server
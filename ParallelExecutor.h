@@ -0,0 +1,121 @@
+#ifndef MYSQLLIB_PARALLEL_EXECUTOR_H
+#define MYSQLLIB_PARALLEL_EXECUTOR_H
+
+#include "MySQLTemplate.h"
+#include <pthread.h>
+#include <deque>
+
+namespace server {
+namespace mysqldb {
+
+/*
+ * independent statements for ParallelExecutor::run, each with its own
+ * callback. Arguments are referenced, not copied, like Pipeline.
+ */
+class QueryBatch {
+public:
+	struct Job {
+		SQLTemplate *tpl;		//NULL: the one given to run
+		Callback *callback;
+		const char *sql;
+		std::vector<Parameter> params;
+	};
+
+	template<typename... Args>
+	QueryBatch &add(Callback *callback, const char *sql, const Args &... args) {
+		jobs_.push_back(Job());
+		Job &job = jobs_.back();
+		job.tpl = NULL;
+		job.callback = callback;
+		job.sql = sql;
+		job.params.reserve(sizeof...(Args));
+		(job.params.push_back(Parameter(args)), ...);
+		return *this;
+	}
+
+	//a job running through tpl instead
+	QueryBatch &addOn(SQLTemplate *tpl, Callback *callback, const char *sql, const ParamList *args) {
+		jobs_.push_back(Job());
+		Job &job = jobs_.back();
+		job.tpl = tpl;
+		job.callback = callback;
+		job.sql = sql;
+		if (args != NULL)
+			job.params.assign(args->data, args->data + args->size);
+		return *this;
+	}
+
+	inline size_t size() const { return jobs_.size(); }
+
+	inline const Job &at(size_t index) const { return jobs_[index]; }
+
+	//what execute() returned for job index in the last run
+	inline int result(size_t index) const { return results_[index]; }
+
+	inline void setResult(size_t index, int code) { results_[index] = code; }
+
+	inline void reset() { results_.assign(jobs_.size(), 0); }
+
+private:
+	std::vector<Job> jobs_;
+	std::vector<int> results_;
+};	//QueryBatch
+
+/*
+ * Fixed set of worker threads running the jobs of a QueryBatch side by side,
+ * each on its own pooled connection. Every worker keeps a deque of tasks and
+ * idle workers steal from the others, so one slow statement does not hold
+ * up the jobs queued behind it.
+ */
+class ParallelExecutor {
+public:
+	explicit ParallelExecutor(unsigned int workers = 4);
+
+	virtual ~ParallelExecutor();
+
+	/*
+	 * run every job of batch through tpl and return once all of them have
+	 * finished: 0, or the code of the first failed job. At most concurrency
+	 * jobs (0: one per worker) hold a connection at the same time. Callbacks
+	 * run on the workers, so run must not be called from one of them.
+	 */
+	int run(MySQLTemplate &tpl, QueryBatch &batch, unsigned int concurrency = 0);
+
+private:
+	struct Run;
+
+	struct Task {
+		Run *run;
+		size_t index;
+	};
+
+	struct Worker {
+		ParallelExecutor *executor;
+		pthread_t thread;
+		pthread_mutex_t lock;
+		std::deque<Task> tasks;
+	};
+
+	ParallelExecutor(const ParallelExecutor &);
+	ParallelExecutor &operator =(const ParallelExecutor &);
+
+	static void *loop(void *arg);
+
+	void push(Worker *worker, const Task &task);
+
+	bool take(Worker *worker, Task *task);
+
+	void execute(Worker *worker, const Task &task);
+
+	std::vector<Worker *> workers_;
+	unsigned int next_worker_;
+	int pending_;		//tasks queued on any worker
+	bool stopping_;
+	pthread_mutex_t idle_lock_;
+	pthread_cond_t idle_cond_;
+};	//ParallelExecutor
+
+}	//mysqldb
+}	//server
+
+#endif	//MYSQLLIB_PARALLEL_EXECUTOR_H
@@ -0,0 +1,81 @@
+#include "MySQLDriver.h"
+#include "CompiledSQL.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace server::mysqldb;
+
+/*
+ * Prepared statements against a live server, skipped unless
+ * MYSQL_TEST_HOST is set. MYSQL_TEST_USER, MYSQL_TEST_PASSWD,
+ * MYSQL_TEST_DB and MYSQL_TEST_PORT default to root, "", test and 3306.
+ */
+
+static int failures = 0;
+
+static const char *env(const char *name, const char *df) {
+    const char *value = getenv(name);
+    return value != NULL ? value : df;
+}
+
+static void expectRows(Connection &conn, unsigned int cache_size) {
+    conn.setStmtCacheSize(cache_size);
+    CompiledSQL tpl("select :1 union all select :2");
+    std::vector<Parameter> params;
+    params.push_back(Parameter(1));
+    params.push_back(Parameter(2));
+    ParamList both(params);
+    ParamList last(&params[1], 1);
+
+    try {
+        ResultSet first = conn.executePrepared(tpl, &both);
+        //a second statement must not close the first one's rows
+        CompiledSQL other("select :1");
+        ResultSet second = conn.executePrepared(other, &last);
+
+        long long sum = 0;
+        int rows = 0;
+        while (first.next()) {
+            sum += first.getInt(1);
+            ++rows;
+        }
+        if (rows != 2 || sum != 3) {
+            printf("FAIL stmt_cache_size=%u: %d rows summing to %lld, expected 2 and 3\n",
+                   cache_size, rows, sum);
+            ++failures;
+        }
+        if (!second.next() || second.getInt(1) != 2) {
+            printf("FAIL stmt_cache_size=%u: second statement lost its row\n", cache_size);
+            ++failures;
+        }
+    } catch (Exception &e) {
+        printf("FAIL stmt_cache_size=%u: %s\n", cache_size, e.what());
+        ++failures;
+    }
+}
+
+int
+main()
+{
+    const char *host = getenv("MYSQL_TEST_HOST");
+    if (host == NULL) {
+        printf("PreparedTest: skipped, MYSQL_TEST_HOST not set\n");
+        return 0;
+    }
+
+    Connection conn(env("MYSQL_TEST_USER", "root"), env("MYSQL_TEST_PASSWD", ""),
+                    env("MYSQL_TEST_DB", "test"), host, atoi(env("MYSQL_TEST_PORT", "3306")));
+    try {
+        conn.connect();
+    } catch (Exception &e) {
+        printf("FAIL connect: %s\n", e.what());
+        return 1;
+    }
+
+    expectRows(conn, 64);
+    expectRows(conn, 0);
+
+    if (failures == 0)
+        printf("PreparedTest: all passed\n");
+    return failures == 0 ? 0 : 1;
+}
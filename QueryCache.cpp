@@ -0,0 +1,323 @@
+#include "QueryCache.h"
+#include <time.h>
+#include <algorithm>
+
+namespace server {
+namespace mysqldb {
+
+static uint64_t nowMs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+template<typename T>
+static void appendRaw(std::string &out, const T &value) {
+	out.append((const char *) &value, sizeof(value));
+}
+
+static void appendBytes(std::string &out, const char *data, size_t size) {
+	appendRaw(out, (uint64_t) size);
+	out.append(data, size);
+}
+
+/* QueryCache */
+QueryCache::QueryCache(size_t max_bytes, unsigned int shards)
+: stopping_(false), hits_(0), stale_hits_(0), misses_(0), evictions_(0), invalidations_(0), refreshes_(0) {
+	if (shards == 0)
+		shards = 1;
+	shard_bytes_ = max_bytes / shards;
+	for (unsigned int i = 0; i < shards; ++i) {
+		Shard *shard = new Shard;
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->bytes = 0;
+		shards_.push_back(shard);
+	}
+
+	pthread_mutex_init(&tags_lock_, NULL);
+	pthread_mutex_init(&jobs_lock_, NULL);
+	pthread_cond_init(&jobs_cond_, NULL);
+	pthread_create(&thread_, NULL, run, this);
+}
+
+QueryCache::~QueryCache() {
+	pthread_mutex_lock(&jobs_lock_);
+	stopping_ = true;
+	pthread_cond_signal(&jobs_cond_);
+	pthread_mutex_unlock(&jobs_lock_);
+	pthread_join(thread_, NULL);
+	pthread_cond_destroy(&jobs_cond_);
+	pthread_mutex_destroy(&jobs_lock_);
+
+	for (std::vector<Shard *>::iterator it = shards_.begin(); it != shards_.end(); ++it) {
+		pthread_mutex_destroy(&(*it)->lock);
+		delete *it;
+	}
+	for (std::map<std::string, Tag *>::iterator it = tags_.begin(); it != tags_.end(); ++it) {
+		delete it->second;
+	}
+	pthread_mutex_destroy(&tags_lock_);
+}
+
+/*
+ * the values are encoded with their type instead of rendered, rendering
+ * needs a connection for escaping. Equal keys still mean equal text.
+ */
+std::string QueryCache::key(const std::string &dbname, const char *sql, const ParamList *args) {
+	std::string out;
+	size_t length = strlen(sql);
+	out.reserve(dbname.size() + length + 16 + (args ? args->size * 16 : 0));
+	appendBytes(out, dbname.data(), dbname.size());
+	appendBytes(out, sql, length);
+	if (args == NULL)
+		return out;
+
+	for (size_t i = 0; i < args->size; ++i) {
+		const Parameter &p = (*args)[i];
+		out.push_back((char) p.type);
+		switch (p.type) {
+			case Parameter::INTEGER:
+				appendRaw(out, p.data.integer);
+				break;
+			case Parameter::UINT64:
+				appendRaw(out, p.data.uinteger);
+				break;
+			case Parameter::DOUBLE:
+				appendRaw(out, p.data.real);
+				break;
+			case Parameter::STRING:
+				if (p.data.string == NULL)
+					out.push_back('\0');
+				else
+					appendBytes(out, p.data.string, strlen(p.data.string));
+				break;
+			case Parameter::BLOB:
+				appendBytes(out, p.data.blob->data(), p.data.blob->size());
+				break;
+			case Parameter::STRING_VIEW:
+				appendBytes(out, p.data.view.data, p.data.view.size);
+				break;
+			case Parameter::INT_VECTOR:
+				appendBytes(out, (const char *) p.data.int_vec->data(), p.data.int_vec->size() * sizeof(int64_t));
+				break;
+			case Parameter::STRING_VECTOR:
+				appendRaw(out, (uint64_t) p.data.str_vec->size());
+				for (size_t k = 0; k < p.data.str_vec->size(); ++k)
+					appendBytes(out, (*p.data.str_vec)[k].data(), (*p.data.str_vec)[k].size());
+				break;
+			case Parameter::DATETIME:
+				{
+					const MYSQL_TIME &t = *p.data.time;
+					uint32_t parts[] = { t.year, t.month, t.day, t.hour, t.minute, t.second,
+					                     (uint32_t) t.second_part, (uint32_t) t.neg, (uint32_t) t.time_type };
+					out.append((const char *) parts, sizeof(parts));
+				}
+				break;
+			default:
+				break;
+		}
+	}
+	return out;
+}
+
+QueryCache::Shard &QueryCache::shardOf(const std::string &key) {
+	return *shards_[std::hash<std::string>()(key) % shards_.size()];
+}
+
+bool QueryCache::current(const TagVersions &versions) {
+	for (TagVersions::const_iterator it = versions.begin(); it != versions.end(); ++it) {
+		if (it->first->load(std::memory_order_acquire) != it->second)
+			return false;
+	}
+	return true;
+}
+
+void QueryCache::erase(Shard &shard, LRU::iterator it) {
+	shard.bytes -= it->bytes;
+	shard.index.erase(std::string_view(it->key));
+	shard.lru.erase(it);
+}
+
+ResultSnapshotPtr QueryCache::get(const std::string &key, bool *refresh) {
+	Shard &shard = shardOf(key);
+	ResultSnapshotPtr result;
+	*refresh = false;
+
+	pthread_mutex_lock(&shard.lock);
+	std::unordered_map<std::string_view, LRU::iterator>::iterator found = shard.index.find(std::string_view(key));
+	if (found != shard.index.end()) {
+		LRU::iterator it = found->second;
+		uint64_t now = nowMs();
+		if (now >= it->stale_until || !current(it->versions)) {
+			erase(shard, it);
+		} else {
+			shard.lru.splice(shard.lru.begin(), shard.lru, it);
+			result = it->result;
+			if (now < it->expires) {
+				++hits_;
+			} else {
+				++stale_hits_;
+				if (!it->refreshing) {
+					it->refreshing = true;
+					*refresh = true;
+					++refreshes_;
+				}
+			}
+		}
+	}
+	pthread_mutex_unlock(&shard.lock);
+
+	if (result.get() == NULL)
+		++misses_;
+	return result;
+}
+
+QueryCache::TagVersions QueryCache::watch(const std::vector<std::string> &tags) {
+	uint64_t quiet_ms;
+	return watch(tags, &quiet_ms);
+}
+
+QueryCache::TagVersions QueryCache::watch(const std::vector<std::string> &tags, uint64_t *quiet_ms) {
+	TagVersions versions;
+	versions.reserve(tags.size());
+	uint64_t changed_at = 0;
+
+	pthread_mutex_lock(&tags_lock_);
+	for (std::vector<std::string>::const_iterator it = tags.begin(); it != tags.end(); ++it) {
+		Tag *&tag = tags_[*it];
+		if (tag == NULL)
+			tag = new Tag;
+		versions.push_back(std::make_pair(&tag->version, tag->version.load(std::memory_order_acquire)));
+		changed_at = std::max(changed_at, tag->changed_at);
+	}
+	pthread_mutex_unlock(&tags_lock_);
+	*quiet_ms = (changed_at == 0) ? UINT64_MAX : nowMs() - changed_at;
+	return versions;
+}
+
+void QueryCache::put(const std::string &key, ResultSnapshotPtr result, const CachePolicy &policy, const TagVersions &versions) {
+	size_t bytes = result->bytes() + sizeof(Entry) + key.size() * 2 + versions.size() * 16;
+	Shard &shard = shardOf(key);
+
+	pthread_mutex_lock(&shard.lock);
+	std::unordered_map<std::string_view, LRU::iterator>::iterator found = shard.index.find(std::string_view(key));
+	if (found != shard.index.end())
+		erase(shard, found->second);
+
+	//checked under the shard lock, so a racing invalidate() is not missed
+	if (bytes <= shard_bytes_ && current(versions)) {
+		uint64_t now = nowMs();
+		shard.lru.push_front(Entry());
+		Entry &entry = shard.lru.front();
+		entry.key = key;
+		entry.result = result;
+		entry.expires = now + policy.ttl_ms;
+		entry.stale_until = entry.expires + policy.stale_ms;
+		entry.versions = versions;
+		entry.bytes = bytes;
+		entry.refreshing = false;
+		shard.index[std::string_view(entry.key)] = shard.lru.begin();
+		shard.bytes += bytes;
+
+		while (shard.bytes > shard_bytes_) {
+			erase(shard, --shard.lru.end());
+			++evictions_;
+		}
+	}
+	pthread_mutex_unlock(&shard.lock);
+}
+
+void QueryCache::abandon(const std::string &key) {
+	Shard &shard = shardOf(key);
+
+	pthread_mutex_lock(&shard.lock);
+	std::unordered_map<std::string_view, LRU::iterator>::iterator found = shard.index.find(std::string_view(key));
+	if (found != shard.index.end())
+		found->second->refreshing = false;
+	pthread_mutex_unlock(&shard.lock);
+}
+
+void QueryCache::invalidate(const std::string &tag) {
+	pthread_mutex_lock(&tags_lock_);
+	//kept for a tag nobody watched yet too, reads after the write may need its time
+	Tag *&entry = tags_[tag];
+	if (entry == NULL)
+		entry = new Tag;
+	//entries holding the old version are dropped when next looked up
+	entry->version.fetch_add(1, std::memory_order_acq_rel);
+	entry->changed_at = nowMs();
+	++invalidations_;
+	pthread_mutex_unlock(&tags_lock_);
+}
+
+void QueryCache::invalidate(const std::vector<std::string> &tags) {
+	for (std::vector<std::string>::const_iterator it = tags.begin(); it != tags.end(); ++it) {
+		invalidate(*it);
+	}
+}
+
+void QueryCache::clear() {
+	for (std::vector<Shard *>::iterator it = shards_.begin(); it != shards_.end(); ++it) {
+		pthread_mutex_lock(&(*it)->lock);
+		(*it)->index.clear();
+		(*it)->lru.clear();
+		(*it)->bytes = 0;
+		pthread_mutex_unlock(&(*it)->lock);
+	}
+}
+
+QueryCache::Stats QueryCache::stats() {
+	Stats stats;
+	stats.hits = hits_;
+	stats.stale_hits = stale_hits_;
+	stats.misses = misses_;
+	stats.evictions = evictions_;
+	stats.invalidations = invalidations_;
+	stats.refreshes = refreshes_;
+	stats.bytes = 0;
+	stats.entries = 0;
+	for (std::vector<Shard *>::iterator it = shards_.begin(); it != shards_.end(); ++it) {
+		pthread_mutex_lock(&(*it)->lock);
+		stats.bytes += (*it)->bytes;
+		stats.entries += (*it)->index.size();
+		pthread_mutex_unlock(&(*it)->lock);
+	}
+	return stats;
+}
+
+void QueryCache::schedule(const std::function<void()> &job) {
+	pthread_mutex_lock(&jobs_lock_);
+	jobs_.push_back(job);
+	pthread_cond_signal(&jobs_cond_);
+	pthread_mutex_unlock(&jobs_lock_);
+}
+
+void *QueryCache::run(void *arg) {
+	QueryCache *cache = (QueryCache *) arg;
+#ifdef LINUX
+	mysql_thread_init();
+#endif
+
+	for (;;) {
+		pthread_mutex_lock(&cache->jobs_lock_);
+		while (cache->jobs_.empty() && !cache->stopping_)
+			pthread_cond_wait(&cache->jobs_cond_, &cache->jobs_lock_);
+		if (cache->stopping_) {
+			pthread_mutex_unlock(&cache->jobs_lock_);
+			break;
+		}
+		std::function<void()> job = cache->jobs_.front();
+		cache->jobs_.pop_front();
+		pthread_mutex_unlock(&cache->jobs_lock_);
+
+		job();
+	}
+
+#ifdef LINUX
+	mysql_thread_end();
+#endif
+	return NULL;
+}
+
+}	//mysqldb
+}	//server
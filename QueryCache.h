@@ -0,0 +1,149 @@
+#ifndef MYSQLLIB_QUERY_CACHE_H
+#define MYSQLLIB_QUERY_CACHE_H
+
+#include "MySQLDriver.h"
+#include <pthread.h>
+#include <atomic>
+#include <functional>
+#include <unordered_map>
+
+namespace server {
+namespace mysqldb {
+
+/* which reads of a MySQLTemplate are cached, and for how long */
+struct CachePolicy {
+	CachePolicy(): ttl_ms(0), stale_ms(0) {}
+
+	CachePolicy(unsigned int ttl, unsigned int stale = 0): ttl_ms(ttl), stale_ms(stale) {}
+
+	unsigned int ttl_ms;		//results are served this long, 0 caches nothing
+	unsigned int stale_ms;		//then this long more while one refresh runs in the background
+	std::vector<std::string> tags;	//tables the results depend on, empty: those the statement reads
+};
+
+/*
+ * In-process cache of SELECT results in front of MySQLTemplate. Entries are
+ * spread over shards by key, each shard with its own lock and LRU list, and
+ * the whole cache is bounded by bytes.
+ *
+ * Every entry remembers the version of its tags when its statement started.
+ * invalidate() moves a tag on, so entries filled before a write are never
+ * served after it, even when their statement finished afterwards. That
+ * holds for a statement that saw the write: a read filling the cache from a
+ * replica must not start within the replica's lag of the write, watch()
+ * tells how long ago that was.
+ */
+class QueryCache {
+public:
+	struct Stats {
+		uint64_t hits;
+		uint64_t stale_hits;	//served past the ttl while refreshing
+		uint64_t misses;
+		uint64_t evictions;
+		uint64_t invalidations;
+		uint64_t refreshes;
+		size_t bytes;
+		size_t entries;
+	};
+
+	typedef std::vector<std::pair<const std::atomic<uint64_t> *, uint64_t> > TagVersions;
+
+	explicit QueryCache(size_t max_bytes = 64 << 20, unsigned int shards = 16);
+
+	virtual ~QueryCache();
+
+	//key of sql on source dbname bound to args, the same for the same rendered text
+	static std::string key(const std::string &dbname, const char *sql, const ParamList *args);
+
+	/*
+	 * result cached under key, empty if there is none. *refresh is set when
+	 * it is past its ttl and the caller should refresh it, until put() or
+	 * abandon() nobody else is asked to.
+	 */
+	ResultSnapshotPtr get(const std::string &key, bool *refresh);
+
+	//current versions of tags, taken before the statement runs
+	TagVersions watch(const std::vector<std::string> &tags);
+
+	//the same, *quiet_ms set to how long ago one of tags was last invalidated, UINT64_MAX for never
+	TagVersions watch(const std::vector<std::string> &tags, uint64_t *quiet_ms);
+
+	//result of a statement started at versions, dropped if a tag moved on since
+	void put(const std::string &key, ResultSnapshotPtr result, const CachePolicy &policy, const TagVersions &versions);
+
+	//a refresh asked for by get() failed, let the next reader try
+	void abandon(const std::string &key);
+
+	void invalidate(const std::string &tag);
+
+	void invalidate(const std::vector<std::string> &tags);
+
+	void clear();
+
+	Stats stats();
+
+	//run job on the refresh thread
+	void schedule(const std::function<void()> &job);
+
+private:
+	struct Entry {
+		std::string key;
+		ResultSnapshotPtr result;
+		uint64_t expires;
+		uint64_t stale_until;
+		TagVersions versions;
+		size_t bytes;
+		bool refreshing;
+	};
+
+	typedef std::list<Entry> LRU;
+
+	struct Tag {
+		Tag(): version(0), changed_at(0) {}
+
+		std::atomic<uint64_t> version;
+		uint64_t changed_at;		//ms, under tags_lock_
+	};
+
+	struct Shard {
+		pthread_mutex_t lock;
+		LRU lru;		//most recently used first
+		std::unordered_map<std::string_view, LRU::iterator> index;	//keys point into lru
+		size_t bytes;
+	};
+
+	QueryCache(const QueryCache &);
+	QueryCache &operator =(const QueryCache &);
+
+	static void *run(void *arg);
+
+	static bool current(const TagVersions &versions);
+
+	Shard &shardOf(const std::string &key);
+
+	void erase(Shard &shard, LRU::iterator it);
+
+	std::vector<Shard *> shards_;
+	size_t shard_bytes_;
+
+	pthread_mutex_t tags_lock_;
+	std::map<std::string, Tag *> tags_;	//never shrinks, entries point into it
+
+	pthread_t thread_;
+	pthread_mutex_t jobs_lock_;
+	pthread_cond_t jobs_cond_;
+	std::deque<std::function<void()> > jobs_;
+	bool stopping_;
+
+	std::atomic<uint64_t> hits_;
+	std::atomic<uint64_t> stale_hits_;
+	std::atomic<uint64_t> misses_;
+	std::atomic<uint64_t> evictions_;
+	std::atomic<uint64_t> invalidations_;
+	std::atomic<uint64_t> refreshes_;
+};	//QueryCache
+
+}	//mysqldb
+}	//server
+
+#endif	//MYSQLLIB_QUERY_CACHE_H
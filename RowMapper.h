@@ -0,0 +1,158 @@
+#ifndef MYSQLLIB_ROW_MAPPER_H
+#define MYSQLLIB_ROW_MAPPER_H
+
+#include "MySQLDriver.h"
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace server {
+namespace mysqldb {
+
+/*
+ * Declarative mapping of result rows onto a user struct, for
+ * SQLTemplate::query. The struct lists its columns once:
+ *
+ *	struct Emp {
+ *		int id;
+ *		std::string name;
+ *
+ *		static auto columns() {
+ *			return std::make_tuple(mapColumn("id", &Emp::id), mapColumn("name", &Emp::name));
+ *		}
+ *	};
+ *
+ * Names are resolved once per result, each row is then read by index
+ * straight from the column data, without intermediate strings.
+ */
+template<typename T, typename M>
+struct ColumnMapping {
+	const char *name;
+	M T::*member;
+};
+
+template<typename T, typename M>
+inline ColumnMapping<T, M> mapColumn(const char *name, M T::*member) {
+	return ColumnMapping<T, M>{ name, member };
+}
+
+template<typename T, typename = void>
+struct HasColumns : std::false_type {};
+
+template<typename T>
+struct HasColumns<T, std::void_t<decltype(T::columns())> > : std::true_type {};
+
+template<typename T>
+struct UnmappedField : std::false_type {};
+
+/*
+ * one cell into a field. NULL reads as 0, an empty string or a zeroed
+ * MYSQL_TIME, std::optional fields tell it apart.
+ */
+template<typename T>
+inline void readField(const ResultSet &result, ColumnHandle column, T &out) {
+	if constexpr (std::is_same_v<T, bool>) {
+		out = (result.getInt(column) != 0);
+	} else if constexpr (std::is_integral_v<T> && std::is_unsigned_v<T> && sizeof(T) == sizeof(uint64_t)) {
+		//past the range of getInt
+		out = result.get(column).to<T>(0);
+	} else if constexpr (std::is_integral_v<T> || std::is_enum_v<T>) {
+		out = (T) result.getInt(column);
+	} else if constexpr (std::is_floating_point_v<T>) {
+		out = (T) result.getDouble(column);
+	} else if constexpr (std::is_same_v<T, std::string>) {
+		std::string_view v = result.get(column).view();
+		out.assign(v.data(), v.size());
+	} else if constexpr (std::is_same_v<T, MYSQL_TIME>) {
+		if (!result.getTime(column, &out))
+			memset(&out, 0, sizeof(out));
+	} else {
+		static_assert(UnmappedField<T>::value, "no column conversion for this field type");
+	}
+}
+
+template<typename T>
+inline void readField(const ResultSet &result, ColumnHandle column, std::optional<T> &out) {
+	if (result.isNull(column)) {
+		out.reset();
+	} else {
+		readField(result, column, out.emplace());
+	}
+}
+
+/* reads rows of one result into T, the columns of T resolved up front */
+template<typename T, bool Mapped = HasColumns<T>::value>
+class RowReader {
+public:
+	//throws for a column name the result does not have
+	explicit RowReader(const ResultSet &result): mappings_(T::columns()) {
+		resolve(result, std::make_index_sequence<COLUMNS>());
+	}
+
+	inline void read(const ResultSet &result, T &row) const {
+		read(result, row, std::make_index_sequence<COLUMNS>());
+	}
+
+private:
+	typedef decltype(T::columns()) Mappings;
+
+	static const size_t COLUMNS = std::tuple_size<Mappings>::value;
+
+	template<size_t... I>
+	void resolve(const ResultSet &result, std::index_sequence<I...>) {
+		((handles_[I] = result.handle(std::get<I>(mappings_).name)), ...);
+	}
+
+	template<size_t... I>
+	void read(const ResultSet &result, T &row, std::index_sequence<I...>) const {
+		(readField(result, handles_[I], row.*(std::get<I>(mappings_).member)), ...);
+	}
+
+	Mappings mappings_;
+	ColumnHandle handles_[COLUMNS > 0 ? COLUMNS : 1];
+};	//RowReader
+
+//a T without columns() is a scalar, read from the first column
+template<typename T>
+class RowReader<T, false> {
+public:
+	explicit RowReader(const ResultSet &result) {}
+
+	inline void read(const ResultSet &result, T &value) const {
+		readField(result, ColumnHandle(1), value);
+	}
+};	//RowReader
+
+/*
+ * where a scalar query puts its first cell. Read through a plain function
+ * pointer by the executor, no Callback is involved.
+ */
+class ScalarCell {
+public:
+	template<typename T>
+	explicit ScalarCell(T &value): value_(&value), read_(&readInto<T>), found_(false) {}
+
+	inline void read(const ResultSet &result) {
+		read_(result, value_);
+		found_ = true;
+	}
+
+	//false if the statement returned no row
+	inline bool found() const { return found_; }
+
+private:
+	template<typename T>
+	static void readInto(const ResultSet &result, void *value) {
+		readField(result, ColumnHandle(1), *(T *) value);
+	}
+
+	void *value_;
+	void (*read_)(const ResultSet &result, void *value);
+	bool found_;
+};	//ScalarCell
+
+}	//mysqldb
+}	//server
+
+#endif	//MYSQLLIB_ROW_MAPPER_H
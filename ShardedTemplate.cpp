@@ -0,0 +1,479 @@
+#include "ShardedTemplate.h"
+#include "ColumnarResult.h"
+#include <algorithm>
+
+namespace server {
+namespace mysqldb {
+
+//splitmix64 finalizer, spreads consecutive ids over the buckets
+static uint64_t mix(uint64_t x) {
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+//FNV-1a, unlike std::hash the same everywhere
+static uint64_t fnv(const char *data, size_t size) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < size; ++i) {
+		h ^= (unsigned char) data[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+/* ShardMap */
+ShardMap::ShardMap(const std::vector<std::string> &sources, unsigned int buckets): sources_(sources) {
+	if (buckets == 0)
+		buckets = 1;
+	table_.resize(buckets);
+	for (unsigned int i = 0; i < buckets; ++i)
+		table_[i] = sources_.empty() ? 0 : i % sources_.size();
+}
+
+ShardMap::ShardMap(const std::vector<std::string> &sources, const std::vector<int64_t> &bounds)
+: sources_(sources), bounds_(bounds) {
+	if (bounds_.empty())
+		bounds_.push_back(INT64_MIN);
+	table_.resize(bounds_.size());
+	for (size_t i = 0; i < table_.size(); ++i)
+		table_[i] = sources_.empty() ? 0 : i % sources_.size();
+}
+
+void ShardMap::assign(unsigned int bucket, size_t shard) {
+	if (bucket < table_.size() && shard < sources_.size())
+		table_[bucket] = shard;
+}
+
+unsigned int ShardMap::bucketOf(const Parameter &key) const {
+	if (!bounds_.empty() && (key.type == Parameter::INTEGER || key.type == Parameter::UINT64)) {
+		int64_t value = key.data.integer;
+		if (key.type == Parameter::UINT64 && key.data.uinteger > (uint64_t) INT64_MAX)
+			value = INT64_MAX;
+		std::vector<int64_t>::const_iterator it = std::upper_bound(bounds_.begin(), bounds_.end(), value);
+		return (it == bounds_.begin()) ? 0 : (unsigned int) (it - bounds_.begin() - 1);
+	}
+
+	uint64_t h = 0;
+	switch (key.type) {
+		case Parameter::INTEGER:
+		case Parameter::UINT64:
+			h = mix(key.data.uinteger);
+			break;
+		case Parameter::DOUBLE:
+			{
+				uint64_t bits;
+				memcpy(&bits, &key.data.real, sizeof(bits));
+				h = mix(bits);
+			}
+			break;
+		case Parameter::STRING:
+			h = key.data.string ? fnv(key.data.string, strlen(key.data.string)) : 0;
+			break;
+		case Parameter::STRING_VIEW:
+			h = fnv(key.data.view.data, key.data.view.size);
+			break;
+		case Parameter::BLOB:
+			h = fnv(key.data.blob->data(), key.data.blob->size());
+			break;
+		default:
+			break;
+	}
+	return (unsigned int) (h % table_.size());
+}
+
+/* what one shard returned */
+struct ShardResult : public Callback {
+	ShardResult(): error_(0) {}
+
+	virtual void onResult(ResultSet &result) {
+		snapshot_.reset(new ResultSnapshot(result));
+	}
+
+	virtual void onException(const Exception &ex) {
+		error_ = ex.code();
+		errorMsg_ = ex.what();
+	}
+
+	ResultSnapshotPtr snapshot_;
+	int error_;
+	std::string errorMsg_;
+};
+
+/* a cell of a merged row, in a shard's snapshot or in a folded group */
+struct Cell {
+	const char *data;		//NULL for NULL
+	unsigned long size;
+};
+
+/* how the cells of a column compare and add */
+enum Arithmetic {
+	TEXT	= 0,
+	FLOAT	= 1,		//FLOAT and DOUBLE
+	EXACT	= 2,		//integers and DECIMAL, SUM() of integers is a DECIMAL
+};
+
+static Arithmetic arithmeticOf(const MYSQL_FIELD &field) {
+	if (field.type == MYSQL_TYPE_DECIMAL || field.type == MYSQL_TYPE_NEWDECIMAL)
+		return EXACT;
+	switch (ColumnVector::kindOf(field)) {
+		case ColumnVector::KIND_INT:
+		case ColumnVector::KIND_UINT:
+			return EXACT;
+		case ColumnVector::KIND_DOUBLE:
+			return FLOAT;
+		default:
+			return TEXT;
+	}
+}
+
+/* a decimal as MySQL prints it, [-]digits[.digits] */
+struct Decimal {
+	bool negative;
+	std::string digits;		//integer and fraction digits, without leading zeros of the integer part
+	size_t scale;			//how many of them are the fraction
+};
+
+static bool parseDecimal(const Cell &cell, Decimal *out) {
+	const char *p = cell.data, *end = cell.data + cell.size;
+	out->negative = (p < end && *p == '-');
+	if (p < end && (*p == '-' || *p == '+'))
+		++p;
+	while (p + 1 < end && *p == '0' && p[1] != '.')
+		++p;
+	out->digits.clear();
+	out->scale = 0;
+	bool point = false;
+	for (; p < end; ++p) {
+		if (*p == '.' && !point) {
+			point = true;
+		} else if (*p >= '0' && *p <= '9') {
+			out->digits.push_back(*p);
+			if (point)
+				++out->scale;
+		} else {
+			return false;
+		}
+	}
+	return !out->digits.empty();
+}
+
+//both to the same scale and number of digits, so their digits compare as text
+static void align(Decimal &a, Decimal &b) {
+	size_t scale = std::max(a.scale, b.scale);
+	a.digits.append(scale - a.scale, '0');
+	b.digits.append(scale - b.scale, '0');
+	a.scale = b.scale = scale;
+	size_t width = std::max(a.digits.size(), b.digits.size());
+	a.digits.insert(0, width - a.digits.size(), '0');
+	b.digits.insert(0, width - b.digits.size(), '0');
+}
+
+static int compareDecimal(Decimal a, Decimal b) {
+	align(a, b);
+	bool zero_a = a.digits.find_first_not_of('0') == std::string::npos;
+	bool zero_b = b.digits.find_first_not_of('0') == std::string::npos;
+	bool neg_a = a.negative && !zero_a, neg_b = b.negative && !zero_b;
+	if (neg_a != neg_b)
+		return neg_a ? -1 : 1;
+	int c = a.digits.compare(b.digits);
+	c = (c > 0) - (c < 0);
+	return neg_a ? -c : c;
+}
+
+//a + b exactly, at the larger scale of the two
+static std::string addDecimal(Decimal a, Decimal b) {
+	align(a, b);
+	std::string digits(a.digits.size() + 1, '0');
+	bool negative = a.negative;
+	if (a.negative == b.negative) {
+		int carry = 0;
+		for (size_t i = a.digits.size(); i > 0; --i) {
+			int d = (a.digits[i - 1] - '0') + (b.digits[i - 1] - '0') + carry;
+			digits[i] = '0' + d % 10;
+			carry = d / 10;
+		}
+		digits[0] = '0' + carry;
+	} else {
+		//the larger magnitude minus the smaller, with its sign
+		if (a.digits < b.digits) {
+			std::swap(a, b);
+			negative = a.negative;
+		}
+		int borrow = 0;
+		for (size_t i = a.digits.size(); i > 0; --i) {
+			int d = (a.digits[i - 1] - '0') - (b.digits[i - 1] - '0') - borrow;
+			borrow = (d < 0);
+			digits[i] = '0' + (d < 0 ? d + 10 : d);
+		}
+	}
+
+	size_t integer = digits.size() - a.scale;
+	size_t first = digits.find_first_not_of('0');
+	if (first == std::string::npos)
+		negative = false;
+	first = std::min(first, integer - 1);
+	std::string out = negative ? "-" : "";
+	out.append(digits, first, integer - first);
+	if (a.scale > 0) {
+		out.push_back('.');
+		out.append(digits, integer, a.scale);
+	}
+	return out;
+}
+
+//NULL first as in ascending MySQL order, text byte by byte
+static int compareCells(const Cell &a, const Cell &b, Arithmetic arithmetic) {
+	if (a.data == NULL || b.data == NULL)
+		return (a.data != NULL) - (b.data != NULL);
+	if (arithmetic == EXACT) {
+		Decimal x, y;
+		if (parseDecimal(a, &x) && parseDecimal(b, &y))
+			return compareDecimal(x, y);
+	}
+	if (arithmetic != TEXT) {
+		long double x = strtold(a.data, NULL);
+		long double y = strtold(b.data, NULL);
+		return (x > y) - (x < y);
+	}
+	int c = memcmp(a.data, b.data, std::min(a.size, b.size));
+	return c ? c : (a.size > b.size) - (a.size < b.size);
+}
+
+class Merger {
+public:
+	Merger(const ResultSnapshot &layout, const ShardMerge &merge): layout_(layout), merge_(merge) {
+		MYSQL_FIELD *fields = layout.fields();
+		for (uint32_t i = 0; i < layout.columns(); ++i)
+			arithmetic_.push_back(fields != NULL ? arithmeticOf(fields[i]) : TEXT);
+	}
+
+	void add(const ResultSnapshot &part) {
+		parts_.push_back(&part);
+	}
+
+	ResultSnapshotPtr result(uint32_t affected_rows) {
+		aggregated() ? fold() : interleave();
+		if (merge_.limit > 0 && rows_.size() > merge_.limit)
+			rows_.resize(merge_.limit);
+
+		std::vector<const char *> cells;
+		std::vector<unsigned long> lengths;
+		cells.reserve(rows_.size() * layout_.columns());
+		lengths.reserve(rows_.size() * layout_.columns());
+		for (size_t r = 0; r < rows_.size(); ++r) {
+			for (uint32_t i = 0; i < layout_.columns(); ++i) {
+				cells.push_back(rows_[r][i].data);
+				lengths.push_back(rows_[r][i].size);
+			}
+		}
+		return ResultSnapshotPtr(new ResultSnapshot(layout_, cells, lengths, affected_rows));
+	}
+
+private:
+	typedef std::vector<Cell> Row;
+
+	bool aggregated() const {
+		for (size_t i = 0; i < merge_.aggregates.size(); ++i) {
+			if (merge_.aggregates[i] != ShardMerge::NONE)
+				return true;
+		}
+		return false;
+	}
+
+	ShardMerge::Aggregate aggregateOf(uint32_t column) const {
+		return column < merge_.aggregates.size() ? merge_.aggregates[column] : ShardMerge::NONE;
+	}
+
+	//row index of part into row, sized columns() already
+	void fill(Row &row, const ResultSnapshot &part, size_t index) const {
+		MYSQL_ROW cells = part.row(index);
+		unsigned long *lengths = part.lengths(index);
+		for (uint32_t i = 0; i < layout_.columns(); ++i) {
+			row[i].data = cells[i];
+			row[i].size = lengths[i];
+		}
+	}
+
+	bool before(const Row &a, const Row &b) const {
+		for (size_t k = 0; k < merge_.order.size(); ++k) {
+			uint32_t column = merge_.order[k].first - 1;
+			if (column >= layout_.columns())
+				continue;
+			int c = compareCells(a[column], b[column], arithmetic_[column]);
+			if (c != 0)
+				return merge_.order[k].second ? c > 0 : c < 0;
+		}
+		return false;
+	}
+
+	//every shard sorted its rows already, take the first of their heads each time
+	void interleave() {
+		size_t total = 0;
+		for (size_t p = 0; p < parts_.size(); ++p)
+			total += parts_[p]->rows();
+		if (merge_.limit > 0 && total > merge_.limit)
+			total = merge_.limit;
+		rows_.reserve(total);
+
+		//the next row of each shard, only the one consumed is read again
+		std::vector<Row> heads(parts_.size(), Row(layout_.columns()));
+		std::vector<size_t> next(parts_.size(), 0);
+		for (size_t p = 0; p < parts_.size(); ++p) {
+			if (parts_[p]->rows() > 0)
+				fill(heads[p], *parts_[p], 0);
+		}
+
+		while (rows_.size() < total) {
+			int best = -1;
+			for (size_t p = 0; p < parts_.size(); ++p) {
+				if (next[p] >= parts_[p]->rows())
+					continue;
+				if (best < 0 || before(heads[p], heads[best]))
+					best = (int) p;
+				if (merge_.order.empty())
+					break;
+			}
+			if (best < 0)
+				break;
+			rows_.push_back(heads[best]);
+			if (++next[best] < parts_[best]->rows())
+				fill(heads[best], *parts_[best], next[best]);
+		}
+	}
+
+	//rows equal in every column that is not aggregated become one, sorted afterwards
+	void fold() {
+		std::map<std::string, size_t> groups;
+		Row row(layout_.columns());
+		std::string key;
+		for (size_t p = 0; p < parts_.size(); ++p) {
+			for (size_t r = 0; r < parts_[p]->rows(); ++r) {
+				fill(row, *parts_[p], r);
+				key.clear();
+				for (uint32_t i = 0; i < layout_.columns(); ++i) {
+					if (aggregateOf(i) != ShardMerge::NONE)
+						continue;
+					if (row[i].data == NULL) {
+						key.push_back('\0');
+						continue;
+					}
+					key.push_back('\1');
+					key.append((const char *) &row[i].size, sizeof(row[i].size));
+					key.append(row[i].data, row[i].size);
+				}
+
+				std::map<std::string, size_t>::iterator it = groups.find(key);
+				if (it == groups.end()) {
+					groups.insert(std::make_pair(key, rows_.size()));
+					rows_.push_back(row);
+					continue;
+				}
+				Row &group = rows_[it->second];
+				for (uint32_t i = 0; i < layout_.columns(); ++i)
+					combine(aggregateOf(i), group[i], row[i], arithmetic_[i]);
+			}
+		}
+		if (!merge_.order.empty())
+			std::stable_sort(rows_.begin(), rows_.end(), [this](const Row &a, const Row &b) { return before(a, b); });
+	}
+
+	void combine(ShardMerge::Aggregate how, Cell &into, const Cell &value, Arithmetic arithmetic) {
+		if (how == ShardMerge::NONE || value.data == NULL)
+			return;
+		if (into.data == NULL) {
+			into = value;
+			return;
+		}
+
+		int c = compareCells(value, into, arithmetic);
+		if ((how == ShardMerge::MIN && c < 0) || (how == ShardMerge::MAX && c > 0)) {
+			into = value;
+		} else if (how == ShardMerge::SUM) {
+			//integers and DECIMAL stay exact, whatever their size
+			Decimal a, b;
+			if (arithmetic != FLOAT && parseDecimal(into, &a) && parseDecimal(value, &b)) {
+				sums_.push_back(addDecimal(a, b));
+			} else {
+				char text[64];
+				snprintf(text, sizeof(text), "%.17Lg", strtold(into.data, NULL) + strtold(value.data, NULL));
+				sums_.push_back(text);
+			}
+			into.data = sums_.back().c_str();
+			into.size = sums_.back().size();
+		}
+	}
+
+	const ResultSnapshot &layout_;
+	const ShardMerge &merge_;
+	std::vector<Arithmetic> arithmetic_;
+	std::vector<const ResultSnapshot *> parts_;
+	std::vector<Row> rows_;
+	std::deque<std::string> sums_;		//cells folded groups point into, never moved
+};
+
+/* ShardedTemplate */
+ShardedTemplate::ShardedTemplate(const ShardMap &map, ParallelExecutor *executor)
+: map_(map), executor_(executor), owned_(false) {
+	for (size_t i = 0; i < map_.shards(); ++i)
+		shards_.push_back(new MySQLTemplate(map_.source(i)));
+	if (executor_ == NULL) {
+		executor_ = new ParallelExecutor(map_.shards() > 0 ? map_.shards() : 1);
+		owned_ = true;
+	}
+}
+
+ShardedTemplate::~ShardedTemplate() {
+	if (owned_)
+		delete executor_;
+	for (std::vector<MySQLTemplate *>::iterator it = shards_.begin(); it != shards_.end(); ++it) {
+		delete *it;
+	}
+}
+
+int ShardedTemplate::scatterSQL(Callback *callback, const char *sql, const ShardMerge &merge, const ParamList *args) {
+	if (shards_.empty())
+		return 0;
+
+	std::vector<ShardResult> results(shards_.size());
+	QueryBatch batch;
+	for (size_t i = 0; i < shards_.size(); ++i)
+		batch.addOn(shards_[i], &results[i], sql, args);
+	executor_->run(*shards_[0], batch);
+
+	for (size_t i = 0; i < shards_.size(); ++i) {
+		if (batch.result(i) != 0) {
+			if (callback)
+				callback->onException(Exception(results[i].error_, "shard %s: %s", map_.source(i).c_str(), results[i].errorMsg_.c_str()));
+			return batch.result(i);
+		}
+	}
+
+	const ResultSnapshot *layout = NULL;
+	uint32_t affected_rows = 0;
+	for (size_t i = 0; i < results.size(); ++i) {
+		const ResultSnapshot *part = results[i].snapshot_.get();
+		if (part == NULL)
+			continue;
+		if (layout == NULL || (layout->fields() == NULL && part->fields() != NULL))
+			layout = part;
+		affected_rows += part->affectedRows();
+	}
+	if (layout == NULL || callback == NULL)
+		return 0;
+
+	Merger merger(*layout, merge);
+	for (size_t i = 0; i < results.size(); ++i) {
+		const ResultSnapshot *part = results[i].snapshot_.get();
+		if (part != NULL && part->columns() == layout->columns())
+			merger.add(*part);
+	}
+	ResultSet result(merger.result(affected_rows));
+	callback->onResult(result);
+	return 0;
+}
+
+}	//mysqldb
+}	//server
@@ -0,0 +1,147 @@
+#ifndef MYSQLLIB_SHARDED_TEMPLATE_H
+#define MYSQLLIB_SHARDED_TEMPLATE_H
+
+#include "MySQLTemplate.h"
+#include "ParallelExecutor.h"
+
+namespace server {
+namespace mysqldb {
+
+/*
+ * Which source a shard key lives on. Keys go to one of a fixed number of
+ * virtual buckets and every bucket names a shard, so moving a bucket to
+ * another source moves only its keys.
+ *
+ * A hash map spreads keys over the buckets by a hash that is the same in
+ * every process: integers and text hash differently, 5 is not "5". A range
+ * map makes bucket i the integer keys from bounds[i] up to bounds[i + 1],
+ * keys below bounds[0] fall into bucket 0; other keys are hashed onto the
+ * ranges.
+ */
+class ShardMap {
+public:
+	//buckets handed to sources round robin
+	explicit ShardMap(const std::vector<std::string> &sources, unsigned int buckets = 1024);
+
+	//range i on sources[i % sources.size()], bounds ascending
+	ShardMap(const std::vector<std::string> &sources, const std::vector<int64_t> &bounds);
+
+	inline size_t shards() const { return sources_.size(); }
+
+	inline const std::string &source(size_t shard) const { return sources_[shard]; }
+
+	inline size_t buckets() const { return table_.size(); }
+
+	//move bucket to shard
+	void assign(unsigned int bucket, size_t shard);
+
+	unsigned int bucketOf(const Parameter &key) const;
+
+	inline size_t shardOf(const Parameter &key) const { return table_[bucketOf(key)]; }
+
+private:
+	std::vector<std::string> sources_;
+	std::vector<int64_t> bounds_;		//empty for a hash map
+	std::vector<size_t> table_;			//shard of each bucket
+};	//ShardMap
+
+/*
+ * How scatter() combines the results of the shards into one. Without
+ * anything set the rows of shard 0 come first, then those of shard 1 and
+ * so on. orderBy() merges rows each shard returned sorted the same way.
+ * Aggregate columns fold rows with equal values in all other columns into
+ * one, as GROUP BY does: COUNT is summed like SUM, AVG cannot be combined,
+ * select SUM and COUNT instead. Integer and DECIMAL columns are summed and
+ * compared exactly, FLOAT and DOUBLE as long double. Columns are numbered
+ * from 1.
+ */
+struct ShardMerge {
+	enum Aggregate {
+		NONE	= 0,
+		SUM		= 1,	//COUNT too
+		MIN		= 2,
+		MAX		= 3,
+	};
+
+	ShardMerge(): limit(0) {}
+
+	ShardMerge &orderBy(int column, bool descending = false) {
+		order.push_back(std::make_pair(column, descending));
+		return *this;
+	}
+
+	ShardMerge &aggregate(int column, Aggregate how) {
+		//no column 0 or below, ignored
+		if (column <= 0)
+			return *this;
+		if ((int) aggregates.size() < column)
+			aggregates.resize(column, NONE);
+		aggregates[column - 1] = how;
+		return *this;
+	}
+
+	ShardMerge &setLimit(size_t rows) {
+		limit = rows;
+		return *this;
+	}
+
+	std::vector<std::pair<int, bool> > order;
+	std::vector<Aggregate> aggregates;
+	size_t limit;			//rows kept after merging, 0: all
+};	//ShardMerge
+
+/*
+ * One MySQLTemplate per shard of a ShardMap. Statements about one key run
+ * on the template forKey() returns, those about all keys go to every shard
+ * at once through scatter() and reach the callback as a single result.
+ */
+class ShardedTemplate {
+public:
+	//scatter() runs on executor, or on threads of its own, one per shard
+	explicit ShardedTemplate(const ShardMap &map, ParallelExecutor *executor = NULL);
+
+	virtual ~ShardedTemplate();
+
+	inline const ShardMap &map() const { return map_; }
+
+	inline size_t shards() const { return shards_.size(); }
+
+	inline MySQLTemplate &shard(size_t index) { return *shards_[index]; }
+
+	template<typename K>
+	MySQLTemplate &forKey(const K &key) {
+		return *shards_[map_.shardOf(Parameter(key))];
+	}
+
+	/*
+	 * sql on every shard in parallel, the results combined as merge says
+	 * into one onResult. If a shard fails the callback gets its error
+	 * instead and no result; the code is that of the first failed shard.
+	 */
+	template<typename... Args>
+	int scatter(Callback *callback, const char *sql, const ShardMerge &merge, const Args &... args) {
+		if constexpr (sizeof...(Args) == 0) {
+			return scatterSQL(callback, sql, merge, NULL);
+		} else {
+			const Parameter param[] = { Parameter(args)... };
+			ParamList list(param, sizeof...(Args));
+			return scatterSQL(callback, sql, merge, &list);
+		}
+	}
+
+	int scatterSQL(Callback *callback, const char *sql, const ShardMerge &merge, const ParamList *args);
+
+private:
+	ShardedTemplate(const ShardedTemplate &);
+	ShardedTemplate &operator =(const ShardedTemplate &);
+
+	ShardMap map_;
+	std::vector<MySQLTemplate *> shards_;
+	ParallelExecutor *executor_;
+	bool owned_;
+};	//ShardedTemplate
+
+}	//mysqldb
+}	//server
+
+#endif	//MYSQLLIB_SHARDED_TEMPLATE_H
@@ -0,0 +1,67 @@
+#include "SingleFlight.h"
+#include <exception>
+
+namespace server {
+namespace mysqldb {
+
+/* SingleFlight */
+SingleFlight::SingleFlight(): started_(0), joined_(0) {
+	pthread_mutex_init(&lock_, NULL);
+}
+
+SingleFlight::~SingleFlight() {
+	pthread_mutex_destroy(&lock_);
+}
+
+void SingleFlight::execute(const std::string &key, const Fill &fill, Outcome *out) {
+	pthread_mutex_lock(&lock_);
+	FLIGHT_MAP::iterator it = flights_.find(key);
+	if (it != flights_.end()) {
+		boost::shared_ptr<Flight> flight = it->second;
+		++joined_;
+		while (!flight->done)
+			pthread_cond_wait(&flight->cond, &lock_);
+		*out = flight->outcome;
+		pthread_mutex_unlock(&lock_);
+		out->shared = true;
+		return;
+	}
+
+	boost::shared_ptr<Flight> flight(new Flight);
+	flights_[key] = flight;
+	++started_;
+	pthread_mutex_unlock(&lock_);
+
+	std::exception_ptr failure;
+	try {
+		fill(out);
+	} catch (...) {
+		//waiters must not hang on a fill that threw, the caller gets it
+		failure = std::current_exception();
+		out->code = -1;
+		out->error = -1;
+		out->message = "shared statement failed";
+		out->result.reset();
+	}
+	out->shared = false;
+
+	pthread_mutex_lock(&lock_);
+	flight->outcome = *out;
+	flight->done = true;
+	flights_.erase(key);
+	pthread_cond_broadcast(&flight->cond);
+	pthread_mutex_unlock(&lock_);
+
+	if (failure)
+		std::rethrow_exception(failure);
+}
+
+SingleFlight::Stats SingleFlight::stats() const {
+	Stats stats;
+	stats.flights = started_;
+	stats.joined = joined_;
+	return stats;
+}
+
+}	//mysqldb
+}	//server
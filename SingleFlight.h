@@ -0,0 +1,73 @@
+#ifndef MYSQLLIB_SINGLE_FLIGHT_H
+#define MYSQLLIB_SINGLE_FLIGHT_H
+
+#include "MySQLDriver.h"
+#include "singleton.h"
+#include <pthread.h>
+#include <atomic>
+#include <functional>
+
+namespace server {
+namespace mysqldb {
+
+/*
+ * Collapses identical reads running at the same time into one. The first
+ * caller for a key runs the statement, callers arriving while it is in
+ * flight wait for it and share its result snapshot. A key is forgotten as
+ * soon as its statement finished, later callers run it again.
+ */
+class SingleFlight {
+public:
+	struct Outcome {
+		Outcome(): code(0), error(0), shared(false) {}
+
+		int code;				//what execute() returns, 0 on success
+		int error;				//code of the exception the callback got
+		std::string message;
+		ResultSnapshotPtr result;
+		bool shared;			//true for callers that waited for another one
+	};
+
+	struct Stats {
+		uint64_t flights;		//statements actually run
+		uint64_t joined;		//callers served by a flight of someone else
+	};
+
+	typedef std::function<void(Outcome *out)> Fill;
+
+	SingleFlight();
+
+	virtual ~SingleFlight();
+
+	//run fill for key unless it is already running, in both cases *out gets its outcome
+	void execute(const std::string &key, const Fill &fill, Outcome *out);
+
+	Stats stats() const;
+
+private:
+	struct Flight {
+		Flight(): done(false) { pthread_cond_init(&cond, NULL); }
+
+		~Flight() { pthread_cond_destroy(&cond); }
+
+		pthread_cond_t cond;
+		bool done;
+		Outcome outcome;
+	};
+
+	SingleFlight(const SingleFlight &);
+	SingleFlight &operator =(const SingleFlight &);
+
+	typedef std::map<std::string, boost::shared_ptr<Flight> > FLIGHT_MAP;
+	FLIGHT_MAP flights_;
+	pthread_mutex_t lock_;
+	std::atomic<uint64_t> started_;
+	std::atomic<uint64_t> joined_;
+};	//SingleFlight
+
+typedef singleton_default<SingleFlight> SINGLE_FLIGHT;
+
+}	//mysqldb
+}	//server
+
+#endif	//MYSQLLIB_SINGLE_FLIGHT_H
@@ -11,14 +11,13 @@ using namespace server::mysqldb;
 void
 sample(MySQLTemplate& template_)
 {
-    SingleResultSet cb;
+    long long total = 0;
     const char * sql = "select count(*) from emp";
-    if(template_.execute(&cb, sql)) {
-         printf("Fail to execute sql: %s errcode: %d errmsg:%s\n",
-                sql, cb.error_, cb.errorMsg_.data());
+    if(int err = template_.query(total, sql)) {
+         printf("Fail to execute sql: %s errcode: %d\n", sql, err);
          return;
     } 
-    printf("employ total: %s\n", cb.result_[0].data());
+    printf("employ total: %lld\n", total);
 }
 
 void
@@ -41,37 +40,26 @@ sample1(MySQLTemplate& template_)
 struct Emp {
     int id;
     string name;
+
+    static auto columns() {
+        return std::make_tuple(mapColumn("id", &Emp::id), mapColumn("name", &Emp::name));
+    }
 };
 
 void
 sample2(MySQLTemplate& template_)
 {
-    struct MyCustomCallBack : public NOPCallback
-    {
-        void onResult(ResultSet &result)
-        {
-            while (result.next())
-            {
-                Emp* emp = new(Emp);
-                emp->id = result.getInt(1);
-                emp->name = result.getString(2);
-                emp_list.push_back(emp);
-            }
-        }
-        vector<Emp*> emp_list ;
-    } cb;
-    
+    vector<Emp> emp_list;
     const char *sql = "select id, name from emp";
-    if(template_.execute(&cb, sql)) {
-        printf("Fail to execute sql: %s errcode: %d errmsg:%s\n",
-                sql, cb.error_, cb.errorMsg_.data());
+    if(int err = template_.query(emp_list, sql)) {
+        printf("Fail to execute sql: %s errcode: %d\n", sql, err);
         return;
     }
-    printf("employ total: %d\n", cb.emp_list.size());
-    for(vector<Emp*>::iterator it = cb.emp_list.begin();
-        it!=cb.emp_list.end();
+    printf("employ total: %zu\n", emp_list.size());
+    for(vector<Emp>::iterator it = emp_list.begin();
+        it!=emp_list.end();
         ++it) {
-         printf("%d\t%s\n", (*it)->id, (*it)->name.data());
+         printf("%d\t%s\n", it->id, it->name.data());
     }
 }
 
@@ -129,6 +117,8 @@ main()
     cfg.read_timeout = 3;
     cfg.maxconns = 10;
     cfg.autocommit = 1;
+    cfg.breaker_failures = 3;
+    cfg.reconnect_rate = 10;
     server::mysqldb::MYSQL_FACTORY::instance().addSource("testdb", cfg);
     MySQLTemplate template_("testdb");   
     pthread_t th;